@@ -182,10 +182,12 @@ Client broadcasts /dy (discovery) to all, including server. This
     either to the discovery port or to the UDP port.
 Server sends /dy (discovery) to client's discovery or UDP port.
 Client receives /dy and replies with:
-    Client connect()'s to server, creating TCP socket.
-    The server status is set to PROCESS_CONNECTED
+    Client connect()'s to server, creating TCP socket. The connect
+        call does not block: the server status is PROCESS_CONNECTING
+        until the socket becomes writable, then PROCESS_CONNECTED.
     Client sends /in (initialization) to server using the TCP socket.
     Client sends /sv (services) to server using the TCP socket.
+        (While connecting, these messages are queued in proc.pending.)
     Locally, the client creates a service named "IP:port" representing
         the server so that if another /dy message arrives, the client
         will not make another connection.
@@ -257,6 +259,20 @@ Some message flows are:
                              <--/dy for other, NO_HUB---
         (messages to other are handled in the same way)
 
+Scalable hubs (see o2_set_scalable_hub()) do not send /dy to clients.
+Instead, the hub keeps the list of its clients. When a client's /in
+arrives, the hub sends it the list in /hd (hub directory) messages,
+and in the next o2_poll() it sends one /hd message listing all new
+clients to every client. /hd also announces clients that disconnect.
+Clients record the processes listed in /hd as known but not connected,
+just as lazy mode does, and exchange /lz messages with them by UDP:
+    client A (old)           client B (new)              hub
+                             <--/hd listing A joined-----
+        <--/lz, REPLY--------
+        ---/lz, INFO-------->
+        <--/hd listing B joined (next poll)--------------
+    (A and B connect only when one sends a TCP message to the other)
+
 Services and Processes
 ----------------------
 A process includes a list of services (strings). Each 
@@ -349,6 +365,8 @@ to host byte order if necessary.
 #include "o2_send.h"
 #include "o2_sched.h"
 #include "o2_clock.h"
+#include "o2_interoperation.h"
+#include "o2_trace.h"
 
 #ifndef WIN32
 #include <sys/time.h>
@@ -450,6 +468,10 @@ void *o2_calloc(size_t n, size_t s)
 #endif
 
 
+static void o2_stats_handler(o2_msg_data_ptr msg, const char *types,
+                             o2_arg_ptr *argv, int argc, void *user_data);
+
+
 int o2_initialize(const char *application_name)
 {
     int err;
@@ -475,16 +497,27 @@ int o2_initialize(const char *application_name)
     
     o2_service_new("_o2");
     o2_method_new("/_o2/dy", "issii", &o2_discovery_handler, NULL, FALSE, FALSE);
+    o2_method_new("/_o2/lz", NULL, &o2_lazy_handler, NULL, FALSE, FALSE);
+    o2_method_new("/_o2/hd", NULL, &o2_hub_directory_handler, NULL,
+                  FALSE, FALSE);
     // "/sv/" service messages are sent by tcp as ordinary O2 messages, so they
     // are addressed by full name (IP:PORT). We cannot call them /_o2/sv:
     char address[32];
     o2_service_new(o2_process->proc.name);
     snprintf(address, 32, "/%s/sv", o2_process->proc.name);
     o2_method_new(address, NULL, &o2_services_handler, NULL, FALSE, FALSE);
+    snprintf(address, 32, "/%s/sr", o2_process->proc.name);
+    o2_method_new(address, "s", &o2_services_request_handler, NULL,
+                  FALSE, FALSE);
     snprintf(address, 32, "/%s/cs/cs", o2_process->proc.name);
     o2_method_new(address, "s", &o2_clocksynced_handler, NULL, FALSE, FALSE);
     snprintf(address, 32, "/%s/cs/rt", o2_process->proc.name);
     o2_method_new(address, "s", &o2_clockrt_handler, NULL, FALSE, FALSE);
+    snprintf(address, 32, "/%s/cs/get", o2_process->proc.name);
+    o2_method_new(address, "is", &o2_cs_ping_handler, NULL, FALSE, FALSE);
+    snprintf(address, 32, "/%s/stats", o2_process->proc.name);
+    o2_method_new(address, "s", &o2_stats_handler, NULL, FALSE, FALSE);
+    o2_method_new("/_o2/stats", "s", &o2_stats_handler, NULL, FALSE, FALSE);
     o2_method_new("/_o2/ds", NULL, &o2_discovery_send_handler,
                   NULL, FALSE, FALSE);
     o2_time_initialize();
@@ -526,6 +559,14 @@ o2_time o2_set_discovery_period(o2_time period)
 }
 
 
+int o2_set_lazy_connect(int lazy)
+{
+    int old = o2_lazy_connect;
+    o2_lazy_connect = lazy;
+    return old;
+}
+
+
 int o2_hub(const char *ipaddress, int port)
 {
     char name[32]; // ip:port padded with zeros
@@ -564,29 +605,109 @@ int o2_get_address(const char **ipaddress, int *port)
 }
 
 
+// Changes to local services are batched: o2_notify_others() records each
+// change, replacing any earlier change to the same service, and
+// o2_flush_service_changes() sends the whole batch to every other process
+// in one /sv message tagged with the new version of our service table.
+typedef struct service_change {
+    o2string name;   // owned copy of the service name
+    int added;
+    int created;     // the first change in this batch added the service
+    o2string tappee; // owned copy, "" if not a tapper
+} service_change, *service_change_ptr;
+
+static dyn_array service_changes; // the batch of service_change structs
+int32_t o2_services_seq = 0; // version of the local service table
+
+
 /** notify all known processes that a service has been added or
  * deleted. If adding a service and tappee is not empty or null,
  * then the new service is tapping another service (the tappee).
+ * The notification is sent by o2_flush_service_changes().
  */
 void o2_notify_others(const char *service_name, int added,
                       const char *tappee)
 {
     if (!tappee) tappee = ""; // Make sure we have a string to send.
-    // when we add or remove a service, we must tell all other
-    // processes about it. To find all other processes, use the o2_fds_info
-    // table since all but a few of the entries are connections to processes
+    service_change_ptr change;
+    for (int i = 0; i < service_changes.length; i++) {
+        change = DA_GET(service_changes, service_change, i);
+        if (streql(change->name, service_name)) { // last change wins
+            O2_FREE((void *) change->tappee);
+            if (change->created && !added) { // others never knew about it
+                O2_FREE((void *) change->name);
+                DA_REMOVE(service_changes, service_change, i);
+                return;
+            }
+            change->added = added;
+            change->tappee = o2_heapify(tappee);
+            return;
+        }
+    }
+    DA_EXPAND(service_changes, service_change);
+    change = DA_LAST(service_changes, service_change);
+    change->name = o2_heapify(service_name);
+    change->added = added;
+    change->created = added;
+    change->tappee = o2_heapify(tappee);
+}
+
+
+// send a /sv message with the changes in batch to process info
+static void send_service_changes(process_info_ptr info, dyn_array_ptr batch)
+{
+    o2_send_start();
+    o2_add_string(o2_process->proc.name);
+    o2_add_int32(o2_services_seq);
+    o2_add_bool(FALSE); // not a complete list
+    for (int i = 0; i < batch->length; i++) {
+        service_change_ptr change = DA_GET(*batch, service_change, i);
+        o2_add_string(change->name);
+        o2_add_bool(change->added);
+        o2_add_string(change->tappee);
+        O2_DBd(printf("%s o2_flush_service_changes sending %s to %s (%s) "
+                      "tappee %s\n", o2_debug_prefix, change->name,
+                      info->proc.name, change->added ? "added" : "removed",
+                      change->tappee));
+    }
+    char address[32];
+    snprintf(address, 32, "!%s/sv", info->proc.name);
+    // processes that are known but not connected are told by UDP
+    o2_send_finish(0.0, address, info->fds_index != -1);
+}
+
+
+/** send batched service changes, if any, to all other processes.
+ * This is called by o2_poll() and before sending to another process so
+ * that the receiver will know about any service we tell it about.
+ */
+void o2_flush_service_changes()
+{
+    if (service_changes.length == 0) return;
+    // take the batch so that sending cannot reenter with the same changes
+    dyn_array batch = service_changes;
+    DA_INIT(service_changes, service_change, 0);
+    o2_services_seq++;
+    // To find all other processes, use the o2_fds_info table since all
+    // but a few of the entries are connections to processes
     for (int i = 0; i < o2_fds_info.length; i++) {
         process_info_ptr info = GET_PROCESS(i);
-        if (info->tag == TCP_SOCKET) {
-            char address[32];
-            snprintf(address, 32, "!%s/sv", info->proc.name);
-            o2_send_cmd(address, 0.0, "ssBs", o2_process->proc.name,
-                        service_name, added, tappee);
-            O2_DBd(printf("%s o2_notify_others sent %s to %s (%s) tappee %s\n",
-                          o2_debug_prefix, service_name, info->proc.name, 
-                          added ? "added" : "removed", tappee));
+        // processes without a name have not sent /in yet; they will get
+        // the complete list of services when they do
+        if (info->tag == TCP_SOCKET && info->proc.name && !info->delete_me) {
+            send_service_changes(info, &batch);
         }
     }
+    for (int i = 0; i < o2_lazy_procs.length; i++) {
+        send_service_changes(*DA_GET(o2_lazy_procs, process_info_ptr, i),
+                             &batch);
+    }
+    for (int i = 0; i < batch.length; i++) {
+        service_change_ptr change = DA_GET(batch, service_change, i);
+        O2_FREE((void *) change->name);
+        O2_FREE((void *) change->tappee);
+    }
+    DA_FINISH(batch);
 }
 
 
@@ -753,7 +874,11 @@ int o2_poll()
     }
     o2_sched_poll(); // deal with the timestamped message
     o2_recv(); // receive and dispatch messages
+    o2_connect_poll(); // time out or start TCP connections
     o2_deliver_pending();
+    o2_osc_flush(); // OSC sent over TCP since the last poll
+    o2_flush_service_changes(); // changes made by handlers in this poll
+    o2_hub_flush_events(); // processes that joined or left our hub
     return O2_SUCCESS;
 }
 
@@ -828,6 +953,182 @@ int o2_status(const char *service)
 }
 
 
+// kind reported for a socket by o2_stats_get(): the internal tags in
+// o2_socket.h are not part of the API
+static int socket_stats_kind(process_info_ptr info)
+{
+    switch (info->tag) {
+        case UDP_SOCKET: return O2_STATS_SOCKET_UDP;
+        case TCP_SOCKET: return O2_STATS_SOCKET_TCP;
+        case OSC_SOCKET: return O2_STATS_SOCKET_OSC_UDP;
+        case DISCOVER_SOCKET: return O2_STATS_SOCKET_DISCOVERY;
+        case TCP_SERVER_SOCKET: return O2_STATS_SOCKET_TCP_SERVER;
+        case OSC_TCP_SERVER_SOCKET: return O2_STATS_SOCKET_OSC_TCP_SERVER;
+        case OSC_TCP_SOCKET: return O2_STATS_SOCKET_OSC_TCP;
+        case OSC_TCP_CLIENT: return O2_STATS_SOCKET_OSC_TCP_CLIENT;
+    }
+    assert(FALSE); // every socket has one of these tags
+    return -1;
+}
+
+
+// name reported for a socket by o2_stats_get()
+static const char *socket_stats_name(process_info_ptr info)
+{
+    const char *name = NULL;
+    switch (info->tag) {
+        case TCP_SOCKET:
+        case TCP_SERVER_SOCKET:
+            name = info->proc.name;
+            break;
+        case OSC_SOCKET:
+        case OSC_TCP_SERVER_SOCKET:
+        case OSC_TCP_SOCKET:
+        case OSC_TCP_CLIENT:
+            name = info->osc.service_name;
+            break;
+    }
+    return name ? name : "";
+}
+
+
+int o2_stats_get(o2_stats_ptr stats)
+{
+    memset(stats, 0, sizeof(o2_stats));
+    if (!o2_application_name) {
+        return O2_NOT_INITIALIZED;
+    }
+    stats->dropped_no_service = o2_dropped_no_service;
+    stats->dropped_queue_full = o2_dropped_queue_full;
+    stats->pending = o2_pending_length();
+    int i;
+    for (i = 0; i < O2_SCHED_TABLE_LEN; i++) {
+        o2_message_ptr msg;
+        for (msg = o2_ltsched.table[i]; msg; msg = msg->next) {
+            stats->scheduled++;
+        }
+        if (o2_gtsched_started) {
+            for (msg = o2_gtsched.table[i]; msg; msg = msg->next) {
+                stats->scheduled++;
+            }
+        }
+    }
+    stats->pool_size = o2_message_pool_size;
+    o2_message_ptr msg;
+    for (msg = message_freelist; msg; msg = msg->next) {
+        stats->pool_free++;
+    }
+
+    stats->sockets = (o2_socket_stats_ptr)
+            O2_CALLOC(o2_fds_info.length + 1, sizeof(o2_socket_stats));
+    if (!stats->sockets) return O2_NO_MEMORY;
+    for (i = 0; i < o2_fds_info.length; i++) {
+        process_info_ptr info = GET_PROCESS(i);
+        o2_socket_stats_ptr ss = &stats->sockets[stats->socket_count++];
+        ss->tag = socket_stats_kind(info);
+        ss->name = o2_heapify(socket_stats_name(info));
+        ss->msgs_in = info->msgs_in;
+        ss->bytes_in = info->bytes_in;
+        ss->msgs_out = info->msgs_out;
+        ss->bytes_out = info->bytes_out;
+        ss->partial_reads = info->partial_reads;
+        ss->send_errors = info->send_errors;
+    }
+
+    enumerate enumerator;
+    services_entry_ptr services;
+    int allocated = 0;
+    o2_enumerate_begin(&enumerator, &o2_path_tree.children);
+    while ((services = (services_entry_ptr) o2_enumerate_next(&enumerator))) {
+        if (services->tag != SERVICES) continue;
+        if (stats->service_count == allocated) {
+            allocated = allocated * 2 + 16;
+            o2_service_stats_ptr bigger = (o2_service_stats_ptr)
+                    O2_MALLOC(allocated * sizeof(o2_service_stats));
+            if (!bigger) return O2_NO_MEMORY;
+            if (stats->services) {
+                memcpy(bigger, stats->services,
+                       stats->service_count * sizeof(o2_service_stats));
+                O2_FREE(stats->services);
+            }
+            stats->services = bigger;
+        }
+        o2_service_stats_ptr ss = &stats->services[stats->service_count++];
+        ss->name = o2_heapify(services->key);
+        ss->delivered = services->delivered;
+        ss->tapped = services->tapped;
+    }
+    return O2_SUCCESS;
+}
+
+
+void o2_stats_free(o2_stats_ptr stats)
+{
+    int i;
+    for (i = 0; i < stats->socket_count; i++) {
+        O2_FREE((void *) stats->sockets[i].name);
+    }
+    for (i = 0; i < stats->service_count; i++) {
+        O2_FREE((void *) stats->services[i].name);
+    }
+    if (stats->sockets) O2_FREE(stats->sockets);
+    if (stats->services) O2_FREE(stats->services);
+    stats->sockets = NULL;
+    stats->services = NULL;
+    stats->socket_count = 0;
+    stats->service_count = 0;
+}
+
+
+// handler for /_o2/stats and !ip:port/stats: reply with o2_stats_get()
+// counters to the address prefix in the message (see o2.h)
+//
+static void o2_stats_handler(o2_msg_data_ptr msg, const char *types,
+                             o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_extract_start(msg);
+    o2_arg_ptr reply_to_arg = o2_get_next('s');
+    if (!reply_to_arg) return;
+    char *replyto = reply_to_arg->s;
+    int len = (int) strlen(replyto);
+    if (len > 1000) {
+        fprintf(stderr, "o2_stats_handler ignoring /stats message with "
+                "long reply_to argument\n");
+        return; // address too long - ignore it
+    }
+    o2_stats stats;
+    if (o2_stats_get(&stats) != O2_SUCCESS) {
+        o2_stats_free(&stats);
+        return;
+    }
+    const char *name = o2_process->proc.name;
+    char address[1024];
+    memcpy(address, replyto, len);
+    strcpy(address + len, "/global");
+    o2_send_cmd(address, 0, "shhiiii", name, stats.dropped_no_service,
+                stats.dropped_queue_full, stats.pending, stats.scheduled,
+                stats.pool_size, stats.pool_free);
+    int i;
+    strcpy(address + len, "/socket");
+    for (i = 0; i < stats.socket_count; i++) {
+        o2_socket_stats_ptr ss = &stats.sockets[i];
+        o2_send_cmd(address, 0, "sishhhhhh", name, ss->tag, ss->name,
+                    ss->msgs_in, ss->bytes_in, ss->msgs_out, ss->bytes_out,
+                    ss->partial_reads, ss->send_errors);
+    }
+    strcpy(address + len, "/service");
+    for (i = 0; i < stats.service_count; i++) {
+        o2_service_stats_ptr ss = &stats.services[i];
+        o2_send_cmd(address, 0, "sshh", name, ss->name, ss->delivered,
+                    ss->tapped);
+    }
+    strcpy(address + len, "/end");
+    o2_send_cmd(address, 0, "si", name,
+                stats.socket_count + stats.service_count);
+    o2_stats_free(&stats);
+}
+
+
 #ifdef WIN32
 int gettimeofday(struct timeval * tp, struct timezone * tzp)
 {
@@ -894,6 +1195,8 @@ int o2_finish()
     for (int i = 0 ; i < o2_fds.length; i++) {
         o2_remove_remote_process(GET_PROCESS(i));
     }
+    o2_lazy_finish(); // frees processes that were never connected
+    o2_flush_service_changes(); // there is no one left, so this just frees
     o2_free_deleted_sockets(); // deletes process_info structs
 
     DA_FINISH(o2_fds);
@@ -906,7 +1209,11 @@ int o2_finish()
     o2_sched_finish(&o2_gtsched);
     o2_sched_finish(&o2_ltsched);
     o2_discovery_finish();
+    o2_service_policy_finish();
     o2_clock_finish();
+#ifdef O2_TRACE
+    o2_trace_finish();
+#endif
 
     if (o2_application_name) O2_FREE((void *) o2_application_name);
     o2_application_name = NULL;
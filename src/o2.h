@@ -698,6 +698,131 @@ int o2_memory(void *((*malloc)(size_t size)), void ((*free)(void *)));
 o2_time o2_set_discovery_period(o2_time period);
 
 
+/**
+ * \brief Make TCP connections only when they are needed.
+ *
+ * Normally, every pair of discovered processes is connected by TCP,
+ * so an application with N processes uses N*(N-1)/2 connections even
+ * if most pairs never exchange a message. In lazy mode, a process
+ * that receives a discovery message from an unknown process replies
+ * (by UDP) with its address and its list of services, so both
+ * processes learn about each other's services without connecting.
+ * UDP messages (o2_send()) are sent directly. The TCP connection is
+ * made when the first message is sent with o2_send_cmd() to a service
+ * offered by the other process. Such messages are queued until the
+ * connection is made. At most 64 messages are queued for each process;
+ * further messages are dropped and counted in the dropped_queue_full
+ * field of #o2_stats. If the process neither connects nor replies
+ * within the connection timeout (see o2_set_connect_limits()), it is
+ * forgotten, with its queued messages, until it is discovered again.
+ * Changes to the list of services offered by an unconnected process
+ * are announced by UDP.
+ *
+ * Lazy mode applies to processes found by broadcast discovery or through
+ * a scalable hub (see o2_set_scalable_hub()). Processes found through
+ * other hubs (see o2_hub()) are connected as usual. Lazy and
+ * non-lazy processes can be mixed in one application. This function
+ * should be called before discovery starts, i.e. immediately after
+ * o2_initialize().
+ *
+ * @param lazy TRUE to make connections on demand, FALSE to connect to
+ *             every discovered process (the default)
+ *
+ * @return the previous setting
+ */
+int o2_set_lazy_connect(int lazy);
+
+
+/**
+ * \brief Limit the time and number of TCP connection attempts.
+ *
+ * Connections to discovered processes are made without blocking, so
+ * a process that does not respond (e.g. because of a firewall) cannot
+ * stall o2_poll(). Messages sent to a process while it is being
+ * connected are queued and sent when the connection is made. An
+ * attempt that does not succeed within the timeout is abandoned, and
+ * the process is forgotten until it is discovered again. To avoid
+ * bursts of connection attempts when many processes are discovered at
+ * once, only a limited number of connections are attempted at a time,
+ * and others wait their turn.
+ *
+ * (On Windows, connections are still made by blocking calls.)
+ *
+ * @param timeout the maximum time allowed to connect, or 0 for the
+ *                default (2s)
+ * @param max_connecting the maximum number of connections in progress,
+ *                or 0 for the default (8)
+ *
+ * @return #O2_SUCCESS
+ */
+int o2_set_connect_limits(o2_time timeout, int max_connecting);
+
+
+/** \brief default multicast group for o2_discovery_multicast() */
+#define O2_MULTICAST_GROUP "239.255.79.50"
+/** \brief default multicast port for o2_discovery_multicast() */
+#define O2_MULTICAST_PORT 64540
+
+/**
+ * \brief Use IP multicast for discovery.
+ *
+ * Normally, discovery messages are broadcast to 255.255.255.255 (and
+ * sent separately to localhost), cycling through a list of 16 port
+ * numbers. A process only receives the messages sent to its own port,
+ * so it can take several seconds to discover all other processes.
+ * After calling this function, discovery messages are sent to a single
+ * multicast group and port that every process joins, so each process
+ * receives every discovery message. Multicast loopback is enabled so
+ * that processes on the same host discover each other, and the
+ * time-to-live is 1, so messages stay on the local network.
+ *
+ * Replies are sent to the UDP port of the process, which is unique,
+ * rather than to the shared multicast port. Call this function after
+ * o2_initialize(). All processes in the application should use the
+ * same discovery method, although a process using multicast will
+ * still answer broadcast discovery messages.
+ *
+ * @param group the multicast group address, or NULL for
+ *              #O2_MULTICAST_GROUP
+ * @param port the multicast port number, or 0 for #O2_MULTICAST_PORT
+ *
+ * @return #O2_SUCCESS if success, #O2_NOT_INITIALIZED if O2 is not
+ *         initialized, #O2_ALREADY_RUNNING if multicast discovery is
+ *         already in use, or #O2_FAIL if the socket could not be
+ *         created or the group could not be joined.
+ */
+int o2_discovery_multicast(const char *group, int port);
+
+
+/**
+ * \brief Remember recently connected processes in a file.
+ *
+ * Discovery messages are sent at short intervals at first, but the
+ * interval grows toward the discovery period (see
+ * o2_set_discovery_period()), so a process that restarts can take
+ * seconds to find processes that have not moved. With a peer cache, the
+ * address (IP address, TCP port and UDP port) and application name of
+ * each process are recorded when the process connects (or, in lazy
+ * mode, when it becomes known). Changes are written to the file at most
+ * once per discovery period and when O2 finishes. This function reads
+ * the file and immediately contacts every process of this application
+ * that it lists, as if it had just been discovered. Normal discovery
+ * continues in parallel, so out-of-date entries do no harm, and a
+ * process that refuses a connection is removed from the file. At most
+ * 64 processes are remembered.
+ *
+ * Call this function after o2_initialize() (and after
+ * o2_set_lazy_connect() if you use lazy mode). The file is created if it
+ * does not exist. Several applications may share one file.
+ *
+ * @param filename the cache file, or NULL to stop using a cache
+ *
+ * @return #O2_SUCCESS if success, or #O2_NOT_INITIALIZED if O2 is not
+ *         initialized.
+ */
+int o2_set_peer_cache(const char *filename);
+
+
 /**
  * \brief Connect to a hub.
  *
@@ -736,6 +861,32 @@ o2_time o2_set_discovery_period(o2_time period);
 int o2_hub(const char *ipaddress, int port);
 
 
+/**
+ * \brief Make this process a hub that scales to many clients.
+ *
+ * A hub normally sends each new client a discovery message for every
+ * process it knows, and each client connects to every other process,
+ * so the work grows with the square of the number of processes. A
+ * scalable hub keeps a directory of its clients (the processes that
+ * called o2_hub() with its address). A new client gets the directory
+ * in a few messages, each describing up to 64 processes. Then, once
+ * per o2_poll(), the hub sends every client a single message listing
+ * the clients that joined or left. Clients treat the processes in the
+ * directory as known but not connected: they exchange addresses and
+ * services by UDP and connect only when they send a TCP message to one
+ * another, as in lazy mode (see o2_set_lazy_connect()).
+ *
+ * Call this function in the hub process before clients connect. Clients
+ * need no special setup.
+ *
+ * @param scalable TRUE to keep a directory and send it to clients,
+ *                 FALSE (the default) to send discovery messages
+ *
+ * @return the previous setting
+ */
+int o2_set_scalable_hub(int scalable);
+
+
 /**
  * \brief Get IP address and TCP connection port number.
  *
@@ -784,7 +935,9 @@ int o2_get_address(const char **ipaddress, int *port);
  * intervening time (typically a fraction of a second) during which a
  * service is handled by two different processes. Furthermore, the switch
  * to a new service provider could redirect a stream of messages, causing
- * unexpected behavior in the application.
+ * unexpected behavior in the application. Alternatively, a service
+ * may deliberately have several providers that share the load; see
+ * #o2_service_policy.
  *
  *  @param service_name the name of the service
  *
@@ -808,6 +961,55 @@ int o2_service_new(const char *service_name);
  */
 int o2_tap(const char *tappee, const char *tapper);
 
+
+/** \brief Send each message to the first (highest IP:port) provider. */
+#define O2_POLICY_FIRST 0
+/** \brief Send each message to the next provider in turn. */
+#define O2_POLICY_ROUND_ROBIN 1
+/** \brief Send each message to the provider with the fewest queued bytes. */
+#define O2_POLICY_LEAST_QUEUED 2
+/** \brief Choose a provider by hashing an argument of the message. */
+#define O2_POLICY_HASH_ARG 3
+/** \brief Choose a provider by hashing a node of the message address. */
+#define O2_POLICY_HASH_PATH 4
+
+/**
+ * \brief choose how messages are distributed among service providers
+ *
+ * @param service the service name
+ *
+ * @param policy one of #O2_POLICY_FIRST, #O2_POLICY_ROUND_ROBIN,
+ *               #O2_POLICY_LEAST_QUEUED, #O2_POLICY_HASH_ARG or
+ *               #O2_POLICY_HASH_PATH
+ *
+ * @param param for #O2_POLICY_HASH_ARG, the index (from 0) of the
+ *              message argument to hash; for #O2_POLICY_HASH_PATH,
+ *              the index of the address node following the service
+ *              name, e.g. 0 selects "left" in "/synth/left/freq".
+ *              Otherwise, ignored.
+ *
+ * @return #O2_SUCCESS if success, #O2_NOT_INITIALIZED if O2 is not
+ *         initialized, #O2_BAD_SERVICE_NAME or #O2_BAD_ARGS if
+ *         the service name or policy is invalid.
+ *
+ * When several processes offer the same service (see #o2_service_new),
+ * O2 normally sends every message to the provider with the highest
+ * IP:port. With any other policy, the provider is chosen for each
+ * message sent from this process. A process that receives a message for
+ * a service it offers always handles the message rather than forwarding
+ * it, so only senders need to set the policy. #O2_POLICY_LEAST_QUEUED
+ * compares the bytes waiting to be sent over each TCP connection
+ * (including messages held while connecting), so it only distinguishes
+ * providers for messages sent with #o2_send_cmd. The hashing policies
+ * always map equal keys to the same provider, and when a provider joins
+ * or leaves, only keys belonging to that provider move. If the argument
+ * or address node is missing, or the message is a bundle, the whole
+ * address is hashed. Taps are not affected by the policy. The policy is
+ * remembered by this process even if the service does not exist yet or
+ * later disappears.
+ */
+int o2_service_policy(const char *service, int policy, int param);
+
 /**
  *  \brief Remove a local service
  *
@@ -983,6 +1185,260 @@ extern int o2_clock_is_synchronized;
 int o2_roundtrip(double *mean, double *min);
 
 
+/** \brief Stats socket kind: receives O2 messages by UDP. */
+#define O2_STATS_SOCKET_UDP 0
+/** \brief Stats socket kind: TCP connection to another O2 process. */
+#define O2_STATS_SOCKET_TCP 1
+/** \brief Stats socket kind: UDP port made by o2_osc_port_new(). */
+#define O2_STATS_SOCKET_OSC_UDP 2
+/** \brief Stats socket kind: receives discovery messages. */
+#define O2_STATS_SOCKET_DISCOVERY 3
+/** \brief Stats socket kind: accepts TCP connections from O2 processes. */
+#define O2_STATS_SOCKET_TCP_SERVER 4
+/** \brief Stats socket kind: TCP port made by o2_osc_port_new(). */
+#define O2_STATS_SOCKET_OSC_TCP_SERVER 5
+/** \brief Stats socket kind: connection accepted by an OSC TCP port. */
+#define O2_STATS_SOCKET_OSC_TCP 6
+/** \brief Stats socket kind: TCP connection made by o2_osc_delegate(). */
+#define O2_STATS_SOCKET_OSC_TCP_CLIENT 7
+
+/**
+ * \brief Counters for one socket, part of #o2_stats.
+ */
+typedef struct o2_socket_stats {
+    int tag;           ///< kind of socket, one of the O2_STATS_SOCKET_*
+                       ///< values, e.g. #O2_STATS_SOCKET_TCP
+    const char *name;  ///< ip:port of a remote process, the service of
+                       ///< an OSC socket, or "" for other sockets
+    int64_t msgs_in;   ///< messages received
+    int64_t bytes_in;  ///< bytes of message data received
+    int64_t msgs_out;  ///< messages sent
+    int64_t bytes_out; ///< bytes of message data sent
+    int64_t partial_reads; ///< reads that did not finish a message
+    int64_t send_errors;   ///< failed sends
+} o2_socket_stats, *o2_socket_stats_ptr;
+
+
+/**
+ * \brief Counters for one service, part of #o2_stats.
+ */
+typedef struct o2_service_stats {
+    const char *name;  ///< the service name
+    int64_t delivered; ///< messages delivered locally or forwarded to OSC
+    int64_t tapped;    ///< copies sent to tappers
+} o2_service_stats, *o2_service_stats_ptr;
+
+
+/**
+ * \brief A snapshot of O2 counters, see o2_stats_get().
+ */
+typedef struct o2_stats {
+    int64_t dropped_no_service; ///< messages sent to unknown services
+    int64_t dropped_queue_full; ///< messages dropped because the queue
+                        ///< for an unconnected process was full
+    int pending;        ///< messages waiting for nested delivery to finish
+    int scheduled;      ///< messages in #o2_gtsched and #o2_ltsched
+    int pool_size;      ///< messages allocated for the message free list
+    int pool_free;      ///< of these, how many are on the free list
+    int socket_count;   ///< length of sockets
+    o2_socket_stats_ptr sockets;
+    int service_count;  ///< length of services
+    o2_service_stats_ptr services;
+} o2_stats, *o2_stats_ptr;
+
+
+/**
+ * \brief Get a snapshot of message counters.
+ *
+ * O2 always counts messages and bytes through each socket, deliveries
+ * and taps for each service, and messages dropped because no service
+ * was found or because too many messages were queued for an unconnected
+ * process (see o2_set_lazy_connect()). Counting costs a few increments
+ * per message. This function copies the counters, together with the
+ * current number of pending and scheduled messages and the message free
+ * list usage, into `*stats`. Call o2_stats_free() to release the
+ * arrays.
+ *
+ * The same information can be requested from any process with a
+ * message to `!ip:port/stats` (or `/_o2/stats` for the local
+ * process). The type string is "s" and the parameter is an O2
+ * address prefix. Replies are sent by TCP to the prefix with these
+ * suffixes, and the first parameter is always the ip:port name of
+ * the process:
+ * - "/global" type "shhiiii": dropped_no_service, dropped_queue_full,
+ *   pending, scheduled, pool_size, pool_free
+ * - "/socket" type "sishhhhhh", once for each socket: tag (one of
+ *   the O2_STATS_SOCKET_* values), name, msgs_in, bytes_in,
+ *   msgs_out, bytes_out, partial_reads, send_errors
+ * - "/service" type "sshh", once for each service: name, delivered,
+ *   tapped
+ * - "/end" type "si": the number of "/socket" and "/service"
+ *   replies that were sent
+ *
+ * @param stats the structure to fill in
+ *
+ * @return O2_SUCCESS, O2_NOT_INITIALIZED or O2_NO_MEMORY
+ */
+int o2_stats_get(o2_stats_ptr stats);
+
+
+/**
+ * \brief Free the arrays of a snapshot filled in by o2_stats_get().
+ */
+void o2_stats_free(o2_stats_ptr stats);
+
+
+#ifdef O2_PROFILE_HANDLERS
+/// number of bins in #o2_handler_profile histograms
+#define O2_PROFILE_BINS 16
+
+/**
+ * \brief Execution time of one handler, see o2_profile_get().
+ *
+ * Only available when O2 is compiled with O2_PROFILE_HANDLERS
+ * (the CMake option of the same name). Bin 0 of histogram counts
+ * calls shorter than 1us, bin i counts calls from 2^(i-1) to 2^i us,
+ * and the last bin counts everything longer.
+ */
+typedef struct o2_handler_profile {
+    int64_t calls;   ///< number of calls
+    o2_time total;   ///< total time in the handler
+    o2_time max;     ///< longest call
+    int64_t slow;    ///< calls longer than the o2_profile_slow() threshold
+    int64_t histogram[O2_PROFILE_BINS]; ///< calls by duration
+} o2_handler_profile, *o2_handler_profile_ptr;
+
+
+/**
+ * \brief Set the slow handler threshold.
+ *
+ * Every handler call that takes longer than threshold is recorded,
+ * with its address and duration, in a ring buffer of the last 64
+ * slow calls, which o2_profile_print() prints. The default is 0.01s.
+ * Only available when O2 is compiled with O2_PROFILE_HANDLERS.
+ */
+void o2_profile_slow(o2_time threshold);
+
+
+/**
+ * \brief Get the execution time profile of a handler.
+ *
+ * @param path the path passed to o2_method_new()
+ *
+ * @return the profile, or NULL if there is no handler for path.
+ * Messages to `!`-addresses are profiled separately and are not
+ * included.
+ */
+o2_handler_profile_ptr o2_profile_get(const char *path);
+
+
+/**
+ * \brief Print the profile of every handler that has been called,
+ * followed by recent slow calls.
+ */
+void o2_profile_print();
+
+
+/**
+ * \brief Clear all handler profiles and the slow call ring buffer.
+ */
+void o2_profile_reset();
+#endif
+
+
+#ifdef O2_TRACE
+/**
+ * \brief Start recording message trace events.
+ *
+ * Only available when O2 is compiled with O2_TRACE (the CMake option
+ * of the same name). Each message is followed as it is sent, written
+ * to a socket, received, scheduled and dispatched to a handler, and
+ * each of these events is recorded with local time, global time and
+ * an ID computed from the message contents. The same message gets the
+ * same ID in the sending and receiving processes. Events go into a
+ * ring buffer that holds the last capacity events. Calling
+ * o2_trace_start() again clears the buffer.
+ *
+ * @param capacity the number of events to keep
+ *
+ * @return O2_SUCCESS, O2_FAIL if capacity is not positive, or
+ *         O2_NO_MEMORY
+ */
+int o2_trace_start(int capacity);
+
+
+/**
+ * \brief Stop recording message trace events. The events recorded so
+ * far are kept for o2_trace_write().
+ */
+void o2_trace_stop();
+
+
+/**
+ * \brief Write recorded trace events to a file in Chrome trace event
+ * (JSON) format.
+ *
+ * Load the file with chrome://tracing or https://ui.perfetto.dev.
+ * Events use global time once the clock is synchronized, so files from
+ * several processes can be merged by concatenating their traceEvents
+ * arrays, and the events of each message are connected by a flow.
+ *
+ * @param filename the file to write
+ *
+ * @return O2_SUCCESS, O2_NOT_INITIALIZED, or O2_FAIL if the file
+ *         cannot be written
+ */
+int o2_trace_write(const char *filename);
+#endif
+
+
+/**
+ * \brief Set bounds on the clock synchronization period
+ *
+ * Processes other than the master synchronize their clocks by sending
+ * a request to the master and timing the reply. After a fast start
+ * (one request every 0.1s until there are enough measurements), the
+ * period between requests adapts to how well the clock is tracking
+ * the master: it grows by 50% after each reply that agrees with the
+ * current estimate of clock offset and skew, and it shrinks when round
+ * trip times become erratic or the estimate is off. Longer periods
+ * reduce the load on the master when there are many processes. By
+ * default, the period stays between 0.5s and 60s.
+ *
+ * @param min_period the shortest period between clock sync requests;
+ *        a minimum of 0.1s is enforced; 0.5s is the default.
+ * @param max_period the longest period between clock sync requests;
+ *        60s is the default.
+ *
+ * @return O2_SUCCESS, or O2_FAIL if max_period is less than min_period.
+ */
+int o2_set_clock_sync_period(o2_time min_period, o2_time max_period);
+
+
+/**
+ * \brief Allow clock synchronization through nearby processes
+ *
+ * By default, every process synchronizes its clock by sending requests
+ * to the master clock (the `_cs` service). With many processes, this
+ * places a load on the master. Once a process is synchronized, it can
+ * also answer clock sync requests (sent to `!ip:port/cs/get`), acting
+ * as a relay. When relays are enabled, a process periodically probes
+ * other synchronized processes and switches to the nearest one (by
+ * round-trip time) as long as the resulting error bound is at most
+ * `max_error`. Relays report their error bound and distance from the
+ * master with each reply so that errors accumulate visibly, and a
+ * process returns to the master if its relay stops replying or its
+ * error bound grows beyond `max_error`.
+ *
+ * @param max_error the largest acceptable bound on clock error in
+ *        seconds when synchronizing through a relay, or 0 to always
+ *        synchronize directly with the master (the default).
+ *
+ * @return the previous value of `max_error`
+ */
+o2_time o2_set_clock_relays(o2_time max_error);
+
+
 /** \brief signature for callback that defines the master clock
  *
  * See o2_clock_set() for details.
@@ -1134,6 +1590,15 @@ int o2_finish();
 
 
 // Interoperate with OSC
+/**
+ * \brief tcp_flag value selecting SLIP framing for OSC over TCP
+ *
+ * Pass this as the tcp_flag of #o2_osc_port_new or #o2_osc_delegate
+ * to use TCP with each OSC packet framed by SLIP (as in OSC 1.1)
+ * rather than preceded by its length (as in OSC 1.0).
+ */
+#define O2_OSC_SLIP 2
+
 /**
  *  \brief Create a port to receive OSC messages.
  *
@@ -1146,7 +1611,9 @@ int o2_finish();
  *
  *  @param service_name The name of the service to which messages are delivered
  *  @param port_num     Port number.
- *  @param tcp_flag     Be a TCP server for remote clients. Otherwise, use UDP
+ *  @param tcp_flag     Be a TCP server for remote clients. Otherwise, use
+ *                      UDP. With #O2_OSC_SLIP, clients send SLIP-framed
+ *                      packets.
  *
  *  @return #O2_SUCCESS if success, #O2_FAIL if not.
  */
@@ -1175,11 +1642,13 @@ int o2_osc_port_free(int port_num);
  *  @param port_num     The port number of the osc server.
  *  @param tcp_flag     Send OSC message via TCP protocol, in which case
  *                      port_num is the TCP server port, not a connection.
+ *                      With #O2_OSC_SLIP, packets are SLIP-framed.
  *
  *  @return #O2_SUCCESS if success, #O2_FAIL if not.
  *
  *  If `tcp_flag` is set, a TCP connection will be established with
- *  the OSC server.
+ *  the OSC server. Messages to a TCP server are buffered and written
+ *  together at the end of each #o2_poll call.
  *  When the created service receives any O2 messages, it will
  *  send the message to the OSC server. If the incoming message has
  *  a timestamp for some future time, the message will be held until
@@ -6,6 +6,7 @@
 #include "o2_clock.h"
 #include "o2_sched.h"
 #include "o2_send.h"
+#include "o2_discovery.h"
 
 // get the master clock - clock time is estimated as
 //   global_time_base + elapsed_time * clock_rate, where
@@ -37,6 +38,60 @@ static int clock_rate_id = 0;
 static int ping_reply_count = 0;
 static o2_time round_trip_time[CLOCK_SYNC_HISTORY_LEN];
 static o2_time master_minus_local[CLOCK_SYNC_HISTORY_LEN];
+// a longer history is used to estimate clock skew (rate difference
+// between the local clock and the master) as well as offset. Each
+// sample is the local time at the midpoint of the round trip, the
+// master-vs-local offset, and the round-trip time. These are stored
+// at skew_sample_count % CLOCK_SKEW_HISTORY_LEN
+#define CLOCK_SKEW_HISTORY_LEN 16
+static int skew_sample_count = 0;
+static o2_time skew_local_time[CLOCK_SKEW_HISTORY_LEN];
+static o2_time skew_offset[CLOCK_SKEW_HISTORY_LEN];
+static o2_time skew_rtt[CLOCK_SKEW_HISTORY_LEN];
+static double clock_skew = 0.0; // estimated d(master - local)/d(local)
+// a pair of samples is used to estimate skew only if they are at least
+// CLOCK_SKEW_MIN_SPAN apart and far enough apart that the uncertainty of
+// each offset (half the round trip) leaves the slope accurate to within
+// CLOCK_SKEW_RESOLUTION:
+#define CLOCK_SKEW_MIN_SPAN 2.0
+#define CLOCK_SKEW_RESOLUTION 0.0001
+// skew estimates beyond +/- 1000 ppm are assumed to be bad data:
+#define CLOCK_MAX_SKEW 0.001
+// offset corrections are slewed over at least this many seconds:
+#define CLOCK_SLEW_TIME 2.0
+// After a fast start, the clock sync period adapts between these bounds
+// (see o2_set_clock_sync_period()), growing by CLOCK_SYNC_BACKOFF while
+// the estimate is stable and shrinking when it is not. The skew estimate
+// keeps the clock on track over long gaps, so the default maximum is
+// well above the fixed 10s period that O2 used before:
+static o2_time clock_sync_min_period = 0.5;
+static o2_time clock_sync_max_period = 60.0;
+static o2_time clock_sync_period = 0.5;
+#define CLOCK_SYNC_BACKOFF 1.5
+
+// Clock relays: any synchronized process answers clock sync requests
+// sent to /ip:port/cs/get, replying with its estimate of global time,
+// a bound on the error of that estimate and its "stratum" (number of
+// hops from the master). If relays are enabled (clock_relay_max_error
+// > 0), a process occasionally probes a synchronized peer and switches
+// from the master (or its current relay) to the peer if the peer is
+// nearer and its error bound is acceptable. A relay is only chosen if
+// its stratum is no more than our own, which (with CLOCK_MAX_STRATUM
+// to break loops formed by simultaneous switches) keeps the relays
+// organized as a tree rooted at the master.
+static o2_time clock_relay_max_error = 0; // 0 means do not use relays
+static o2string clock_source = NULL; // relay name, NULL for master (_cs)
+#define CLOCK_MAX_STRATUM 8
+static int clock_stratum = CLOCK_MAX_STRATUM; // 0 is master, 1 syncs to it
+static o2_time clock_error_bound = 0; // bound on |o2_time_get() - master|
+static int clock_replies_missed = 0; // unanswered requests to clock_source
+static int clock_probe_id = 0; // probes use negative ids
+static o2string clock_probe_name = NULL; // process being probed
+static o2_time clock_probe_send_time;
+static int clock_probe_index = 0; // where to look next for a relay
+#define CLOCK_PROBE_PERIOD 4 // probe on every 4th clock sync request
+#define CLOCK_RELAY_MARGIN 0.8 // new relay must be this much nearer
+#define CLOCK_MAX_MISSED 3 // give up on a relay after this many misses
 
 static o2_time time_offset = 0.0; // added to time_callback()
 
@@ -46,19 +101,84 @@ static o2_time time_offset = 0.0; // added to time_callback()
 static uint64_t start_time;
 #elif __linux__
 #include "sys/time.h"
-static long start_time;
+#include <time.h>
+static time_t start_time;
+#ifdef O2_USE_TSC
+// Optional fast path: read the CPU timestamp counter (which must be
+// invariant, i.e. run at a constant rate and be synchronized across
+// cores, as on current x86 processors) and scale it to seconds. The
+// scale is calibrated against CLOCK_MONOTONIC, first over 10ms, then
+// recalibrated with a longer baseline at increasing intervals.
+#include <x86intrin.h>
+static uint64_t tsc_cal_ticks; // calibration reference point
+static o2_time tsc_cal_time;
+static uint64_t tsc_base_ticks; // time is computed relative to this point
+static o2_time tsc_base_time;
+static double tsc_period; // seconds per tick
+static uint64_t tsc_next_calibration; // when to calibrate again (ticks)
+static o2_time tsc_calibration_interval;
+#endif
 #elif WIN32
 static long start_time;
 #endif
 
+#ifdef __linux__
+// seconds since start_time according to CLOCK_MONOTONIC, which, unlike
+// gettimeofday(), does not jump when the system time is set
+static o2_time monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start_time) + (ts.tv_nsec * 1.0E-9);
+}
+
+
+#ifdef O2_USE_TSC
+// local time from the timestamp counter. Every tsc_calibration_interval
+// the period is recomputed over the whole time since initialization, and
+// the base is moved to the current time so that time stays continuous.
+static o2_time tsc_time()
+{
+    uint64_t ticks = __rdtsc();
+    o2_time t = tsc_base_time + (ticks - tsc_base_ticks) * tsc_period;
+    if (ticks >= tsc_next_calibration) {
+        tsc_period = (monotonic_time() - tsc_cal_time) /
+                     (ticks - tsc_cal_ticks);
+        tsc_base_ticks = ticks;
+        tsc_base_time = t;
+        if (tsc_calibration_interval < 60) tsc_calibration_interval *= 2;
+        tsc_next_calibration = ticks +
+                (uint64_t) (tsc_calibration_interval / tsc_period);
+    }
+    return t;
+}
+#endif
+#endif
+
+
 void o2_time_initialize()
 {
 #ifdef __APPLE__
     start_time = AudioGetCurrentHostTime();
 #elif __linux__
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    start_time = tv.tv_sec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start_time = ts.tv_sec;
+#ifdef O2_USE_TSC
+    tsc_cal_time = monotonic_time();
+    tsc_cal_ticks = __rdtsc();
+    o2_time now;
+    uint64_t ticks;
+    do {
+        now = monotonic_time();
+        ticks = __rdtsc();
+    } while (now - tsc_cal_time < 0.01);
+    tsc_period = (now - tsc_cal_time) / (ticks - tsc_cal_ticks);
+    tsc_base_ticks = ticks;
+    tsc_base_time = now;
+    tsc_calibration_interval = 1.0;
+    tsc_next_calibration = ticks + (uint64_t) (1.0 / tsc_period);
+#endif
 #elif WIN32
     start_time = timeGetTime();
 #else
@@ -102,7 +222,7 @@ static void catch_up_handler(o2_msg_data_ptr msg, const char *types,
     // assume the scheduler sets local_now and global_now
     global_time_base = LOCAL_TO_GLOBAL(msg->timestamp);
     local_time_base = msg->timestamp;
-    clock_rate = 1.0;
+    clock_rate = 1.0 + clock_skew;
 }
 
 
@@ -125,34 +245,100 @@ static void set_clock(double local_time, double new_master)
     O2_DBk(printf("%s set_clock: using %g, should be %g\n",
         o2_debug_prefix, global_time_base, new_master));
     double clock_advance = new_master - global_time_base; // how far to catch up
+    // the rate at which the master clock advances relative to local time:
+    double base_rate = 1.0 + clock_skew;
     clock_rate_id++; // cancel any previous calls to catch_up_handler()
-    // compute when we will catch up: estimate will increase at clock_rate
-    // while (we assume) master increases at rate 1, so at what t will
-    //   global_time_base + (t - local_time_base) * clock_rate ==
-    //   new_master + (t - local_time_base)
-    // =>
-    //   new_master - global_time_base ==
-    //       (t - local_time_base) * clock_rate - (t - local_time_base)
-    // =>
-    //   clock_advance == (clock_rate - 1) * (t - local_time_base)
-    // =>
-    //   t == local_time_base + clock_advance / (clock_rate - 1)
+    // Rather than stepping the clock, slew it: run at base_rate plus a
+    // correction that removes clock_advance over slew_time, then return
+    // to base_rate. Since the master advances at base_rate relative to
+    // local time, the estimate catches up exactly when
+    //   (clock_rate - base_rate) * slew_time == clock_advance
+    // Small errors are spread over CLOCK_SLEW_TIME so the mapping stays
+    // smooth; larger ones change the rate by at most 10%.
     if (clock_advance > 1) {
-        clock_rate = 1.0;
+        clock_rate = base_rate;
         global_time_base = new_master; // we are way behind: jump ahead
-    } else if (clock_advance > 0) { // we are a little behind,
-        clock_rate = 1.1;           // go faster to catch up
-        will_catch_up_after(clock_advance * 10);
-    } else if (clock_advance > -1) { // we are a little ahead
-        clock_rate = 0.9; // go slower until the master clock catches up
-        will_catch_up_after(clock_advance * -10);
+    } else if (clock_advance > -1) { // we are a little behind or ahead
+        double slew_time = fabs(clock_advance) * 10;
+        if (slew_time < CLOCK_SLEW_TIME) slew_time = CLOCK_SLEW_TIME;
+        clock_rate = base_rate + clock_advance / slew_time;
+        will_catch_up_after(slew_time);
     } else {
         clock_rate = 0; // we're way ahead: stop until next clock sync
         // TODO: maybe we should try to run clock sync soon since we are
         //       way out of sync and do not know if master time is running
     }
-    O2_DBk(printf("%s adjust clock to %g, rate %g\n",
-                  o2_debug_prefix, LOCAL_TO_GLOBAL(local_time), clock_rate));
+    O2_DBk(printf("%s adjust clock to %g, rate %g, skew %g\n",
+                  o2_debug_prefix, LOCAL_TO_GLOBAL(local_time), clock_rate,
+                  clock_skew));
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+static double median(double *data, int n)
+{
+    qsort(data, n, sizeof(double), &compare_doubles);
+    return ((n & 1) ? data[n / 2] : (data[n / 2 - 1] + data[n / 2]) * 0.5);
+}
+
+
+// estimate master_minus_local at local time now, updating clock_skew
+//   from the skew history. Queueing delays only ever make the round
+//   trip longer and distort the offset, so only samples with a round
+//   trip close to the minimum are used. The skew is the median of the
+//   slopes between pairs of samples (the Theil-Sen estimator) which,
+//   unlike least squares, is not thrown off by a few bad samples. The
+//   offset is the median of the samples projected forward to now.
+//
+static o2_time estimate_offset(o2_time now)
+{
+    int count = skew_sample_count;
+    if (count > CLOCK_SKEW_HISTORY_LEN) count = CLOCK_SKEW_HISTORY_LEN;
+    o2_time min = 9999.0;
+    for (int i = 0; i < count; i++) {
+        if (skew_rtt[i] < min) min = skew_rtt[i];
+    }
+    o2_time limit = min * 2 + 0.001;
+    int best[CLOCK_SKEW_HISTORY_LEN];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (skew_rtt[i] <= limit) best[n++] = i;
+    }
+    // pairwise slopes, ignoring pairs too close together in time:
+    double slopes[CLOCK_SKEW_HISTORY_LEN * (CLOCK_SKEW_HISTORY_LEN - 1) / 2];
+    int ns = 0;
+    for (int i = 0; i < n; i++) {
+        int bi = best[i];
+        for (int j = i + 1; j < n; j++) {
+            int bj = best[j];
+            o2_time dx = skew_local_time[bj] - skew_local_time[bi];
+            o2_time span = (skew_rtt[bi] + skew_rtt[bj]) * 0.5 /
+                           CLOCK_SKEW_RESOLUTION;
+            if (span < CLOCK_SKEW_MIN_SPAN) span = CLOCK_SKEW_MIN_SPAN;
+            if (fabs(dx) >= span) {
+                slopes[ns++] = (skew_offset[bj] - skew_offset[bi]) / dx;
+            }
+        }
+    }
+    if (ns > 0 && n >= 3) {
+        double skew = median(slopes, ns);
+        if (skew > CLOCK_MAX_SKEW) skew = CLOCK_MAX_SKEW;
+        else if (skew < -CLOCK_MAX_SKEW) skew = -CLOCK_MAX_SKEW;
+        clock_skew = skew;
+    }
+    double offsets[CLOCK_SKEW_HISTORY_LEN];
+    for (int i = 0; i < n; i++) {
+        offsets[i] = skew_offset[best[i]] +
+                     (now - skew_local_time[best[i]]) * clock_skew;
+    }
+    return median(offsets, n);
 }
 
 
@@ -162,6 +348,9 @@ static int o2_send_clocksync(process_info_ptr info)
         return O2_SUCCESS;
     char address[32];
     snprintf(address, 32, "!%s/cs/cs", info->proc.name);
+    if (info->fds_index == -1) { // not connected, so do not force a connection
+        return o2_send(address, 0.0, "s", o2_process->proc.name);
+    }
     return o2_send_cmd(address, 0.0, "s", o2_process->proc.name);
 }
     
@@ -212,6 +401,9 @@ static void announce_synchronized(o2_time now)
             o2_send_clocksync(info);
         }
     }
+    for (int i = 0; i < o2_lazy_procs.length; i++) {
+        o2_send_clocksync(*DA_GET(o2_lazy_procs, process_info_ptr, i));
+    }
     // in addition, compute the offset to absolute time in case we need an
     // OSC timestamp
     compute_osc_time_offset(now);
@@ -304,24 +496,175 @@ void o2_clockrt_handler(o2_msg_data_ptr msg, const char *types,
 }
 
 
+// adapt_clock_sync_period -- update clock_sync_period after a reply.
+//   rtt is the latest round trip and error is how far the running clock
+//   is from the new estimate. Both are judged relative to min_rtt since
+//   offsets cannot be measured more precisely than half a round trip.
+//   If the estimate is good and the round trip was not delayed, ping
+//   less often; if either is off by more than twice that, ping more.
+//
+static void adapt_clock_sync_period(o2_time rtt, o2_time error)
+{
+    o2_time tolerance = min_rtt * 0.5;
+    if (tolerance < 0.0005) tolerance = 0.0005;
+    error = fabs(error);
+    if (error > tolerance * 2 || rtt - min_rtt > tolerance * 4) {
+        clock_sync_period /= CLOCK_SYNC_BACKOFF * CLOCK_SYNC_BACKOFF;
+    } else if (error <= tolerance && rtt - min_rtt <= tolerance * 2) {
+        clock_sync_period *= CLOCK_SYNC_BACKOFF;
+    }
+    if (clock_sync_period < clock_sync_min_period) {
+        clock_sync_period = clock_sync_min_period;
+    } else if (clock_sync_period > clock_sync_max_period) {
+        clock_sync_period = clock_sync_max_period;
+    }
+    O2_DBk(printf("%s clock sync error %g rtt %g, period now %g\n",
+                  o2_debug_prefix, error, rtt, clock_sync_period));
+}
+
+
+// forget the round trips and offsets measured from the previous clock
+//   source, so that they do not feed estimate_offset() or the relay
+//   margin test. The clock keeps running at its current rate and is
+//   corrected again once CLOCK_SYNC_HISTORY_LEN replies arrive from the
+//   new source, sent at the minimum period to get there quickly.
+//
+static void clock_source_changed()
+{
+    ping_reply_count = 0;
+    skew_sample_count = 0;
+    min_rtt = 0;
+    clock_replies_missed = 0;
+    clock_sync_period = clock_sync_min_period;
+}
+
+
+// stop using a relay and send clock sync requests to the master (_cs)
+static void use_master_clock()
+{
+    O2_DBk(printf("%s clock source %s dropped, using master\n",
+                  o2_debug_prefix, clock_source));
+    O2_FREE((void *) clock_source);
+    clock_source = NULL;
+    clock_source_changed();
+}
+
+
+// consider_relay -- called with the result of a probe of clock_probe_name.
+//   Switch to the probed process as the clock source if it is a relay
+//   (not the master) no further from the master than this process, its
+//   error bound is acceptable, and it is nearer (by CLOCK_RELAY_MARGIN)
+//   than the current source, whether that is a relay or the master.
+//   min_rtt is 0 until the current source has answered
+//   CLOCK_SYNC_HISTORY_LEN requests, so there is no switching until then.
+//
+static void consider_relay(o2_time rtt, o2_time error, int stratum)
+{
+    O2_DBk(printf("%s clock probe of %s: rtt %g error %g stratum %d\n",
+                  o2_debug_prefix, clock_probe_name, rtt, error, stratum));
+    if (stratum < 1 || stratum > clock_stratum ||
+        stratum >= CLOCK_MAX_STRATUM ||
+        error + rtt * 0.5 > clock_relay_max_error) {
+        return;
+    }
+    if (rtt >= min_rtt * CLOCK_RELAY_MARGIN) {
+        return;
+    }
+    O2_DBk(printf("%s clock source is now %s\n",
+                  o2_debug_prefix, clock_probe_name));
+    if (clock_source) O2_FREE((void *) clock_source);
+    clock_source = clock_probe_name; // transfer ownership
+    clock_probe_name = NULL;
+    clock_source_changed();
+}
+
+
+// send_clock_probe -- send a clock sync request to the next synchronized
+//   process after clock_probe_index (other than the current relay) to
+//   see if it would make a better clock source. Connected processes are
+//   indexed first, then unconnected ones (see o2_set_lazy_connect()),
+//   which are probed by UDP without making a connection.
+//
+static void send_clock_probe()
+{
+    int connected = o2_fds_info.length;
+    int n = connected + o2_lazy_procs.length;
+    for (int j = 0; j < n; j++) {
+        clock_probe_index = (clock_probe_index + 1) % n;
+        process_info_ptr info = (clock_probe_index < connected ?
+                GET_PROCESS(clock_probe_index) :
+                *DA_GET(o2_lazy_procs, process_info_ptr,
+                        clock_probe_index - connected));
+        if (info->tag == TCP_SOCKET && info->proc.status == PROCESS_OK &&
+            info->proc.name &&
+            !(clock_source && streql(clock_source, info->proc.name))) {
+            char address[48];
+            snprintf(address, 48, "!%s/cs/get", info->proc.name);
+            if (clock_probe_name) O2_FREE((void *) clock_probe_name);
+            clock_probe_name = o2_heapify(info->proc.name);
+            clock_probe_id = -clock_sync_id;
+            clock_probe_send_time = o2_local_time();
+            o2_send(address, 0, "is", clock_probe_id, clock_sync_reply_to);
+            return;
+        }
+    }
+}
+
+
 static void cs_ping_reply_handler(o2_msg_data_ptr msg, const char *types,
                                   o2_arg_ptr *argv, int argc, void *user_data)
 {
     o2_arg_ptr arg;
     o2_extract_start(msg);
     if (!(arg = o2_get_next('i'))) return;
-    // if this is not a reply to the most recent message, ignore it
-    if (arg->i32 != clock_sync_id) return;
+    // if this is not a reply to the most recent request or probe, ignore it
+    int id = arg->i32;
+    if (id != clock_sync_id && (id != clock_probe_id || !clock_probe_name)) {
+        return;
+    }
     if (!(arg = o2_get_next('t'))) return;
-    o2_time master_time = arg->t;
-    o2_time now = o2_local_time();
-    o2_time rtt = now - clock_sync_send_time;
+    // the reply has the master time when the request arrived and the
+    // master time when the reply was sent. (Older masters send only
+    // one time, so treat the two as equal.) Then the error bound and
+    // stratum of the replying clock follow (see "Clock relays" above).
+    o2_time master_recv_time = arg->t;
+    o2_time master_time = master_recv_time;
+    o2_time source_error = 0;
+    int source_stratum = 0;
+    if ((arg = o2_get_next('t'))) {
+        master_time = arg->t;
+        if ((arg = o2_get_next('f'))) {
+            source_error = arg->f;
+            if ((arg = o2_get_next('i'))) {
+                source_stratum = arg->i32;
+            }
+        }
+    }
+    // use the kernel timestamp if available to avoid counting time spent
+    // in the poll loop as part of the round trip:
+    o2_time now = (o2_message_recv_time >= 0 ? o2_message_recv_time :
+                                               o2_local_time());
+    // the round trip does not include time the request spent at the master:
+    o2_time send_time = (id == clock_sync_id ? clock_sync_send_time :
+                                               clock_probe_send_time);
+    o2_time rtt = (now - send_time) - (master_time - master_recv_time);
+    if (rtt < 0) rtt = 0;
+    if (id != clock_sync_id) {
+        consider_relay(rtt, source_error, source_stratum);
+        return;
+    }
+    clock_replies_missed = 0;
     // estimate current master time by adding 1/2 round trip time:
     master_time += rtt * 0.5;
     int i = ping_reply_count % CLOCK_SYNC_HISTORY_LEN;
     round_trip_time[i] = rtt;
     master_minus_local[i] = master_time - now;
     ping_reply_count++;
+    i = skew_sample_count % CLOCK_SKEW_HISTORY_LEN;
+    skew_local_time[i] = now - rtt * 0.5;
+    skew_rtt[i] = rtt;
+    skew_offset[i] = master_time - now;
+    skew_sample_count++;
     O2_DBk(printf("%s got clock reply, master_time %g, rtt %g, count %d\n",
                   o2_debug_prefix, master_time, rtt, ping_reply_count));
     if (o2_debug & O2_DBk_FLAG) {
@@ -347,25 +690,29 @@ static void cs_ping_reply_handler(o2_msg_data_ptr msg, const char *types,
     }
 
     if (ping_reply_count >= CLOCK_SYNC_HISTORY_LEN) {
-        // find minimum round trip time
+        // find minimum and mean round trip time
         min_rtt = 9999.0;
         mean_rtt = 0;
-        int best_i;
         for (i = 0; i < CLOCK_SYNC_HISTORY_LEN; i++) {
             mean_rtt += round_trip_time[i];
             if (round_trip_time[i] < min_rtt) {
                 min_rtt = round_trip_time[i];
-                best_i = i;
             }
         }
-        // best estimate of master_minus_local is stored at i
-        //printf("*    %s: time adjust %g\n", o2_debug_prefix,
-        //       now + master_minus_local[best_i] - o2_time_get());
-        o2_time new_master = now + master_minus_local[best_i];
+        mean_rtt /= CLOCK_SYNC_HISTORY_LEN;
+        clock_error_bound = source_error + min_rtt * 0.5;
+        clock_stratum = source_stratum + 1;
+        if (clock_source && (clock_stratum > CLOCK_MAX_STRATUM ||
+                             clock_error_bound > clock_relay_max_error)) {
+            use_master_clock(); // this reply's source is no longer used
+            return;
+        }
+        o2_time new_master = now + estimate_offset(now);
         if (!o2_clock_is_synchronized) {
             o2_clock_synchronized(now, new_master);
             announce_synchronized(new_master);
         } else {
+            adapt_clock_sync_period(rtt, new_master - LOCAL_TO_GLOBAL(now));
             set_clock(now, new_master);
         }
     }
@@ -381,10 +728,34 @@ int o2_roundtrip(double *mean, double *min)
 }
 
 
+o2_time o2_set_clock_relays(o2_time max_error)
+{
+    o2_time old = clock_relay_max_error;
+    clock_relay_max_error = (max_error > 0 ? max_error : 0);
+    if (clock_source && clock_relay_max_error == 0) {
+        use_master_clock();
+    }
+    return old;
+}
+
+
+int o2_set_clock_sync_period(o2_time min_period, o2_time max_period)
+{
+    if (min_period < 0.1) min_period = 0.1;
+    if (max_period < min_period) return O2_FAIL;
+    clock_sync_min_period = min_period;
+    clock_sync_max_period = max_period;
+    if (clock_sync_period < min_period) clock_sync_period = min_period;
+    if (clock_sync_period > max_period) clock_sync_period = max_period;
+    return O2_SUCCESS;
+}
+
+
 // o2_ping_send_handler -- handler for /_o2/ps (short for "ping send")
 //   wait for clock sync service to be established,
 //   then send ping every 0.1s CLICK_SYNC_HISTORY_LEN times, 
-//   then every 0.5s for 5s, then every 10s
+//   then every clock_sync_period, which adapts to the quality of
+//   the clock estimate (see adapt_clock_sync_period())
 //
 void o2_ping_send_handler(o2_msg_data_ptr msg, const char *types,
                           o2_arg_ptr *argv, int argc, void *user_data)
@@ -412,7 +783,8 @@ void o2_ping_send_handler(o2_msg_data_ptr msg, const char *types,
                 char path[48]; // enough room for !IP:PORT/cs/get-reply
                 snprintf(path, 48, "!%s/cs/get-reply",
                          o2_process->proc.name);
-                o2_method_new(path, "it", &cs_ping_reply_handler,
+                // types are checked by the handler ("ittfi" or "it")
+                o2_method_new(path, NULL, &cs_ping_reply_handler,
                               NULL, FALSE, FALSE);
                 snprintf(path, 32, "!%s/cs", o2_process->proc.name);
                 clock_sync_reply_to = o2_heapify(path);
@@ -423,13 +795,31 @@ void o2_ping_send_handler(o2_msg_data_ptr msg, const char *types,
     o2_time when = clock_sync_send_time + 0.1;
     if (found_clock_service) { // found service, but it's non-local
         clock_sync_id++;
-        o2_send("!_cs/get", 0, "is", clock_sync_id, clock_sync_reply_to); // TODO: test return?
+        if (clock_source && clock_replies_missed >= CLOCK_MAX_MISSED) {
+            use_master_clock();
+        }
+        if (clock_source) {
+            char address[48];
+            snprintf(address, 48, "!%s/cs/get", clock_source);
+            if (o2_send(address, 0, "is", clock_sync_id,
+                        clock_sync_reply_to) != O2_SUCCESS) {
+                use_master_clock(); // relay went away
+            }
+        }
+        if (!clock_source) {
+            o2_send("!_cs/get", 0, "is", clock_sync_id, clock_sync_reply_to); // TODO: test return?
+        }
+        clock_replies_missed++;
+        if (clock_relay_max_error > 0 && o2_clock_is_synchronized &&
+            clock_sync_id % CLOCK_PROBE_PERIOD == 0) {
+            send_clock_probe();
+        }
         // run every 0.1 second until at least CLOCK_SYNC_HISTORY_LEN pings
-        // have been sent to get a fast start, then ping every 0.5s until 5s, 
-        // then every 10s.
+        // have been sent to get a fast start, then every clock_sync_period
         o2_time t1 = CLOCK_SYNC_HISTORY_LEN * 0.1 - 0.01;
-        if (clock_sync_send_time - start_sync_time > t1) when += 0.4;
-        if (clock_sync_send_time - start_sync_time > 5.0) when += 9.5;
+        if (clock_sync_send_time - start_sync_time > t1) {
+            when += clock_sync_period - 0.1;
+        }
         O2_DBk(printf("%s clock request sent at %g\n",
                       o2_debug_prefix, clock_sync_send_time));
     }
@@ -450,6 +840,14 @@ void o2_clock_initialize()
 {
     is_master = FALSE;
     o2_clock_is_synchronized = FALSE;
+    ping_reply_count = 0;
+    skew_sample_count = 0;
+    clock_skew = 0.0;
+    clock_sync_period = clock_sync_min_period;
+    clock_stratum = CLOCK_MAX_STRATUM;
+    clock_error_bound = 0;
+    clock_replies_missed = 0;
+    clock_probe_index = 0;
     o2_method_new("/_o2/ps", "", &o2_ping_send_handler, NULL, FALSE, TRUE);
     o2_method_new("/_o2/cu", "i", &catch_up_handler, NULL, FALSE, TRUE);
 }
@@ -457,17 +855,25 @@ void o2_clock_initialize()
 
 void o2_clock_finish()
 {
+    if (clock_source) O2_FREE((void *) clock_source);
+    clock_source = NULL;
+    if (clock_probe_name) O2_FREE((void *) clock_probe_name);
+    clock_probe_name = NULL;
     is_master = FALSE;
     time_callback = NULL;
     time_callback_data = NULL;
 }    
 
 
-// cs_ping_handler -- handler for /_cs/get
-//   return the master clock time
-static void cs_ping_handler(o2_msg_data_ptr msg, const char *types,
-                     o2_arg_ptr *argv, int argc, void *user_data)
+// cs_ping_handler -- handler for /_cs/get, and for /ip:port/cs/get when
+//   this process acts as a clock relay. Returns the global time when
+//   the request arrived (according to the kernel if possible), the
+//   global time when the reply is sent, the error bound of this clock
+//   and its stratum (hops from the master).
+void o2_cs_ping_handler(o2_msg_data_ptr msg, const char *types,
+                        o2_arg_ptr *argv, int argc, void *user_data)
 {
+    if (!o2_clock_is_synchronized) return; // no time to report yet
     o2_arg_ptr serial_no_arg, reply_to_arg;
     o2_extract_start(msg);
     if (!(serial_no_arg = o2_get_next('i')) ||
@@ -484,18 +890,19 @@ static void cs_ping_handler(o2_msg_data_ptr msg, const char *types,
     char address[1024];
     memcpy(address, replyto, len);
     memcpy(address + len, "/get-reply", 11); // include EOS
-    o2_send(address, 0, "it", serial_no, o2_time_get());
+    o2_time now = o2_time_get();
+    o2_time recv_time = (o2_message_recv_time >= 0 ?
+                         o2_local_to_global(o2_message_recv_time) : now);
+    o2_send(address, 0, "ittfi", serial_no, recv_time, now,
+            (is_master ? 0.0 : clock_error_bound),
+            (is_master ? 0 : clock_stratum));
 }
 
 
-int o2_clock_set(o2_time_callback callback, void *data)
+// install callback as the local time source, returning the local time
+//
+static o2_time set_time_callback(o2_time_callback callback, void *data)
 {
-    if (!o2_application_name) {
-        O2_DBk(printf("%s o2_clock_set cannot be called before o2_initialize.\n",
-                      o2_debug_prefix));
-        return O2_FAIL;
-    }
-    int was_synchronized = o2_clock_is_synchronized;
     // adjust local_start_time to ensure continuity of time:
     //   new_local_time - new_time_offset == old_local_time - old_time_offset
     //   new_time_offset = new_local_time - (old_local_time - old_time_offset)
@@ -505,15 +912,42 @@ int o2_clock_set(o2_time_callback callback, void *data)
     time_offset = 0.0; // get the time without any offset
     o2_time new_local_time = o2_local_time();
     time_offset = new_local_time - old_local_time;
+    // with the offset, local time is still old_local_time; do not use
+    // new_local_time, which is the callback time without the offset
+    return old_local_time;
+}
+
+
+int o2_local_clock_set(o2_time_callback callback, void *data)
+{
+    if (!o2_application_name) {
+        O2_DBk(printf("%s o2_local_clock_set cannot be called before o2_initialize.\n",
+                      o2_debug_prefix));
+        return O2_FAIL;
+    }
+    set_time_callback(callback, data);
+    return O2_SUCCESS;
+}
+
+
+int o2_clock_set(o2_time_callback callback, void *data)
+{
+    if (!o2_application_name) {
+        O2_DBk(printf("%s o2_clock_set cannot be called before o2_initialize.\n",
+                      o2_debug_prefix));
+        return O2_FAIL;
+    }
+    int was_synchronized = o2_clock_is_synchronized;
+    o2_time old_local_time = set_time_callback(callback, data);
 
     if (!is_master) {
-        o2_clock_synchronized(new_local_time, new_local_time);
+        o2_clock_synchronized(old_local_time, old_local_time);
         o2_service_new("_cs");
-        o2_method_new("/_cs/get", "is", &cs_ping_handler, NULL, FALSE, FALSE);
+        o2_method_new("/_cs/get", "is", &o2_cs_ping_handler, NULL, FALSE, FALSE);
         O2_DBg(printf("%s ** master clock established, time is now %g\n",
                      o2_debug_prefix, o2_local_time()));
         is_master = TRUE;
-        announce_synchronized(new_local_time);
+        announce_synchronized(old_local_time);
         if (!was_synchronized) {
             // every service including local ones and those provided by a
             // synchronized processes are now synchronized
@@ -567,9 +1001,11 @@ o2_time o2_local_time()
     nsec_time = AudioConvertHostTimeToNanos(clock_time);
     return ((o2_time) (nsec_time * 1.0E-9)) - time_offset;
 #elif __linux__
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return ((tv.tv_sec - start_time) + (tv.tv_usec * 0.000001)) - time_offset;
+#ifdef O2_USE_TSC
+    return tsc_time() - time_offset;
+#else
+    return monotonic_time() - time_offset;
+#endif
 #elif WIN32
     return ((timeGetTime() - start_time) * 0.001) - time_offset;
 #else
@@ -8,6 +8,9 @@ void o2_clocksynced_handler(o2_msg_data_ptr msg, const char *types,
 void o2_ping_send_handler(o2_msg_data_ptr msg, const char *types,
                           o2_arg_ptr *argv, int argc, void *user_data);
 
+void o2_cs_ping_handler(o2_msg_data_ptr msg, const char *types,
+                        o2_arg_ptr *argv, int argc, void *user_data);
+
 void o2_clockrt_handler(o2_msg_data_ptr msg, const char *types,
                         o2_arg_ptr *argv, int argc, void *user_data);
 
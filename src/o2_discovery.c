@@ -31,6 +31,92 @@ int broadcast_recv_port = -1; // port we grabbed
 o2_time o2_discovery_period = DEFAULT_DISCOVERY_PERIOD;
 static int disc_port_index = -1;
 
+// multicast discovery (see o2_discovery_multicast()): when multicast_port
+// is non-zero, discovery messages are sent to multicast_addr rather than
+// being broadcast to the ports in o2_port_map
+static int multicast_port = 0;
+static struct sockaddr_in multicast_addr;
+
+// lazy connections (see o2_set_lazy_connect()): processes that are known
+// from !_o2/lz messages but not connected are described by process_info
+// structs with tag TCP_SOCKET and fds_index -1. Each one is the provider
+// for its ip:port service and its other services, so messages find it
+// just as they would find a connected process. When a connection is made,
+// the record is merged into the new connection's process_info.
+// To bound the memory used for a process that never connects, at most
+// LAZY_PENDING_MAX messages are queued for it, and a process that has
+// not connected or sent a !_o2/lz message within connect_timeout of a
+// message being queued is forgotten (see o2_connect_poll()).
+int o2_lazy_connect = FALSE;
+dyn_array o2_lazy_procs;
+int64_t o2_dropped_queue_full = 0;
+#define LAZY_PENDING_MAX 64
+
+// scalable hub (see o2_set_scalable_hub()): hub_clients lists the
+// processes that use this process as their hub. Each one is told about
+// the others by !_o2/hd messages: a snapshot of hub_clients when it
+// joins, then the joins and leaves of each poll, which are collected in
+// hub_events and sent by o2_hub_flush_events().
+static int scalable_hub = FALSE;
+static dyn_array hub_clients; // process_info_ptrs
+typedef struct hub_event {
+    o2string name; // owned copy of the process name (ip:port)
+    int udp_port;
+    int joined;    // TRUE for a join, FALSE for a leave
+} hub_event, *hub_event_ptr;
+static dyn_array hub_events; // hub_event structs
+#define HUB_BATCH_MAX 64 // processes per !_o2/hd message
+
+// mode parameter of !_o2/lz messages:
+#define LAZY_INFO 0    // sender's address and services
+#define LAZY_REPLY 1   // same, and please send your !_o2/lz in return
+#define LAZY_CONNECT 2 // sender has queued messages, please connect to it
+
+// peer cache (see o2_set_peer_cache()): addresses of processes that were
+// connected (or known, in lazy mode) recently, most recent first. The file
+// may be shared by several applications, so entries record the application
+typedef struct peer_cache_entry {
+    o2string app;    // owned copy of the application name
+    char ip[24];
+    int tcp_port;
+    int udp_port;
+} peer_cache_entry, *peer_cache_entry_ptr;
+
+#define PEER_CACHE_MAX 64
+static o2string peer_cache_file = NULL; // NULL if there is no cache
+static dyn_array peer_cache;            // the peer_cache_entry structs
+// changes are written by peer_cache_poll() at most once per discovery
+// period, and by peer_cache_free()
+static int peer_cache_dirty = FALSE;
+static o2_time peer_cache_write_time = -1; // last write, -1 if none
+
+// non-blocking connections (see o2_set_connect_limits()): at most
+// connect_max connections are in progress at once. Each is listed in
+// connecting until it is made, fails, or times out. Others wait in
+// connect_waiting, in order, without a socket.
+static o2_time connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+static int connect_max = DEFAULT_CONNECT_MAX;
+static dyn_array connecting;      // process_info_ptrs
+static dyn_array connect_waiting; // process_info_ptrs
+
+static void set_sockaddr(struct sockaddr_in *sa, const char *ip, int port);
+static int connect_start(process_info_ptr info);
+static int connect_finish(process_info_ptr info);
+static void connect_failed(process_info_ptr info);
+static int tcp_connect_handler(SOCKET sock, process_info_ptr info);
+static void hub_client_join(process_info_ptr info);
+static process_info_ptr lazy_proc_new(o2string name, const char *ip,
+                                      int udp_port, int status);
+static void lazy_proc_free(process_info_ptr lazy);
+static void lazy_proc_expire();
+static void peer_cache_add(const char *ip, int tcp_port, int udp_port);
+static void peer_cache_forget(struct sockaddr_in *sa);
+static void peer_cache_poll();
+static void peer_cache_free();
+static int send_lazy_info(struct sockaddr_in *to, int32_t mode);
+static void lazy_proc_merge(process_info_ptr lazy, process_info_ptr info);
+static void send_pending(process_info_ptr info);
+
 // From Wikipedia: The range 49152–65535 (215+214 to 216−1) contains
 //   dynamic or private ports that cannot be registered with IANA.[198]
 //   This range is used for private, or customized services or temporary
@@ -48,6 +134,12 @@ int o2_discovery_initialize()
     WSAStartup(MAKEWORD(2, 2), &wsaData);
 #endif // WIN32
 
+    DA_INIT(o2_lazy_procs, process_info_ptr, 0);
+    DA_INIT(connecting, process_info_ptr, 0);
+    DA_INIT(connect_waiting, process_info_ptr, 0);
+    DA_INIT(hub_clients, process_info_ptr, 0);
+    DA_INIT(hub_events, hub_event, 0);
+
     // Set up a socket for broadcasting discovery info
     if ((broadcast_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Create broadcast socket");
@@ -109,40 +201,185 @@ int o2_discovery_initialize()
 }
 
 // we are the "client" connecting to a remote process acting as the "server"
+// Start a connection to ip:tcp_port. The new process_info is returned
+// in *info and its status is PROCESS_CONNECTING until the connection is
+// made (see connect_start() and tcp_connect_handler()). Meanwhile, TCP
+// messages to the process are queued, so the caller can send !_o2/in
+// right away.
+//
 int o2_make_tcp_connection(const char *ip, int tcp_port,
-        o2_socket_handler handler, process_info_ptr *info, int hub_flag)
+                           process_info_ptr *info, int hub_flag)
 {
-    // We are the client because our ip:port string is lower
-    struct sockaddr_in remote_addr;
-    //set up the sockaddr_in
-#ifndef WIN32
-    bzero(&remote_addr, sizeof(remote_addr));
-#endif
-    // expand socket arrays for new port, also allocates info
-    RETURN_IF_ERROR(o2_make_tcp_recv_socket(TCP_SOCKET, 0, handler, info));
-    o2_process_initialize(*info, PROCESS_CONNECTED, hub_flag);
-    // set up the connection
-    remote_addr.sin_family = AF_INET;      //AF_INET means using IPv4
-    inet_pton(AF_INET, ip, &(remote_addr.sin_addr));
-    remote_addr.sin_port = htons(tcp_port);
-
-    // note: our local port number is not recorded, not needed
-    // get the socket just created by o2_make_tcp_recv_socket
-    SOCKET sock = DA_LAST(o2_fds, struct pollfd)->fd;
-
-    O2_DBo(printf("%s connect to %s:%d with socket %ld\n",
-                  o2_debug_prefix, ip, tcp_port, (long) sock));
-    int err = connect(sock, (struct sockaddr *) &remote_addr,
-                      sizeof(remote_addr));
-    if (err == -1) {
-        perror("Connect Error!\n");
-        o2_fds_info.length--;   // restore socket arrays 
-        o2_fds.length--;
+    // the socket is created by connect_start(), so fd is INVALID_SOCKET,
+    // which poll() ignores, until the connection is started
+    *info = o2_add_new_socket(INVALID_SOCKET, TCP_SOCKET,
+                              &o2_tcp_initial_handler);
+    o2_process_initialize(*info, PROCESS_CONNECTING, hub_flag);
+    set_sockaddr(&(*info)->proc.tcp_sa, ip, tcp_port);
+    if (connecting.length >= connect_max) {
+        O2_DBo(printf("%s %d connections in progress, %s:%d must wait\n",
+                      o2_debug_prefix, connecting.length, ip, tcp_port));
+        DA_APPEND(connect_waiting, process_info_ptr, *info);
+        return O2_SUCCESS;
+    }
+    int err = connect_start(*info);
+    if (err) { // connection refused immediately: nothing to clean up but
+        // the socket; the caller did not get to use *info
+        connect_failed(*info);
+        o2_socket_remove((*info)->fds_index);
+        DA_FINISH((*info)->proc.services);
+        O2_FREE(*info);
+        *info = NULL;
+    }
+    return err;
+}
+
+
+// create the socket for info and call connect(). Except on Windows, the
+// socket is non-blocking, so connect() returns immediately and
+// tcp_connect_handler() is called when the socket becomes writable.
+//
+static int connect_start(process_info_ptr info)
+{
+    struct pollfd *pfd = DA_GET(o2_fds, struct pollfd, info->fds_index);
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        printf("tcp socket set up error");
         return O2_FAIL;
     }
+    pfd->fd = sock;
+    // NODELAY: TCP messages are delivered immediately rather than being
+    // consolidated with later data (see o2_make_tcp_recv_socket())
+    int option = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *) &option,
+               sizeof(option));
     o2_disable_sigpipe(sock);
-    O2_DBd(printf("%s connected to %s:%d index %d\n",
-                  o2_debug_prefix, ip, tcp_port, o2_fds.length - 1));
+#ifndef WIN32
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+    O2_DBo(printf("%s connect to %s:%d with socket %ld\n", o2_debug_prefix,
+                  inet_ntoa(info->proc.tcp_sa.sin_addr),
+                  ntohs(info->proc.tcp_sa.sin_port), (long) sock));
+    if (connect(sock, (struct sockaddr *) &info->proc.tcp_sa,
+                sizeof(info->proc.tcp_sa)) == 0) {
+        return connect_finish(info);
+    }
+#ifndef WIN32
+    if (errno == EINPROGRESS) {
+        pfd->events = POLLOUT;
+        info->handler = &tcp_connect_handler;
+        info->proc.connect_deadline = o2_local_time() + connect_timeout;
+        DA_APPEND(connecting, process_info_ptr, info);
+        return O2_SUCCESS;
+    }
+#endif
+    perror("Connect Error!\n");
+    return O2_TCP_CONNECT_FAIL;
+}
+
+
+// the connection is made: restore the blocking mode that the rest of O2
+// expects, wait for the !_o2/in reply and send the queued messages
+//
+static int connect_finish(process_info_ptr info)
+{
+    struct pollfd *pfd = DA_GET(o2_fds, struct pollfd, info->fds_index);
+#ifndef WIN32
+    fcntl(pfd->fd, F_SETFL, fcntl(pfd->fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+    pfd->events = POLLIN;
+    info->handler = &o2_tcp_initial_handler;
+    info->proc.status = PROCESS_CONNECTED;
+    O2_DBd(printf("%s connected to %s:%d index %d\n", o2_debug_prefix,
+                  inet_ntoa(info->proc.tcp_sa.sin_addr),
+                  ntohs(info->proc.tcp_sa.sin_port), info->fds_index));
+    send_pending(info);
+    return O2_SUCCESS;
+}
+
+
+// report a connection that could not be made. The caller removes info.
+static void connect_failed(process_info_ptr info)
+{
+    O2_DBo(printf("%s could not connect to %s:%d\n", o2_debug_prefix,
+                  inet_ntoa(info->proc.tcp_sa.sin_addr),
+                  ntohs(info->proc.tcp_sa.sin_port)));
+    peer_cache_forget(&info->proc.tcp_sa);
+}
+
+
+// handler for a socket with connect() in progress: called by o2_recv()
+// when the socket becomes writable or gets an error
+//
+static int tcp_connect_handler(SOCKET sock, process_info_ptr info)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    o2_connect_cancel(info);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *) &err, &len) < 0 ||
+        err) {
+        connect_failed(info);
+        return O2_TCP_CONNECT_FAIL; // o2_recv() removes the process
+    }
+    return connect_finish(info);
+}
+
+
+// remove info from the connections in progress or waiting to start,
+// called when the connection is made or the process is removed
+//
+void o2_connect_cancel(process_info_ptr info)
+{
+    for (int i = 0; i < connecting.length; i++) {
+        if (*DA_GET(connecting, process_info_ptr, i) == info) {
+            DA_REMOVE(connecting, process_info_ptr, i);
+            return;
+        }
+    }
+    for (int i = 0; i < connect_waiting.length; i++) {
+        if (*DA_GET(connect_waiting, process_info_ptr, i) == info) {
+            // keep the first-come, first-served order
+            memmove(DA_GET(connect_waiting, process_info_ptr, i),
+                    DA_GET(connect_waiting, process_info_ptr, i + 1),
+                    (connect_waiting.length - i - 1) *
+                    sizeof(process_info_ptr));
+            connect_waiting.length--;
+            return;
+        }
+    }
+}
+
+
+// called by o2_poll(): give up on connections that take too long, and
+// start waiting connections when there is room. Unconnected processes
+// that do not answer are also forgotten, and peer cache changes saved.
+//
+void o2_connect_poll()
+{
+    lazy_proc_expire();
+    peer_cache_poll();
+    for (int i = connecting.length - 1; i >= 0; i--) {
+        process_info_ptr info = *DA_GET(connecting, process_info_ptr, i);
+        if (o2_local_now > info->proc.connect_deadline) {
+            connect_failed(info);
+            o2_remove_remote_process(info); // also removes from connecting
+        }
+    }
+    while (connect_waiting.length > 0 && connecting.length < connect_max) {
+        process_info_ptr info = *DA_GET(connect_waiting, process_info_ptr, 0);
+        o2_connect_cancel(info);
+        if (connect_start(info)) {
+            connect_failed(info);
+            o2_remove_remote_process(info);
+        }
+    }
+}
+
+
+int o2_set_connect_limits(o2_time timeout, int max_connecting)
+{
+    connect_timeout = (timeout > 0 ? timeout : DEFAULT_CONNECT_TIMEOUT);
+    connect_max = (max_connecting > 0 ? max_connecting : DEFAULT_CONNECT_MAX);
     return O2_SUCCESS;
 }
 
@@ -159,7 +396,10 @@ int o2_discovery_msg_initialize()
         o2_add_string(o2_application_name) ||
         o2_add_string(o2_local_ip) ||
         o2_add_int32(o2_local_tcp_port) ||
-        o2_add_int32(broadcast_recv_port);
+        // replies go to our UDP port: discovery ports can be shared by
+        // several processes (with multicast, or SO_REUSEADDR on Linux), so
+        // a reply sent there might reach the wrong process
+        o2_add_int32(o2_process->port);
     o2_message_ptr msg;
     if (err || !(msg = o2_message_finish(0.0, "!_o2/dy", FALSE)))
         return O2_FAIL;
@@ -189,6 +429,74 @@ int o2_discovery_finish()
 {
     // sockets are all freed elsewhere
     O2_FREE(o2_discovery_msg);
+    o2_discovery_msg = NULL;
+    multicast_port = 0;
+    peer_cache_free();
+    // connections in progress were removed with their sockets
+    DA_FINISH(connecting);
+    DA_FINISH(connect_waiting);
+    // hub clients were removed with their sockets; their leave events
+    // will never be sent
+    scalable_hub = FALSE;
+    DA_FINISH(hub_clients);
+    for (int i = 0; i < hub_events.length; i++) {
+        O2_FREE((void *) DA_GET(hub_events, hub_event, i)->name);
+    }
+    DA_FINISH(hub_events);
+    return O2_SUCCESS;
+}
+
+
+int o2_discovery_multicast(const char *group, int port)
+{
+    if (!o2_application_name) return O2_NOT_INITIALIZED;
+    if (multicast_port) return O2_ALREADY_RUNNING;
+    if (!group) group = O2_MULTICAST_GROUP;
+    if (port == 0) port = O2_MULTICAST_PORT;
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    if (inet_pton(AF_INET, group, &(mreq.imr_multiaddr.s_addr)) != 1) {
+        return O2_FAIL;
+    }
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    // create a socket to receive from the group. Every process binds the
+    // same port (see o2_make_udp_shared_socket()) and every process gets
+    // a copy of each message
+    process_info_ptr info;
+    RETURN_IF_ERROR(o2_make_udp_shared_socket(DISCOVER_SOCKET, port,
+                                              &info));
+    SOCKET sock = DA_GET(o2_fds, struct pollfd, info->fds_index)->fd;
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                   (const char *) &mreq, sizeof(mreq)) < 0) {
+        perror("Join discovery multicast group");
+        o2_socket_mark_to_free(info);
+        return O2_FAIL;
+    }
+
+    // set up broadcast_sock to send to the group: loopback is needed so
+    // that processes on this host hear us, and a TTL of 1 keeps discovery
+    // messages on the local network
+    unsigned char loop = 1;
+    unsigned char ttl = 1;
+    if (setsockopt(broadcast_sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+                   (const char *) &loop, sizeof(loop)) < 0 ||
+        setsockopt(broadcast_sock, IPPROTO_IP, IP_MULTICAST_TTL,
+                   (const char *) &ttl, sizeof(ttl)) < 0) {
+        perror("Set multicast options");
+        o2_socket_mark_to_free(info);
+        return O2_FAIL;
+    }
+    memset(&multicast_addr, 0, sizeof(multicast_addr));
+    multicast_addr.sin_family = AF_INET;
+#ifdef __APPLE__
+    multicast_addr.sin_len = sizeof(multicast_addr);
+#endif
+    multicast_addr.sin_addr = mreq.imr_multiaddr;
+    multicast_addr.sin_port = htons(port);
+    multicast_port = port;
+    O2_DBo(printf("%s joined discovery multicast group %s port %d\n",
+                  o2_debug_prefix, group, port));
     return O2_SUCCESS;
 }
 
@@ -231,6 +539,22 @@ static void o2_broadcast_message(int port)
 }
 
 
+/**
+ *  Send o2_discovery_msg (!o2/dy) to the discovery multicast group.
+ */
+static void o2_multicast_message()
+{
+    O2_DBd(printf("%s multicasting discovery msg to port %d\n",
+                  o2_debug_prefix, multicast_port));
+    if (sendto(broadcast_sock, (char *) &o2_discovery_msg->data,
+               o2_discovery_msg->length, 0,
+               (struct sockaddr *) &multicast_addr,
+               sizeof(multicast_addr)) < 0) {
+        perror("Error attempting to multicast discovery message");
+    }
+}
+
+
 /// callback function that implements sending discovery messages
 //    message args are:
 //    o2_process_ip (as a string), udp port (int), tcp port (int)
@@ -241,10 +565,15 @@ void o2_discovery_send_handler(o2_msg_data_ptr msg, const char *types,
     if (o2_using_a_hub) {
         return; // end discovery broadcasts after o2_hub()
     }
-    // O2 is not going to work if we did not get a discovery port
-    if (disc_port_index < 0) return;
-    next_discovery_index = (next_discovery_index + 1) % (disc_port_index + 1);
-    o2_broadcast_message(o2_port_map[next_discovery_index]);
+    if (multicast_port) { // every process hears every multicast message
+        o2_multicast_message();
+    } else {
+        // O2 is not going to work if we did not get a discovery port
+        if (disc_port_index < 0) return;
+        next_discovery_index = (next_discovery_index + 1) %
+                               (disc_port_index + 1);
+        o2_broadcast_message(o2_port_map[next_discovery_index]);
+    }
     o2_time next_time = o2_local_time() + o2_discovery_send_interval;
     // back off rate by 10% until we're sending every o2_discovery_period (4s):
     o2_discovery_send_interval *= 1.1;
@@ -290,14 +619,19 @@ int o2_send_initialize(process_info_ptr process, int32_t hub_flag)
 }
 
 
+// send the complete list of our services, tagged with the version of
+// our service table. Connected processes get the list by TCP, processes
+// that are known but not connected (see o2_set_lazy_connect()) by UDP.
+//
 int o2_send_services(process_info_ptr process)
 {
-    // send services if any
-    if (o2_process->proc.services.length <= 0) {
-        return O2_SUCCESS;
-    }
+    // pending changes are sent first so that the version number in this
+    // message is up to date
+    o2_flush_service_changes();
     o2_send_start();
     o2_add_string(o2_process->proc.name);
+    o2_add_int32(o2_services_seq);
+    o2_add_bool(TRUE); // this is a complete list
     for (int i = 0; i < o2_process->proc.services.length; i++) {
         char *service = *DA_GET(o2_process->proc.services, char *, i);
         // ugly, but just a fast test if service is _o2:
@@ -311,7 +645,7 @@ int o2_send_services(process_info_ptr process)
     }
     char address[32];
     snprintf(address, 32, "!%s/sv", process->proc.name);
-    return o2_send_finish(0.0, address, TRUE);
+    return o2_send_finish(0.0, address, process->fds_index != -1);
 }
 
 
@@ -376,8 +710,8 @@ int o2_discovery_by_tcp(const char *ipaddress, int port, char *name,
 {
     int err = O2_SUCCESS;
     process_info_ptr remote;
-    RETURN_IF_ERROR(o2_make_tcp_connection(ipaddress, port, &o2_tcp_initial_handler,
-                                           &remote, O2_NO_HUB));
+    RETURN_IF_ERROR(o2_make_tcp_connection(ipaddress, port, &remote,
+                                           O2_NO_HUB));
     if (be_server) { // we are server; connect to deliver a /dy message
         // we do not use o2_discovery_msg because it is byte-swapped and missing hub_flag
         // it seems easier just to make a new one:
@@ -443,7 +777,7 @@ void o2_discovery_handler(o2_msg_data_ptr msg, const char *types,
         return; // the "discovered process" is this one
     }
     o2_entry_ptr *entry_ptr = o2_lookup(&o2_path_tree, name);
-    // if process is connected, ignore it
+    // if process is connected (or known, see o2_set_lazy_connect()), ignore it
     if (*entry_ptr) {
 #ifndef NDEBUG
         process_info_ptr remote = NULL;
@@ -451,12 +785,23 @@ void o2_discovery_handler(o2_msg_data_ptr msg, const char *types,
         assert(services && services->tag == SERVICES &&
                services->services.length == 1);
         remote = (process_info_ptr) GET_SERVICE(services->services, 0);
-        assert(remote && remote->tag == TCP_SOCKET && remote->fds_index != -1);
-        O2_DBd(printf("    Ignored: already connected\n"));
+        assert(remote && remote->tag == TCP_SOCKET);
+        O2_DBd(printf("    Ignored: already %s\n", remote->fds_index == -1 ?
+                      "known" : "connected"));
 #endif
         return; // we've already connected or accepted, so ignore the /dy data
     }
     int hub_flag = hub_arg->i32;
+    if (o2_lazy_connect && hub_flag == O2_NO_HUB) {
+        // tell the sender about us and ask for its services in return,
+        // but do not connect until there is a message to deliver
+        struct sockaddr_in disc_sa;
+        set_sockaddr(&disc_sa, ip, udp_arg->i32);
+        O2_DBd(printf("%s o2_discovery_handler sending lazy info to %s\n",
+                      o2_debug_prefix, name));
+        send_lazy_info(&disc_sa, LAZY_REPLY);
+        return;
+    }
     if (compare > 0) { // we are server, the other party should connect
         if (hub_flag == O2_FROM_HUB) { // then this message came via TCP from
             // our hub, so we need to send to the remote process' TCP port
@@ -468,13 +813,8 @@ void o2_discovery_handler(o2_msg_data_ptr msg, const char *types,
         }
         // send a discover message back to sender's UDP port, which is now known
         struct sockaddr_in udp_sa;
-        udp_sa.sin_family = AF_INET;
-#ifdef __APPLE__
-        udp_sa.sin_len = sizeof(udp_sa);
-#endif
-        inet_pton(AF_INET, ip, &(udp_sa.sin_addr.s_addr));
         assert(udp_arg->i32 >= 0);
-        udp_sa.sin_port = htons(udp_arg->i32);
+        set_sockaddr(&udp_sa, ip, udp_arg->i32);
         if (sendto(local_send_sock, (char *) &o2_discovery_msg->data,
                    o2_discovery_msg->length, 0,
                    (struct sockaddr *) &udp_sa,
@@ -492,8 +832,8 @@ void o2_discovery_handler(o2_msg_data_ptr msg, const char *types,
                           " /in, hub_flag is %d\n",
                           o2_debug_prefix, hub_flag));
         }
-        if (o2_make_tcp_connection(ip, tcp, &o2_tcp_initial_handler, 
-                                   &remote, hub_flag == O2_CLIENT_IS_HUB)) {
+        if (o2_make_tcp_connection(ip, tcp, &remote,
+                                   hub_flag == O2_CLIENT_IS_HUB)) {
             return;
         }
         remote->proc.name = o2_heapify(name);
@@ -501,7 +841,7 @@ void o2_discovery_handler(o2_msg_data_ptr msg, const char *types,
         o2_service_provider_new(name, (o2_info_ptr) remote, remote, "");
         o2_send_initialize(remote, hub_flag);
         o2_send_services(remote);
-        if (hub_flag == O2_CLIENT_IS_HUB) {
+        if (hub_flag == O2_CLIENT_IS_HUB && !scalable_hub) {
             o2_send_discovery(remote);
         }
         if (hub_flag == O2_CLIENT_IS_HUB) {
@@ -553,35 +893,48 @@ void o2_discovery_init_handler(o2_msg_data_ptr msg, const char *types,
     o2_entry_ptr *entry_ptr = o2_lookup(&o2_path_tree, name);
     O2_DBd(printf("%s o2_discovery_init_handler looked up %s -> %p\n",
                   o2_debug_prefix, name, entry_ptr));
-    if (!*entry_ptr) { // we are the server, and we accepted a client connection,
-        // but we did not yet create a service named for client's IP:port
+    // the entry may describe a process that is known but not connected
+    process_info_ptr lazy = NULL;
+    if (*entry_ptr) {
+        services_entry_ptr services = (services_entry_ptr) *entry_ptr;
+        process_info_ptr remote = (process_info_ptr)
+                GET_SERVICE(services->services, 0);
+        if (remote->tag == TCP_SOCKET && remote->fds_index == -1) {
+            lazy = remote;
+        }
+    }
+    if (!*entry_ptr || lazy) { // we are the server, and we accepted a client
+        // connection, but we did not yet create a service named for client's
+        // IP:port, or the service belongs to an unconnected process_info
         int hub_flag = hub_arg->i32;
         assert(info->tag == TCP_SOCKET);
-        o2_service_provider_new(name, (o2_info_ptr) info, info, "");
         assert(info->proc.name == NULL);
-        info->proc.name = o2_heapify(name);
+        if (lazy) { // the connection takes over name, services and queue
+            lazy_proc_merge(lazy, info);
+        } else {
+            o2_service_provider_new(name, (o2_info_ptr) info, info, "");
+            info->proc.name = o2_heapify(name);
+        }
         // uses_hub means info->proc, the remote proc, is using us as the hub;
         // that's true if O2_SERVER_IS_HUB because we are the server:
         info->proc.uses_hub = (hub_flag == O2_SERVER_IS_HUB);
         // now that we have a name and service, we can send init message back:
         o2_send_initialize(info, hub_flag);
         o2_send_services(info);
-        if (hub_flag == O2_SERVER_IS_HUB) {
+        if (hub_flag == O2_SERVER_IS_HUB && !scalable_hub) {
             o2_send_discovery(info);
         }
+        send_pending(info);
     } // else we are the client, and we connected after receiving a
       // /dy message, also created a service named for server's IP:port
     info->proc.status = status;
-    info->proc.udp_sa.sin_family = AF_INET;
     assert(info != o2_process);
     info->port = udp_port;
-
-#ifdef __APPLE__
-    info->proc.udp_sa.sin_len = sizeof(info->proc.udp_sa);
-#endif
-
-    inet_pton(AF_INET, ip, &(info->proc.udp_sa.sin_addr.s_addr));
-    info->proc.udp_sa.sin_port = htons(udp_port);
+    set_sockaddr(&info->proc.udp_sa, ip, udp_port);
+    peer_cache_add(ip, tcp_port, udp_port);
+    if (info->proc.uses_hub && scalable_hub) {
+        hub_client_join(info); // needs info->port, so do this last
+    }
 
     O2_DBd(printf("%s init msg from %s (udp port %ld)\n   to local socket "
                   "%ld process_info %p\n", o2_debug_prefix, name, 
@@ -590,26 +943,20 @@ void o2_discovery_init_handler(o2_msg_data_ptr msg, const char *types,
 }
 
 
-// /ip:port/sv: called to announce services available or removed. Arguments are
-//     process name, service1, added_flag, tappee, service2, added_flag, tappee, ...
+// apply service updates from proc: the message parameters (after those
+// named by the typecodes in skip) are service, added flag, tappee for each
+// service. If complete is true, the message lists all services offered
+// by proc, and services that are not listed are removed.
 //
-void o2_services_handler(o2_msg_data_ptr msg, const char *types,
-                         o2_arg_ptr *argv, int argc, void *user_data)
+static void update_services(process_info_ptr proc, o2_msg_data_ptr msg,
+                            const char *skip, int complete)
 {
-    o2_extract_start(msg);
-    o2_arg_ptr arg = o2_get_next('s');
-    if (!arg) return;
-    char *name = arg->s;
-    // note that name is padded with zeros to 32-bit boundary
-    services_entry_ptr services;
-    process_info_ptr proc = (process_info_ptr) o2_service_find(name, &services);
-    if (!proc || proc->tag != TCP_SOCKET) {
-        O2_DBg(printf("%s ### ERROR: o2_services_handler did not find %s\n", 
-                      o2_debug_prefix, name));
-        return; // message is bogus (should we report this?)
-    }
+    o2_arg_ptr arg;        // string - service name
     o2_arg_ptr addarg;     // boolean - adding a service or deleting one?
     o2_arg_ptr tappeearg;  // string - non-empty if we are tapping a service
+    int skip_len = (int) strlen(skip);
+    o2_extract_start(msg);
+    for (int j = 0; j < skip_len; j++) o2_get_next(skip[j]);
     while ((arg = o2_get_next('s')) && (addarg = o2_get_next('B')) &&
            (tappeearg = o2_get_next('s'))) {
         if (strchr(arg->s, '/')) {
@@ -625,4 +972,757 @@ void o2_services_handler(o2_msg_data_ptr msg, const char *types,
             o2_service_provider_replace(proc, arg->s, NULL);
         }
     }
+    if (!complete) return;
+    // remove services that are not in the list. Removal moves the last
+    // service into the removed service's place, so search from the end.
+    for (int i = proc->proc.services.length - 1; i >= 0; i--) {
+        o2string service = *DA_GET(proc->proc.services, o2string, i);
+        if (streql(service, proc->proc.name)) continue;
+        int listed = FALSE;
+        o2_extract_start(msg);
+        for (int j = 0; j < skip_len; j++) o2_get_next(skip[j]);
+        while (!listed && (arg = o2_get_next('s')) && o2_get_next('B') &&
+               o2_get_next('s')) {
+            listed = streql(arg->s, service);
+        }
+        if (!listed) {
+            O2_DBd(printf("%s service /%s is no longer offered by /%s\n",
+                          o2_debug_prefix, service, proc->proc.name));
+            o2_service_provider_replace(proc, service, NULL);
+        }
+    }
+}
+
+
+// /ip:port/sv: called to announce services available or removed. Arguments
+//     are process name, version of its service table, complete flag, then
+//     service1, added_flag, tappee, service2, added_flag, tappee, ...
+// Each batch of changes increments the version. If a batch is missing
+// (which can happen with UDP to a process that is not connected), we
+// ask for the complete list with a /sr message.
+//
+void o2_services_handler(o2_msg_data_ptr msg, const char *types,
+                         o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_extract_start(msg);
+    o2_arg_ptr arg, seq_arg, complete_arg;
+    if (!(arg = o2_get_next('s')) || !(seq_arg = o2_get_next('i')) ||
+        !(complete_arg = o2_get_next('B'))) {
+        return;
+    }
+    char *name = arg->s;
+    // note that name is padded with zeros to 32-bit boundary
+    services_entry_ptr services;
+    process_info_ptr proc = (process_info_ptr) o2_service_find(name, &services);
+    if (!proc || proc->tag != TCP_SOCKET) {
+        O2_DBg(printf("%s ### ERROR: o2_services_handler did not find %s\n", 
+                      o2_debug_prefix, name));
+        return; // message is bogus (should we report this?)
+    }
+    int32_t seq = seq_arg->i32;
+    int complete = complete_arg->B;
+    if (complete ? seq < proc->proc.services_seq :
+                   seq <= proc->proc.services_seq) {
+        O2_DBd(printf("%s o2_services_handler ignored old version %d from %s\n",
+                      o2_debug_prefix, seq, name));
+        return;
+    }
+    if (!complete && seq != proc->proc.services_seq + 1) {
+        // a complete list is always sent when a connection is made, so if
+        // we have none, it is on the way. Otherwise we missed some changes:
+        if (proc->proc.services_seq != -1) {
+            O2_DBd(printf("%s o2_services_handler missed changes from %s, "
+                          "requesting all services\n", o2_debug_prefix, name));
+            char address[32];
+            snprintf(address, 32, "!%s/sr", proc->proc.name);
+            if (proc->fds_index == -1) {
+                o2_send(address, 0.0, "s", o2_process->proc.name);
+            } else {
+                o2_send_cmd(address, 0.0, "s", o2_process->proc.name);
+            }
+        }
+        return;
+    }
+    proc->proc.services_seq = seq;
+    update_services(proc, msg, "siB", complete);
+}
+
+
+// /ip:port/sr: another process is missing some of our service changes,
+//     so send the complete list. The argument is the process name.
+//
+void o2_services_request_handler(o2_msg_data_ptr msg, const char *types,
+                                 o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_extract_start(msg);
+    o2_arg_ptr arg = o2_get_next('s');
+    if (!arg) return;
+    services_entry_ptr services;
+    process_info_ptr proc = (process_info_ptr) o2_service_find(arg->s,
+                                                               &services);
+    if (!proc || proc->tag != TCP_SOCKET) {
+        O2_DBg(printf("%s ### ERROR: o2_services_request_handler did not "
+                      "find %s\n", o2_debug_prefix, arg->s));
+        return;
+    }
+    o2_send_services(proc);
+}
+
+
+// fill in an IPv4 address to send UDP messages to ip:port
+static void set_sockaddr(struct sockaddr_in *sa, const char *ip, int port)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+#ifdef __APPLE__
+    sa->sin_len = sizeof(*sa);
+#endif
+    inet_pton(AF_INET, ip, &(sa->sin_addr.s_addr));
+    sa->sin_port = htons(port);
+}
+
+
+// send !_o2/lz to a discovery or UDP port. The message tells the receiver
+// how to reach this process and what services it offers. Parameters are
+// mode, application name, ip, tcp port, udp port, clocksync, version of
+// the service table, and then service, added flag (always true), tappee
+// for each service as in /sv
+//
+static int send_lazy_info(struct sockaddr_in *to, int32_t mode)
+{
+    // pending changes are sent first so that the version number in this
+    // message is up to date
+    o2_flush_service_changes();
+    int err = o2_send_start() ||
+        o2_add_int32(mode) ||
+        o2_add_string(o2_application_name) ||
+        o2_add_string(o2_local_ip) ||
+        o2_add_int32(o2_local_tcp_port) ||
+        o2_add_int32(o2_process->port) ||
+        o2_add_int32(o2_clock_is_synchronized) ||
+        o2_add_int32(o2_services_seq);
+    for (int i = 0; !err && i < o2_process->proc.services.length; i++) {
+        char *service = *DA_GET(o2_process->proc.services, char *, i);
+        // ugly, but just a fast test if service is _o2:
+        if ((*((int32_t *) service) != *((int32_t *) "_o2"))) {
+            err = o2_add_string(service) || o2_add_only_typecode(O2_TRUE) ||
+                  o2_add_string("");
+        }
+    }
+    o2_message_ptr msg;
+    if (err || !(msg = o2_message_finish(0.0, "!_o2/lz", FALSE)))
+        return O2_FAIL;
+    O2_DBd(o2_dbg_msg("send_lazy_info", &msg->data, NULL, NULL));
+#if IS_LITTLE_ENDIAN
+    o2_msg_swap_endian(&msg->data, TRUE);
+#endif
+    err = O2_SUCCESS;
+    if (sendto(local_send_sock, (char *) &msg->data, msg->length, 0,
+               (struct sockaddr *) to, sizeof(*to)) < 0) {
+        perror("Error attempting to send lazy connection info");
+        err = O2_FAIL;
+    }
+    o2_message_free(msg);
+    return err;
+}
+
+
+// create a process_info for a process that is known but not connected
+static process_info_ptr lazy_proc_new(o2string name, const char *ip,
+                                      int udp_port, int status)
+{
+    process_info_ptr info = (process_info_ptr)
+            O2_CALLOC(1, sizeof(process_info));
+    info->tag = TCP_SOCKET;
+    info->fds_index = -1;
+    o2_process_initialize(info, status, FALSE);
+    info->proc.name = o2_heapify(name);
+    info->port = udp_port;
+    set_sockaddr(&info->proc.udp_sa, ip, udp_port);
+    // the address we would connect to, used by peer_cache_forget()
+    set_sockaddr(&info->proc.tcp_sa, ip, atoi(strchr(name, ':') + 1));
+    DA_APPEND(o2_lazy_procs, process_info_ptr, info);
+    o2_service_provider_new(name, (o2_info_ptr) info, info, "");
+    O2_DBd(printf("%s lazy_proc_new created %s (udp port %d)\n",
+                  o2_debug_prefix, name, udp_port));
+    return info;
+}
+
+
+static void lazy_proc_unlist(process_info_ptr lazy)
+{
+    for (int i = 0; i < o2_lazy_procs.length; i++) {
+        if (*DA_GET(o2_lazy_procs, process_info_ptr, i) == lazy) {
+            DA_REMOVE(o2_lazy_procs, process_info_ptr, i);
+            return;
+        }
+    }
+}
+
+
+// remove an unconnected process, its services and queued messages
+static void lazy_proc_free(process_info_ptr lazy)
+{
+    lazy_proc_unlist(lazy);
+    o2_remove_remote_process(lazy); // removes services, name and queue
+    O2_FREE(lazy);
+}
+
+
+// move the name, services, UDP address and queued messages of an
+// unconnected process to info, which describes a new connection to the
+// same process, and free the unconnected process_info
+//
+static void lazy_proc_merge(process_info_ptr lazy, process_info_ptr info)
+{
+    O2_DBd(printf("%s lazy_proc_merge %s is now connected (socket %d)\n",
+                  o2_debug_prefix, lazy->proc.name, info->fds_index));
+    for (int i = 0; i < lazy->proc.services.length; i++) {
+        o2string service = *DA_GET(lazy->proc.services, o2string, i);
+        o2_service_provider_replace(lazy, service, (o2_info_ptr) info);
+    }
+    DA_FINISH(info->proc.services);
+    info->proc.services = lazy->proc.services;
+    info->proc.name = lazy->proc.name;
+    info->port = lazy->port;
+    info->proc.udp_sa = lazy->proc.udp_sa;
+    info->proc.services_seq = lazy->proc.services_seq;
+    info->proc.pending = lazy->proc.pending;
+    info->msgs_out += lazy->msgs_out; // UDP sent before connecting
+    info->bytes_out += lazy->bytes_out;
+    info->send_errors += lazy->send_errors;
+    lazy_proc_unlist(lazy);
+    O2_FREE(lazy);
+}
+
+
+// send messages that were queued while info was not connected
+static void send_pending(process_info_ptr info)
+{
+    while (info->proc.pending) {
+        o2_message_ptr msg = info->proc.pending;
+        info->proc.pending = msg->next;
+        send_by_tcp_to_process(info, &msg->data);
+        o2_message_free(msg);
+    }
+}
+
+
+// connect to an unconnected process. We must be the client, i.e. our
+// name is lower. On success, lazy is freed.
+//
+static int lazy_proc_connect(process_info_ptr lazy)
+{
+    char ip[32];
+    strcpy(ip, lazy->proc.name);
+    char *colon = strchr(ip, ':');
+    assert(colon);
+    *colon = 0; // isolate the ipaddress from ip:port
+    int tcp_port = atoi(colon + 1);
+    process_info_ptr remote;
+    O2_DBg(printf("%s ** Connecting on demand to %s\n",
+                  o2_debug_prefix, lazy->proc.name));
+    if (o2_make_tcp_connection(ip, tcp_port, &remote, FALSE)) {
+        lazy_proc_free(lazy); // the process seems to be gone
+        return O2_FAIL;
+    }
+    // the queued messages must follow !_o2/in and /sv
+    o2_message_ptr pending = lazy->proc.pending;
+    lazy->proc.pending = NULL;
+    lazy_proc_merge(lazy, remote);
+    o2_send_initialize(remote, O2_NO_HUB);
+    o2_send_services(remote);
+    o2_message_ptr *last = &remote->proc.pending;
+    while (*last) last = &((*last)->next);
+    *last = pending;
+    if (remote->proc.status != PROCESS_CONNECTING) {
+        send_pending(remote);
+    }
+    return O2_SUCCESS;
+}
+
+
+// queue a copy of msg on info->proc.pending, to be sent by send_pending()
+// when info is connected
+//
+int o2_pending_append(process_info_ptr info, o2_msg_data_ptr msg)
+{
+    int len = MSG_DATA_LENGTH(msg);
+    o2_message_ptr copy = o2_alloc_size_message(len);
+    if (!copy) return O2_NO_MEMORY;
+    memcpy((char *) &(copy->data), msg, len);
+    copy->length = len;
+    copy->tcp_flag = TRUE;
+    copy->next = NULL;
+    o2_message_ptr *last = &info->proc.pending; // append to preserve order
+    while (*last) last = &((*last)->next);
+    *last = copy;
+    return O2_SUCCESS;
+}
+
+
+// called by send_by_tcp_to_process() when info is not connected. A copy
+// of msg is queued, and either we connect (if we are the client) or we
+// ask the other process to connect. Since a request can be lost, it is
+// repeated for each message sent until the connection is made.
+//
+// At most LAZY_PENDING_MAX messages are queued; others are dropped.
+// If the process does not answer within connect_timeout of the first
+// unanswered request, lazy_proc_expire() forgets it.
+//
+int o2_lazy_send(process_info_ptr info, o2_msg_data_ptr msg)
+{
+    int queued = 0;
+    o2_message_ptr pending;
+    for (pending = info->proc.pending; pending; pending = pending->next) {
+        queued++;
+    }
+    int err = O2_SUCCESS;
+    if (queued < LAZY_PENDING_MAX) {
+        RETURN_IF_ERROR(o2_pending_append(info, msg));
+    } else {
+        O2_DBd(printf("%s o2_lazy_send dropped message to %s, queue full\n",
+                      o2_debug_prefix, info->proc.name));
+        o2_dropped_queue_full++;
+        err = O2_FAIL;
+    }
+    if (strcmp(o2_process->proc.name, info->proc.name) < 0) {
+        RETURN_IF_ERROR(lazy_proc_connect(info)); // we are the client
+        return err;
+    }
+    if (info->proc.connect_deadline == 0) {
+        info->proc.connect_deadline = o2_local_time() + connect_timeout;
+    }
+    send_lazy_info(&info->proc.udp_sa, LAZY_CONNECT);
+    return err;
+}
+
+
+// called by o2_connect_poll(): forget unconnected processes that were
+// asked to connect and did not answer in time, as lazy_proc_connect()
+// does when it cannot connect
+//
+static void lazy_proc_expire()
+{
+    for (int i = o2_lazy_procs.length - 1; i >= 0; i--) {
+        process_info_ptr lazy = *DA_GET(o2_lazy_procs, process_info_ptr, i);
+        if (lazy->proc.connect_deadline != 0 &&
+            o2_local_now > lazy->proc.connect_deadline) {
+            O2_DBd(printf("%s lazy_proc_expire %s did not connect\n",
+                          o2_debug_prefix, lazy->proc.name));
+            peer_cache_forget(&lazy->proc.tcp_sa);
+            lazy_proc_free(lazy);
+        }
+    }
+}
+
+
+// /_o2/lz handler, parameters are: mode, application name, ip, tcp, udp,
+//     clocksync, then service, added flag, tappee for each service
+//
+void o2_lazy_handler(o2_msg_data_ptr msg, const char *types,
+                     o2_arg_ptr *argv, int argc, void *user_data)
+{
+    O2_DBd(o2_dbg_msg("o2_lazy_handler gets", msg, NULL, NULL));
+    o2_arg_ptr mode_arg, app_arg, ip_arg, tcp_arg, udp_arg, clocksync_arg;
+    o2_arg_ptr seq_arg;
+    o2_extract_start(msg);
+    if (!(mode_arg = o2_get_next('i')) ||
+        !(app_arg = o2_get_next('s')) ||
+        !(ip_arg = o2_get_next('s')) ||
+        !(tcp_arg = o2_get_next('i')) ||
+        !(udp_arg = o2_get_next('i')) ||
+        !(clocksync_arg = o2_get_next('i')) ||
+        !(seq_arg = o2_get_next('i'))) {
+        return;
+    }
+    if (!streql(app_arg->s, o2_application_name)) {
+        O2_DBd(printf("    Ignored: application name is not %s\n",
+                      o2_application_name));
+        return;
+    }
+    char name[32];
+    // ip:port + pad with zeros
+    snprintf(name, 32, "%s:%d%c%c%c%c", ip_arg->s, tcp_arg->i32, 0, 0, 0, 0);
+    int compare = strcmp(o2_process->proc.name, name);
+    if (compare == 0) return;
+    process_info_ptr info;
+    services_entry_ptr *entry_ptr = (services_entry_ptr *)
+            o2_lookup(&o2_path_tree, name);
+    if (*entry_ptr) {
+        info = (process_info_ptr) GET_SERVICE((*entry_ptr)->services, 0);
+        if (info->tag != TCP_SOCKET || info->fds_index != -1) {
+            O2_DBd(printf("    Ignored: already connected\n"));
+            return; // services are reported over TCP by /sv messages
+        }
+        info->proc.connect_deadline = 0; // it answered, see o2_lazy_send()
+        // the record may come from a !_o2/hd message, which does not
+        // report clock status
+        info->proc.status = (clocksync_arg->i32 ? PROCESS_OK :
+                                                  PROCESS_NO_CLOCK);
+    } else {
+        info = lazy_proc_new(name, ip_arg->s, udp_arg->i32,
+                             clocksync_arg->i32 ? PROCESS_OK :
+                                                  PROCESS_NO_CLOCK);
+        peer_cache_add(ip_arg->s, tcp_arg->i32, udp_arg->i32);
+    }
+    // the message has a complete list of services
+    int32_t mode = mode_arg->i32;
+    if (seq_arg->i32 >= info->proc.services_seq) {
+        info->proc.services_seq = seq_arg->i32;
+        update_services(info, msg, "issiiii", TRUE);
+    }
+    if (mode == LAZY_REPLY) {
+        send_lazy_info(&info->proc.udp_sa, LAZY_INFO);
+    } else if (mode == LAZY_CONNECT && compare < 0) {
+        lazy_proc_connect(info);
+    }
+}
+
+
+// free all unconnected processes, called by o2_finish()
+void o2_lazy_finish()
+{
+    while (o2_lazy_procs.length > 0) {
+        lazy_proc_free(*DA_LAST(o2_lazy_procs, process_info_ptr));
+    }
+    DA_FINISH(o2_lazy_procs);
+}
+
+
+// set the fields of a peer cache entry
+static void peer_cache_set(peer_cache_entry_ptr entry, const char *app,
+                           const char *ip, int tcp_port, int udp_port)
+{
+    entry->app = o2_heapify(app);
+    snprintf(entry->ip, sizeof(entry->ip), "%s", ip);
+    entry->tcp_port = tcp_port;
+    entry->udp_port = udp_port;
+}
+
+
+// remove the peer cache entry at index i, keeping the others in order
+static void peer_cache_remove(int i)
+{
+    O2_FREE((void *) DA_GET(peer_cache, peer_cache_entry, i)->app);
+    memmove(DA_GET(peer_cache, peer_cache_entry, i),
+            DA_GET(peer_cache, peer_cache_entry, i + 1),
+            (peer_cache.length - i - 1) * sizeof(peer_cache_entry));
+    peer_cache.length--;
+}
+
+
+// write the peer cache file, one process per line: application name,
+// ip, tcp port and udp port separated by spaces
+static void peer_cache_write()
+{
+    FILE *outf = fopen(peer_cache_file, "w");
+    if (!outf) {
+        perror("Error attempting to write peer cache");
+        return;
+    }
+    for (int i = 0; i < peer_cache.length; i++) {
+        peer_cache_entry_ptr entry = DA_GET(peer_cache, peer_cache_entry, i);
+        fprintf(outf, "%s %s %d %d\n", entry->app, entry->ip,
+                entry->tcp_port, entry->udp_port);
+    }
+    fclose(outf);
+}
+
+
+// called by o2_connect_poll(): write the peer cache file if it changed,
+// but not more than once per discovery period, since many processes
+// can be found in one period
+static void peer_cache_poll()
+{
+    if (peer_cache_dirty && (peer_cache_write_time < 0 ||
+            o2_local_now >= peer_cache_write_time + o2_discovery_period)) {
+        peer_cache_write();
+        peer_cache_dirty = FALSE;
+        peer_cache_write_time = o2_local_now;
+    }
+}
+
+
+// record a process of this application as the most recent entry in the
+// peer cache; the file is written later by peer_cache_poll()
+static void peer_cache_add(const char *ip, int tcp_port, int udp_port)
+{
+    if (!peer_cache_file) return;
+    for (int i = 0; i < peer_cache.length; i++) {
+        peer_cache_entry_ptr entry = DA_GET(peer_cache, peer_cache_entry, i);
+        if (streql(entry->app, o2_application_name) &&
+            streql(entry->ip, ip) && entry->tcp_port == tcp_port) {
+            peer_cache_remove(i);
+            break;
+        }
+    }
+    if (peer_cache.length >= PEER_CACHE_MAX) { // forget the oldest
+        peer_cache_remove(peer_cache.length - 1);
+    }
+    DA_EXPAND(peer_cache, peer_cache_entry);
+    memmove(DA_GET(peer_cache, peer_cache_entry, 1),
+            DA_GET(peer_cache, peer_cache_entry, 0),
+            (peer_cache.length - 1) * sizeof(peer_cache_entry));
+    peer_cache_set(DA_GET(peer_cache, peer_cache_entry, 0),
+                   o2_application_name, ip, tcp_port, udp_port);
+    peer_cache_dirty = TRUE;
+}
+
+
+// remove a process that could not be reached from the peer cache
+static void peer_cache_forget(struct sockaddr_in *sa)
+{
+    if (!peer_cache_file) return;
+    char ip[24];
+    if (!inet_ntop(AF_INET, &sa->sin_addr, ip, sizeof(ip))) return;
+    for (int i = 0; i < peer_cache.length; i++) {
+        peer_cache_entry_ptr entry = DA_GET(peer_cache, peer_cache_entry, i);
+        if (streql(entry->app, o2_application_name) &&
+            streql(entry->ip, ip) && entry->tcp_port == ntohs(sa->sin_port)) {
+            peer_cache_remove(i);
+            peer_cache_dirty = TRUE;
+            return;
+        }
+    }
+}
+
+
+// contact each cached process of this application directly rather than
+// waiting for it to be discovered. As in o2_discovery_handler(), if we
+// are the client we connect, otherwise we send our /dy message to the
+// process's UDP port so that it connects to us. In lazy mode, we send
+// our !_o2/lz info instead. Processes that cannot be reached are removed
+// from the cache (see connect_failed()), so we go from the oldest entry
+// to the newest, and removals do not affect entries yet to be visited.
+//
+static void peer_cache_join()
+{
+    for (int i = peer_cache.length - 1; i >= 0; i--) {
+        peer_cache_entry_ptr entry = DA_GET(peer_cache, peer_cache_entry, i);
+        char name[32];
+        // ip:port + pad with zeros
+        snprintf(name, 32, "%s:%d%c%c%c%c", entry->ip, entry->tcp_port,
+                 0, 0, 0, 0);
+        int compare = strcmp(o2_process->proc.name, name);
+        if (!streql(entry->app, o2_application_name) || compare == 0 ||
+            *o2_lookup(&o2_path_tree, name)) {
+            continue;
+        }
+        O2_DBd(printf("%s peer_cache_join contacting %s\n",
+                      o2_debug_prefix, name));
+        struct sockaddr_in udp_sa;
+        set_sockaddr(&udp_sa, entry->ip, entry->udp_port);
+        if (o2_lazy_connect) {
+            send_lazy_info(&udp_sa, LAZY_REPLY);
+        } else if (compare < 0) { // we are the client
+            o2_discovery_by_tcp(entry->ip, entry->tcp_port, name,
+                                FALSE, FALSE);
+        } else if (sendto(local_send_sock, (char *) &o2_discovery_msg->data,
+                          o2_discovery_msg->length, 0,
+                          (struct sockaddr *) &udp_sa, sizeof(udp_sa)) < 0) {
+            perror("Error attempting to send discovery message directly");
+        }
+    }
+}
+
+
+int o2_set_peer_cache(const char *filename)
+{
+    if (!o2_application_name) return O2_NOT_INITIALIZED;
+    peer_cache_free();
+    if (!filename) return O2_SUCCESS;
+    peer_cache_file = o2_heapify(filename);
+    DA_INIT(peer_cache, peer_cache_entry, PEER_CACHE_MAX);
+    FILE *inf = fopen(filename, "r");
+    if (inf) {
+        char app[128];
+        char ip[24];
+        int tcp_port, udp_port;
+        while (peer_cache.length < PEER_CACHE_MAX &&
+               fscanf(inf, "%127s %23s %d %d",
+                      app, ip, &tcp_port, &udp_port) == 4) {
+            DA_EXPAND(peer_cache, peer_cache_entry);
+            peer_cache_set(DA_LAST(peer_cache, peer_cache_entry),
+                           app, ip, tcp_port, udp_port);
+        }
+        fclose(inf);
+    }
+    O2_DBd(printf("%s o2_set_peer_cache read %d processes from %s\n",
+                  o2_debug_prefix, peer_cache.length, filename));
+    peer_cache_join();
+    return O2_SUCCESS;
+}
+
+
+// write any changes and free the peer cache, called by
+// o2_discovery_finish() and o2_set_peer_cache()
+static void peer_cache_free()
+{
+    if (!peer_cache_file) return;
+    if (peer_cache_dirty) {
+        peer_cache_write();
+        peer_cache_dirty = FALSE;
+    }
+    peer_cache_write_time = -1;
+    while (peer_cache.length > 0) {
+        peer_cache_remove(peer_cache.length - 1);
+    }
+    DA_FINISH(peer_cache);
+    O2_FREE((void *) peer_cache_file);
+    peer_cache_file = NULL;
+}
+
+
+int o2_set_scalable_hub(int scalable)
+{
+    int old = scalable_hub;
+    scalable_hub = scalable;
+    return old;
+}
+
+
+// send entries, which are hub_event structs, to a hub client in
+// !_o2/hd messages of up to HUB_BATCH_MAX entries, skipping the entry
+// for the client itself. Parameters are ip:port, udp port and joined
+// flag for each process.
+//
+static int hub_send_entries(process_info_ptr client, hub_event_ptr entries,
+                            int n)
+{
+    int i = 0;
+    while (i < n) {
+        int count = 0;
+        int err = o2_send_start();
+        for (; !err && i < n && count < HUB_BATCH_MAX; i++) {
+            if (streql(entries[i].name, client->proc.name)) continue;
+            err = o2_add_string(entries[i].name) ||
+                  o2_add_int32(entries[i].udp_port) ||
+                  o2_add_bool(entries[i].joined);
+            count++;
+        }
+        o2_message_ptr msg;
+        if (err || !(msg = o2_message_finish(0.0, "!_o2/hd", TRUE)))
+            return O2_FAIL;
+        if (count > 0) {
+            O2_DBd(printf("%s hub_send_entries sending %d processes to %s\n",
+                          o2_debug_prefix, count, client->proc.name));
+            err = send_by_tcp_to_process(client, &msg->data);
+        }
+        o2_message_free(msg);
+        RETURN_IF_ERROR(err);
+    }
+    return O2_SUCCESS;
+}
+
+
+// add a connected process that uses us as its hub to hub_clients, send
+// it the current directory and tell the others in the next flush
+//
+static void hub_client_join(process_info_ptr info)
+{
+    for (int i = 0; i < hub_clients.length; i++) {
+        if (*DA_GET(hub_clients, process_info_ptr, i) == info) return;
+    }
+    // the snapshot: a temporary array of join entries that borrow names
+    hub_event_ptr entries = (hub_event_ptr)
+            O2_MALLOC((hub_clients.length + 1) * sizeof(hub_event));
+    for (int i = 0; i < hub_clients.length; i++) {
+        process_info_ptr client = *DA_GET(hub_clients, process_info_ptr, i);
+        entries[i].name = client->proc.name;
+        entries[i].udp_port = client->port;
+        entries[i].joined = TRUE;
+    }
+    hub_send_entries(info, entries, hub_clients.length);
+    O2_FREE(entries);
+    DA_APPEND(hub_clients, process_info_ptr, info);
+    DA_EXPAND(hub_events, hub_event);
+    hub_event_ptr event = DA_LAST(hub_events, hub_event);
+    event->name = o2_heapify(info->proc.name);
+    event->udp_port = info->port;
+    event->joined = TRUE;
+}
+
+
+// called by o2_remove_remote_process(): if info is a hub client, remove
+// it from hub_clients and tell the others in the next flush
+//
+void o2_hub_remove(process_info_ptr info)
+{
+    int i;
+    for (i = 0; i < hub_clients.length; i++) {
+        if (*DA_GET(hub_clients, process_info_ptr, i) == info) break;
+    }
+    if (i >= hub_clients.length) return;
+    DA_REMOVE(hub_clients, process_info_ptr, i);
+    for (i = 0; i < hub_events.length; i++) {
+        hub_event_ptr event = DA_GET(hub_events, hub_event, i);
+        if (streql(event->name, info->proc.name)) {
+            // the others have not heard about the join yet
+            O2_FREE((void *) event->name);
+            DA_REMOVE(hub_events, hub_event, i);
+            return;
+        }
+    }
+    DA_EXPAND(hub_events, hub_event);
+    hub_event_ptr event = DA_LAST(hub_events, hub_event);
+    event->name = o2_heapify(info->proc.name);
+    event->udp_port = info->port;
+    event->joined = FALSE;
+}
+
+
+// send the joins and leaves collected since the last call to every hub
+// client, called by o2_poll()
+//
+void o2_hub_flush_events()
+{
+    if (hub_events.length == 0) return;
+    for (int i = 0; i < hub_clients.length; i++) {
+        hub_send_entries(*DA_GET(hub_clients, process_info_ptr, i),
+                         (hub_event_ptr) hub_events.array, hub_events.length);
+    }
+    for (int i = 0; i < hub_events.length; i++) {
+        O2_FREE((void *) DA_GET(hub_events, hub_event, i)->name);
+    }
+    hub_events.length = 0;
+}
+
+
+// /_o2/hd handler, parameters are ip:port, udp port and joined flag for
+// each process that joined or left our scalable hub. New processes are
+// recorded as known but not connected, and we exchange !_o2/lz messages
+// with them to learn their services, so that we connect only to the
+// processes we send messages to (see o2_set_lazy_connect()).
+//
+void o2_hub_directory_handler(o2_msg_data_ptr msg, const char *types,
+                              o2_arg_ptr *argv, int argc, void *user_data)
+{
+    O2_DBd(o2_dbg_msg("o2_hub_directory_handler gets", msg, NULL, NULL));
+    o2_arg_ptr name_arg, udp_arg, joined_arg;
+    o2_extract_start(msg);
+    while ((name_arg = o2_get_next('s')) && (udp_arg = o2_get_next('i')) &&
+           (joined_arg = o2_get_next('B'))) {
+        char *name = name_arg->s;
+        if (streql(name, o2_process->proc.name)) continue;
+        services_entry_ptr *entry_ptr = (services_entry_ptr *)
+                o2_lookup(&o2_path_tree, name);
+        process_info_ptr info = NULL;
+        if (*entry_ptr) {
+            info = (process_info_ptr) GET_SERVICE((*entry_ptr)->services, 0);
+        }
+        if (joined_arg->B) {
+            if (info) continue; // already known or connected
+            char ip[32];
+            snprintf(ip, 32, "%s", name);
+            char *colon = strchr(ip, ':');
+            if (!colon) continue;
+            *colon = 0; // isolate the ipaddress from ip:port
+            info = lazy_proc_new(name, ip, udp_arg->i32, PROCESS_NO_CLOCK);
+            send_lazy_info(&info->proc.udp_sa, LAZY_REPLY);
+        } else if (info && info->tag == TCP_SOCKET && info->fds_index == -1) {
+            // connected processes are removed when their sockets close
+            lazy_proc_free(info);
+        }
+    }
 }
@@ -14,6 +14,12 @@
 extern o2_message_ptr o2_discovery_msg;
 
 extern SOCKET o2_discovery_socket;
+
+// processes that are known but not connected (see o2_set_lazy_connect())
+extern dyn_array o2_lazy_procs;
+// messages dropped because the queue of a process in o2_lazy_procs
+// was full
+extern int64_t o2_dropped_queue_full;
 extern int o2_port_map[16];
 
 /**
@@ -55,12 +61,35 @@ void o2_discovery_init_handler(o2_msg_data_ptr msg, const char *types,
 void o2_services_handler(o2_msg_data_ptr msg, const char *types,
                          o2_arg_ptr *argv, int argc, void *user_data);
 
+void o2_services_request_handler(o2_msg_data_ptr msg, const char *types,
+                                 o2_arg_ptr *argv, int argc, void *user_data);
+
 int o2_make_tcp_connection(const char *ip, int tcp_port,
-        o2_socket_handler handler, process_info_ptr *info, int hub_flag);
+                           process_info_ptr *info, int hub_flag);
+
+void o2_connect_cancel(process_info_ptr info);
+
+void o2_connect_poll();
+
+int o2_pending_append(process_info_ptr info, o2_msg_data_ptr msg);
 
 int o2_discovery_by_tcp(const char *ipaddress, int port, char *name,
                         int be_server, int32_t hub_flag);
 
+int o2_lazy_send(process_info_ptr info, o2_msg_data_ptr msg);
+
+void o2_lazy_handler(o2_msg_data_ptr msg, const char *types,
+                     o2_arg_ptr *argv, int argc, void *user_data);
+
+void o2_lazy_finish();
+
+void o2_hub_remove(process_info_ptr info);
+
+void o2_hub_flush_events();
+
+void o2_hub_directory_handler(o2_msg_data_ptr msg, const char *types,
+                              o2_arg_ptr *argv, int argc, void *user_data);
+
 
 
 #endif /* O2_discovery_h */
@@ -153,6 +153,8 @@ extern o2_time o2_global_now;
 extern int o2_gtsched_started;
 
 #define DEFAULT_DISCOVERY_PERIOD 4.0
+#define DEFAULT_CONNECT_TIMEOUT 2.0 // see o2_set_connect_limits()
+#define DEFAULT_CONNECT_MAX 8
 extern o2_time o2_discovery_period;
 
 #define O2_ARGS_END O2_MARKER_A, O2_MARKER_B
@@ -196,6 +198,10 @@ extern int o2_argc; // length of argv
 // shared internal functions
 void o2_notify_others(const char *service_name, int added, const char *tappee);
 
+void o2_flush_service_changes();
+
+extern int32_t o2_services_seq; // version of the local service table
+
 o2_info_ptr o2_proc_service_find(process_info_ptr proc, services_entry_ptr *services);
 
 int o2_service_provider_new(o2string key, o2_info_ptr service, process_info_ptr process,
@@ -203,6 +209,10 @@ int o2_service_provider_new(o2string key, o2_info_ptr service, process_info_ptr
 
 int o2_status_from_info(o2_info_ptr entry, const char **process);
 
+// use callback for o2_local_time() without becoming the master, as
+// o2_clock_set() does; test/clocksyncbench.c uses it to make clocks drift
+int o2_local_clock_set(o2_time_callback callback, void *data);
+
 
 #define O2_NO_HUB 0
 #define O2_CLIENT_IS_HUB 1
@@ -212,5 +222,8 @@ int o2_status_from_info(o2_info_ptr entry, const char **process);
 extern int o2_using_a_hub; // set to true if o2_hub() is called;
                            // turns of broadcasting
 
+extern int o2_lazy_connect; // set by o2_set_lazy_connect(); when true,
+                            // TCP connections are made on first use
+
 #endif /* O2_INTERNAL_H */
 /// \endcond
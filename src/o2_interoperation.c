@@ -19,7 +19,14 @@
  *
  *   We handle outgoing OSC messages using
  * o2_osc_delegate(service_name, ip, port_num), which puts an
- * entry in the top-level hash table with the OSC socket.
+ * entry in the top-level hash table with the OSC socket. Since the
+ * OSC message is just the O2 message without the timestamp and service
+ * name, an outgoing message is sent in place with sendmsg(), using the
+ * address after the service name, padding, and the rest of the message.
+ * Bundles are still built as a copy. Over TCP,
+ * OSC packets are collected in a per-socket output buffer (with a
+ * length prefix or SLIP framing) and written by o2_osc_flush() once per
+ * o2_poll(), so a burst of messages takes few TCP packets.
  */
 
 #include "o2.h"
@@ -28,6 +35,7 @@
 #include "o2_sched.h"
 #include "o2_send.h"
 #include "o2_interoperation.h"
+#include "o2_trace.h"
 
 #include "errno.h"
 
@@ -80,6 +88,7 @@ int o2_osc_port_new(const char *service_name, int port_num, int tcp_flag)
         RETURN_IF_ERROR(o2_make_udp_recv_socket(OSC_SOCKET, &port_num, &info));
     }
     info->osc.service_name = o2_heapify(service_name);
+    info->osc.slip = (tcp_flag == O2_OSC_SLIP);
     return O2_SUCCESS;
 }
 
@@ -172,6 +181,7 @@ int o2_osc_delegate(const char *service_name, const char *ip, int port_num, int
             goto fail_and_exit;
         }
         info->osc.service_name = o2_heapify(service_name);
+        info->osc.slip = (tcp_flag == O2_OSC_SLIP);
         o2_disable_sigpipe(sock);
     } else {
         hints.ai_socktype = SOCK_DGRAM;
@@ -291,15 +301,84 @@ static o2_message_ptr osc_to_o2(int32_t len, char *oscmsg, o2string service)
 }
 
 
-// forward an OSC message to an O2 service
+// How many bytes to reserve in front of incoming OSC data so that it
+// can become an O2 message without copying: the timestamp plus the
+// most the "/service" prefix can add to the padded address.
+//
+int o2_osc_headroom(o2string service)
+{
+    int service_len = (int) strlen(service);
+    int grow = 0;
+    int r;
+    // the padded address grows by 1 + service_len rounded to a word
+    // boundary, depending on the OSC address length modulo 4
+    for (r = 0; r < 4; r++) {
+        int g = ((1 + service_len + r + 4) & ~3) - ((r + 4) & ~3);
+        if (g > grow) grow = g;
+    }
+    return sizeof(o2_time) + grow;
+}
+
+
+// convert an osc message in network byte order, located at offset
+// o2_osc_headroom(service) in msg, to an o2 message in host order.
+// The service name and timestamp are written into the headroom, so
+// only the OSC address and (sometimes) the rest of the message move,
+// and only by a few bytes. msg is either returned or freed.
+//
+static o2_message_ptr osc_to_o2_in_place(o2_message_ptr msg, int32_t len,
+                                         o2string service)
+{
+    int headroom = o2_osc_headroom(service);
+    char *oscmsg = PTR(&(msg->data)) + headroom;
+    if (strcmp(oscmsg, "#bundle") == 0) { // bundles are unpacked and copied
+        o2_message_ptr o2msg = osc_bundle_to_o2(len, oscmsg, service);
+        o2_message_free(msg);
+        return o2msg;
+    }
+    int service_len = (int) strlen(service);
+    int addr_len = (int) strlen(oscmsg);
+    char *osc_ptr = WORD_ALIGN_PTR(oscmsg + addr_len + 4); // OSC types
+    int payload_len = (int) (oscmsg + len - osc_ptr);
+    if (payload_len < 0) {
+        o2_message_free(msg);
+        return NULL;
+    }
+    char *dst = msg->data.address;
+    char *o2_ptr = dst + ((1 + service_len + addr_len + 4) & ~3);
+    // headroom >= 1 + service_len, so the address moves toward the front
+    memmove(dst + 1 + service_len, oscmsg, addr_len);
+    // zero fill to word boundary; o2_ptr <= osc_ptr, so types are safe
+    memset(dst + 1 + service_len + addr_len, 0,
+           o2_ptr - (dst + 1 + service_len + addr_len));
+    if (o2_ptr != osc_ptr) {
+        memmove(o2_ptr, osc_ptr, payload_len);
+    }
+    dst[0] = '/'; // slash before service name
+    memcpy(dst + 1, service, service_len);
+    msg->data.timestamp = 0.0; // deliver immediately
+    msg->length = (int32_t) (o2_ptr + payload_len - PTR(&(msg->data)));
+#if IS_LITTLE_ENDIAN
+    o2_msg_swap_endian(&(msg->data), FALSE);
+#endif
+    return msg;
+}
+
+
+// forward an OSC message to an O2 service. The OSC message starts
+// o2_osc_headroom() bytes into info->message->data.
 int o2_deliver_osc(process_info_ptr info)
 {
-    char *msg_data = (char *) &(info->message->data); // OSC address starts here
     O2_DBO(printf("%s os_deliver_osc got OSC message %s length %d for service %s\n",
-                  o2_debug_prefix, msg_data, info->message->length, info->osc.service_name));
-    o2_message_ptr o2msg = osc_to_o2(info->message->length, msg_data,
-                                     info->osc.service_name);
-    o2_message_free(info->message);
+                  o2_debug_prefix, PTR(&(info->message->data)) +
+                  o2_osc_headroom(info->osc.service_name),
+                  info->message->length, info->osc.service_name));
+    info->msgs_in++;
+    info->bytes_in += info->message->length;
+    o2_message_ptr o2msg = osc_to_o2_in_place(info->message,
+                                              info->message->length,
+                                              info->osc.service_name);
+    info->message = NULL; // now owned (or freed) by osc_to_o2_in_place()
     if (!o2msg) {
         return O2_FAIL;
     }
@@ -308,8 +387,8 @@ int o2_deliver_osc(process_info_ptr info)
     if (o2_message_send_sched(o2msg, TRUE)) { // failure to deliver message will NOT
             // cause the connection to be closed; only the current message
             // will be dropped
-        O2_DBO(printf("%s os_deliver_osc: message %s forward to %s failed\n",
-                      o2_debug_prefix, msg_data, info->osc.service_name));
+        O2_DBO(printf("%s os_deliver_osc: message forward to %s failed\n",
+                      o2_debug_prefix, info->osc.service_name));
     }
     return O2_SUCCESS;
 }
@@ -357,9 +436,272 @@ static int msg_data_to_osc_data(osc_info_ptr service, o2_msg_data_ptr msg,
 }
 
 
+// SLIP framing (RFC 1055) as used by OSC 1.1 over TCP
+#define SLIP_END 0300
+#define SLIP_ESC 0333
+#define SLIP_ESC_END 0334
+#define SLIP_ESC_ESC 0335
+
+// write OSC TCP output early if this much is waiting for o2_osc_flush()
+#define OSC_OUT_MAX 32768
+
+
+// append len bytes to out, SLIP-escaping them if slip is set
+static void osc_out_append(dyn_array_ptr out, const char *data, int len,
+                           int slip)
+{
+    int need = out->length + (slip ? 2 * len : len); // worst case
+    while (out->allocated < need) {
+        o2_da_expand(out, sizeof(char));
+    }
+    char *dst = out->array + out->length;
+    if (slip) {
+        int i;
+        for (i = 0; i < len; i++) {
+            unsigned char c = data[i];
+            if (c == SLIP_END) {
+                *dst++ = (char) SLIP_ESC;
+                *dst++ = (char) SLIP_ESC_END;
+            } else if (c == SLIP_ESC) {
+                *dst++ = (char) SLIP_ESC;
+                *dst++ = (char) SLIP_ESC_ESC;
+            } else {
+                *dst++ = c;
+            }
+        }
+    } else {
+        memcpy(dst, data, len);
+        dst += len;
+    }
+    out->length = (int32_t) (dst - out->array);
+}
+
+
+// start an OSC packet of len bytes in the TCP output buffer: OSC 1.0
+// sends the length first, SLIP begins (and ends) with END
+static void osc_tcp_begin(process_info_ptr info, int32_t len)
+{
+    info->msgs_out++;
+    info->bytes_out += len;
+    if (info->osc.slip) {
+        char end = (char) SLIP_END;
+        osc_out_append(&info->osc.out, &end, 1, FALSE);
+    } else {
+        int32_t net_len = htonl(len);
+        osc_out_append(&info->osc.out, (char *) &net_len, sizeof(int32_t),
+                       FALSE);
+    }
+}
+
+
+// finish an OSC packet started by osc_tcp_begin(). If a lot of output
+// is waiting, write it now.
+static int osc_tcp_end(osc_info_ptr service)
+{
+    process_info_ptr info = service->tcp_socket_info;
+    if (info->osc.slip) {
+        char end = (char) SLIP_END;
+        osc_out_append(&info->osc.out, &end, 1, FALSE);
+    }
+    if (info->osc.out.length >= OSC_OUT_MAX &&
+        o2_osc_flush_socket(info) != O2_SUCCESS) {
+        o2_service_free((void *) service->service_name);
+        return O2_FAIL;
+    }
+    return O2_SUCCESS;
+}
+
+
+// write output buffered for an OSC_TCP_CLIENT socket
+int o2_osc_flush_socket(process_info_ptr info)
+{
+    dyn_array_ptr out = &info->osc.out;
+    SOCKET fd = DA_GET(o2_fds, struct pollfd, info->fds_index)->fd;
+    int sent = 0;
+    while (sent < out->length) {
+        // coerce to int to avoid compiler warning; length is int
+        int n = (int) send(fd, out->array + sent, out->length - sent,
+                           MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            perror("o2_osc_flush_socket");
+            info->send_errors++;
+            out->length = 0;
+            return O2_FAIL;
+        }
+        sent += n;
+    }
+    out->length = 0;
+    return O2_SUCCESS;
+}
+
+
+// called by o2_poll() to write the OSC messages sent over TCP since the
+// last poll, so that several small messages can share a packet
+void o2_osc_flush()
+{
+    int i;
+    for (i = 0; i < o2_fds_info.length; i++) {
+        process_info_ptr info = GET_PROCESS(i);
+        if (info->tag == OSC_TCP_CLIENT && !info->delete_me &&
+            info->osc.out.length > 0 &&
+            o2_osc_flush_socket(info) != O2_SUCCESS &&
+            info->osc.service_name) {
+            // the socket is marked to free, so o2_fds_info is unchanged
+            o2_service_free((char *) info->osc.service_name);
+        }
+    }
+}
+
+
+// receive SLIP-framed OSC from a TCP client. Packets are decoded into
+// info->message after o2_osc_headroom() bytes, and each is delivered
+// as soon as its final END arrives.
+//
+int o2_osc_slip_recv(SOCKET sock, process_info_ptr info)
+{
+    char buf[1024];
+    // coerce to int to avoid compiler warning; requested length is int
+    int n = (int) recvfrom(sock, buf, sizeof(buf), 0, NULL, NULL);
+    if (n == 0) { // the other process closed the connection
+        return O2_TCP_HUP;
+    } else if (n < 0) {
+#ifdef WIN32
+        if (GetLastError() == WSAEWOULDBLOCK || GetLastError() == WSAEINTR) {
+#else
+        if (errno == EAGAIN || errno == EINTR) {
+#endif
+            return O2_SUCCESS;
+        }
+        perror("recvfrom in o2_osc_slip_recv");
+        return O2_TCP_HUP;
+    }
+    int i;
+    for (i = 0; i < n && info->osc.service_name; i++) {
+        unsigned char c = buf[i];
+        int headroom = o2_osc_headroom(info->osc.service_name);
+        if (c == SLIP_END) {
+            info->osc.slip_esc = FALSE;
+            if (info->message_got > 0) { // END after a packet
+                info->message->length = info->message_got;
+                o2_deliver_osc(info); // frees info->message
+                info->message = NULL;
+                info->message_got = 0;
+            }
+            continue;
+        } else if (c == SLIP_ESC) {
+            info->osc.slip_esc = TRUE;
+            continue;
+        } else if (info->osc.slip_esc) {
+            info->osc.slip_esc = FALSE;
+            if (c == SLIP_ESC_END) c = SLIP_END;
+            else if (c == SLIP_ESC_ESC) c = SLIP_ESC;
+        }
+        if (!info->message ||
+            headroom + info->message_got >= info->message->allocated) {
+            int size = info->message ? 2 * info->message->allocated :
+                                       headroom + 256;
+            o2_message_ptr bigger = o2_alloc_size_message(size);
+            if (!bigger) return O2_FAIL;
+            if (info->message) {
+                memcpy(&(bigger->data), &(info->message->data),
+                       headroom + info->message_got);
+                o2_message_free(info->message);
+            }
+            info->message = bigger;
+        }
+        PTR(&(info->message->data))[headroom + info->message_got++] = c;
+    }
+    if (info->message_got > 0) { // the rest of the packet comes later
+        info->partial_reads++;
+    }
+    return O2_SUCCESS;
+}
+
+
+// send an O2 message (not a bundle) to an OSC server without building
+// a copy: the OSC address is the O2 address after the service name,
+// and the types and data follow unchanged, so send these parts of msg
+// with one sendmsg() call (UDP), or append them to the output buffer
+// (TCP)
+//
+static int send_osc_iov(osc_info_ptr service, o2_msg_data_ptr msg)
+{
+    static char zeros[4] = {0, 0, 0, 0};
+    // Begin by converting to network byte order:
+#if IS_LITTLE_ENDIAN
+    RETURN_IF_ERROR(o2_msg_swap_endian(msg, TRUE));
+#endif
+    int service_len = (int) strlen(service->service_name) + 1; // include slash
+    char *osc_addr = msg->address + service_len;
+    int addr_len = (int) strlen(osc_addr);
+    int addr_size = (addr_len + 4) & ~3; // OSC address padded from its start
+    // Get the address of the rest of the message:
+    char *types_ptr = msg->address + 4;
+    while (types_ptr[-1]) types_ptr += 4;
+    int32_t payload_len = (int32_t) (PTR(msg) + MSG_DATA_LENGTH(msg) -
+                                     types_ptr);
+    int32_t osc_len = addr_size + payload_len;
+    O2_DBO(printf("%s o2_send_osc sending OSC message %s length %d as "
+                  "service %s\n",
+                  o2_debug_prefix, osc_addr, osc_len, service->service_name));
+    process_info_ptr info = service->tcp_socket_info;
+    if (info) { // gather the message into the TCP output buffer
+        osc_tcp_begin(info, osc_len);
+        osc_out_append(&info->osc.out, osc_addr, addr_len, info->osc.slip);
+        osc_out_append(&info->osc.out, zeros, addr_size - addr_len,
+                       info->osc.slip);
+        osc_out_append(&info->osc.out, types_ptr, payload_len,
+                       info->osc.slip);
+        return osc_tcp_end(service);
+    }
+#ifdef WIN32
+    // no sendmsg(), so copy the parts into one packet
+    o2_send_start();
+    o2_add_raw_bytes(addr_len, osc_addr);
+    o2_add_raw_bytes(addr_size - addr_len, zeros);
+    o2_add_raw_bytes(payload_len, types_ptr);
+    int32_t len;
+    char *packet = o2_msg_data_get(&len);
+    if (sendto(local_send_sock, packet, len, 0,
+               (struct sockaddr *) &(service->udp_sa),
+               sizeof(service->udp_sa)) < 0) {
+#else
+    struct iovec iov[3];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    iov[0].iov_base = osc_addr;
+    iov[0].iov_len = addr_len;
+    iov[1].iov_base = zeros;
+    iov[1].iov_len = addr_size - addr_len;
+    iov[2].iov_base = types_ptr;
+    iov[2].iov_len = payload_len;
+    mh.msg_name = &(service->udp_sa);
+    mh.msg_namelen = sizeof(service->udp_sa);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 3;
+    if (sendmsg(local_send_sock, &mh, 0) < 0) {
+#endif
+        perror("o2_send_osc");
+        return O2_SEND_FAIL;
+    }
+    return O2_SUCCESS;
+}
+
+
 // forward an O2 message to an OSC server
 int o2_send_osc(osc_info_ptr service, o2_msg_data_ptr msg, services_entry_ptr services)
 {
+    // taps are copied from the O2 message, so do this before sending
+    // converts msg to network byte order
+    o2_send_to_tappers(msg, services);
+    services->delivered++;
+    O2_TRACE_EVENT(O2_TRACE_WIRE, msg);
+    // messages can be sent in place unless they are bundles, which
+    // need new timestamps
+    if (!IS_BUNDLE(msg)) {
+        return send_osc_iov(service, msg);
+    }
     o2_send_start();
     RETURN_IF_ERROR(msg_data_to_osc_data(service, msg, 0.0));
     int32_t osc_len;
@@ -377,35 +719,10 @@ int o2_send_osc(osc_info_ptr service, o2_msg_data_ptr msg, services_entry_ptr se
             return O2_SEND_FAIL;
         }
     } else { // send by TCP
-        SOCKET fd = DA_GET(o2_fds, struct pollfd, service->tcp_socket_info->fds_index)->fd;
-        // send length
-        int32_t len = htonl(osc_len);
-        while (send(fd, (char *) &len, sizeof(int32_t), MSG_NOSIGNAL) < 0) {
-            perror("o2_send_osc writing length");
-            if (errno != EAGAIN && errno != EINTR)
-                goto close_socket;
-        }
-        // send message body
-        while (send(fd, osc_msg, osc_len, MSG_NOSIGNAL) < 0) {
-            perror("o2_send_osc writing data");
-            if (errno != EAGAIN && errno != EINTR)
-                goto close_socket;
-        }
+        process_info_ptr info = service->tcp_socket_info;
+        osc_tcp_begin(info, osc_len);
+        osc_out_append(&info->osc.out, osc_msg, osc_len, info->osc.slip);
+        RETURN_IF_ERROR(osc_tcp_end(service));
     }
-    // if there are tappers, send the message to them as well
-    int tapper_index = 1; // first tapper will be here
-    while (tapper_index < services->services.length) {
-        tapper_entry_ptr tapper = *DA_GET(services->services, tapper_entry_ptr, tapper_index);
-        if (tapper->tag != TAPPER) {
-            break; // we've found all the tappers, so we're done
-        }
-        o2_message_ptr o2msg = osc_to_o2(osc_len, osc_msg,
-                                         tapper->tapper_name);
-        o2_message_send_sched(o2msg, FALSE);
-    }
-
     return O2_SUCCESS;
-  close_socket:
-    o2_service_free((void *) service->service_name);
-    return O2_FAIL;
 }
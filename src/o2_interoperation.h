@@ -1,5 +1,13 @@
 /* o2_interoperation.h -- header for OSC functions */
 
+int o2_osc_headroom(o2string service);
+
 int o2_deliver_osc(process_info_ptr info);
 
+int o2_osc_slip_recv(SOCKET sock, process_info_ptr info);
+
+int o2_osc_flush_socket(process_info_ptr info);
+
+void o2_osc_flush();
+
 int o2_send_osc(osc_info_ptr service, o2_msg_data_ptr msg, services_entry_ptr services);
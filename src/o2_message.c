@@ -539,6 +539,8 @@ MX_TYPE(rd_int64, int64_t)
 
 /// a free list of 240-byte (MESSAGE_DEFAULT_SIZE) o2_messages
 o2_message_ptr message_freelist = NULL;
+/// how many messages have been allocated for the free list
+int o2_message_pool_size = 0;
 
 // get a free message of size MESSAGE_DEFAULT_SIZE
 static o2_message_ptr message_alloc()
@@ -546,6 +548,7 @@ static o2_message_ptr message_alloc()
     o2_message_ptr msg;
     if (!message_freelist) {
         msg = (o2_message_ptr) o2_malloc(MESSAGE_DEFAULT_SIZE);
+        o2_message_pool_size++;
         // printf("new msg %p\n", msg);
         msg->allocated = MESSAGE_ALLOCATED_FROM_SIZE(MESSAGE_DEFAULT_SIZE);
         MSG_ZERO_END(msg, MESSAGE_DEFAULT_SIZE);
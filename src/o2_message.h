@@ -10,6 +10,7 @@
 #define o2_message_h
 
 extern o2_message_ptr message_freelist;
+extern int o2_message_pool_size;
 
 #define MAX_SERVICE_LEN 64
 
@@ -0,0 +1,59 @@
+/* o2_probes.h -- static tracepoints for perf, bpftrace, etc. */
+
+// When sys/sdt.h (systemtap-sdt-dev) is available, O2 is compiled with
+// O2_USDT (see CMakeLists.txt) and the O2_PROBE macros become USDT
+// probes with provider "o2". A probe is a single nop instruction until
+// a tracer attaches to it, so unlike the O2_DB macros, these cost
+// nearly nothing under load. Without O2_USDT they compile to nothing.
+//
+// Every probe has the O2 address, the message length and the message
+// timestamp (in microseconds, 0 for "now") as arguments 0 to 2:
+//   send           - o2_message_send_sched(), the application sends
+//   send_remote    - o2_send_remote(), arg3 is the tcp_flag
+//   tcp_read       - read_whole_message() has a whole message,
+//                    arg3 is the socket tag (see o2_socket.h)
+//   udp_recv       - udp_recv_handler() received a message, arg3 is
+//                    the socket tag
+//   sched_dispatch - sched_dispatch() delivers a timed message
+//   handler_entry  - call_handler() is about to call a handler
+//   handler_return - the handler returned (only arg0, the address)
+// Messages received from OSC have no O2 timestamp, so the timestamp
+// of tcp_read and udp_recv on OSC sockets is 0.
+//
+// For example, to get a histogram of handler times with bpftrace:
+//   bpftrace -e 'usdt:./o2server:o2:handler_entry { @s[tid] = nsecs; }
+//     usdt:./o2server:o2:handler_return /@s[tid]/ {
+//       @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+
+#ifdef O2_USDT
+#include <sys/sdt.h>
+
+#define O2_PROBE1(name, a0) DTRACE_PROBE1(o2, name, a0)
+#define O2_PROBE3(name, a0, a1, a2) DTRACE_PROBE3(o2, name, a0, a1, a2)
+#define O2_PROBE4(name, a0, a1, a2, a3) \
+    DTRACE_PROBE4(o2, name, a0, a1, a2, a3)
+
+// an o2_time in integer microseconds, because tracers do not handle
+// floating point probe arguments well
+#define O2_PROBE_USEC(t) ((int64_t) ((t) * 1000000.0))
+
+// the timestamp of a message that is still in network byte order
+static inline int64_t o2_probe_net_usec(o2_msg_data_ptr msg)
+{
+#if IS_LITTLE_ENDIAN
+    union { uint64_t i; o2_time t; } ts;
+    ts.t = msg->timestamp;
+    ts.i = swap64(ts.i);
+    return O2_PROBE_USEC(ts.t);
+#else
+    return O2_PROBE_USEC(msg->timestamp);
+#endif
+}
+
+#else
+
+#define O2_PROBE1(name, a0)
+#define O2_PROBE3(name, a0, a1, a2)
+#define O2_PROBE4(name, a0, a1, a2, a3)
+
+#endif
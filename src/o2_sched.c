@@ -51,6 +51,8 @@
 #include "o2_sched.h"
 #include "o2_clock.h"
 #include "o2_send.h"
+#include "o2_trace.h"
+#include "o2_probes.h"
 
 
 #define SCHED_BIN(time) ((int64_t) ((time) * 100))
@@ -144,6 +146,7 @@ int o2_schedule(o2_sched_ptr s, o2_message_ptr m)
     // either *m_ptr is null or it points to a time > mt
     m->next = *m_ptr;
     *m_ptr = m;
+    O2_TRACE_EVENT(O2_TRACE_SCHEDULE, &m->data);
     // assert(scheduled_for(s, m->data.timestamp));
     return O2_SUCCESS;
 }
@@ -170,6 +173,8 @@ static void sched_dispatch(o2_sched_ptr s, o2_time run_until_time)
         while (*m_ptr && ((*m_ptr)->data.timestamp <= run_until_time)) {
             o2_message_ptr m = *m_ptr;
             *m_ptr = m->next; // unlink message m
+            O2_PROBE3(sched_dispatch, (char *) m->data.address, m->length,
+                      O2_PROBE_USEC(m->data.timestamp));
             o2_active_sched = s; // if we recursively schedule another message,
             // use this same scheduler.
             // careful: this can call schedule and change the table
@@ -179,7 +184,7 @@ static void sched_dispatch(o2_sched_ptr s, o2_time run_until_time)
             O2_DBT(if (m->data.address[1] == '_' ||
                        isdigit(m->data.address[1]))
                        o2_dbg_msg("sched_dispatch", &m->data, NULL, NULL));
-            o2_message_send_sched(m, FALSE); // don't assume local and call
+            o2_message_send_local(m, FALSE); // don't assume local and call
             // o2_msg_data_deliver; maybe this is an OSC message
         }
         s->last_bin++;
@@ -56,6 +56,8 @@
 #include "o2_discovery.h"
 #include "o2_send.h"
 #include "o2_sched.h"
+#include "o2_trace.h"
+#include "o2_probes.h"
 
 #ifdef WIN32
 #include "malloc.h"
@@ -203,6 +205,182 @@ int o2_add_entry_at(node_entry_ptr node, o2_entry_ptr *loc,
 }
 
 
+#ifdef O2_PROFILE_HANDLERS
+// Handler profiling: call_handler() times each handler with
+// o2_local_time() and adds the time to handler->profile. Calls longer
+// than slow_threshold are also saved in a ring buffer of the most
+// recent PROFILE_SLOW_LEN slow calls.
+//
+#define PROFILE_SLOW_LEN 64
+#define PROFILE_ADDRESS_LEN 64
+
+typedef struct slow_call {
+    o2_time when; // local time when the handler returned
+    o2_time duration;
+    char address[PROFILE_ADDRESS_LEN]; // truncated if necessary
+} slow_call;
+
+static o2_time slow_threshold = 0.01;
+static slow_call slow_calls[PROFILE_SLOW_LEN];
+static int64_t slow_count = 0; // slow_calls[slow_count % LEN] is next
+
+static void profile_record(handler_entry_ptr handler, o2_msg_data_ptr msg,
+                           o2_time duration)
+{
+    o2_handler_profile_ptr profile = &handler->profile;
+    profile->calls++;
+    profile->total += duration;
+    if (duration > profile->max) profile->max = duration;
+    // bin 0 is < 1us, bin i is < 2^i us, the last bin has the rest
+    double usec = duration * 1000000.0;
+    int bin = 0;
+    while (bin < O2_PROFILE_BINS - 1 && usec >= (double) (1 << bin)) {
+        bin++;
+    }
+    profile->histogram[bin]++;
+    if (duration > slow_threshold) {
+        profile->slow++;
+        slow_call *sc = &slow_calls[slow_count++ % PROFILE_SLOW_LEN];
+        sc->when = o2_local_time();
+        sc->duration = duration;
+        strncpy(sc->address, msg->address, PROFILE_ADDRESS_LEN - 1);
+        sc->address[PROFILE_ADDRESS_LEN - 1] = 0;
+    }
+}
+
+
+typedef void (*profile_visit)(handler_entry_ptr handler, const char *path,
+                              void *rock);
+
+// call visit for every handler under node. Leaves of the path tree
+// have full_path, but a handler for a whole service does not, so
+// its path is passed in by the caller.
+//
+static void profile_walk_node(o2_entry_ptr entry, const char *path,
+                              profile_visit visit, void *rock)
+{
+    if (entry->tag == PATTERN_HANDLER) {
+        handler_entry_ptr handler = (handler_entry_ptr) entry;
+        (*visit)(handler, handler->full_path ? handler->full_path : path,
+                 rock);
+    } else if (entry->tag == PATTERN_NODE) {
+        enumerate enumerator;
+        o2_enumerate_begin(&enumerator, &(((node_entry_ptr) entry)->children));
+        o2_entry_ptr child;
+        while ((child = o2_enumerate_next(&enumerator))) {
+            profile_walk_node(child, NULL, visit, rock);
+        }
+    }
+}
+
+
+// call visit for every local handler in the path tree, then for
+// every handler in the full path table (used for "!" addresses).
+// The second group is visited with rock set to NULL.
+//
+static void profile_walk(profile_visit visit, void *rock)
+{
+    enumerate enumerator;
+    o2_enumerate_begin(&enumerator, &o2_path_tree.children);
+    services_entry_ptr services;
+    while ((services = (services_entry_ptr) o2_enumerate_next(&enumerator))) {
+        if (services->tag != SERVICES) continue;
+        int i;
+        for (i = 0; i < services->services.length; i++) {
+            o2_info_ptr entry = GET_SERVICE(services->services, i);
+            if (entry->tag == PATTERN_NODE || entry->tag == PATTERN_HANDLER) {
+                char path[NAME_BUF_LEN];
+                snprintf(path, NAME_BUF_LEN, "/%s", services->key);
+                profile_walk_node((o2_entry_ptr) entry, path, visit, rock);
+            }
+        }
+    }
+    o2_enumerate_begin(&enumerator, &o2_full_path_table.children);
+    o2_entry_ptr entry;
+    while ((entry = o2_enumerate_next(&enumerator))) {
+        if (entry->tag == PATTERN_HANDLER) {
+            (*visit)((handler_entry_ptr) entry, entry->key, NULL);
+        }
+    }
+}
+
+
+void o2_profile_slow(o2_time threshold)
+{
+    slow_threshold = threshold;
+}
+
+
+static void profile_find(handler_entry_ptr handler, const char *path,
+                         void *rock)
+{
+    struct { const char *path; o2_handler_profile_ptr profile; } *find = rock;
+    if (find && !find->profile && path && streql(path, find->path)) {
+        find->profile = &handler->profile;
+    }
+}
+
+
+o2_handler_profile_ptr o2_profile_get(const char *path)
+{
+    struct { const char *path; o2_handler_profile_ptr profile; } find;
+    find.path = path;
+    find.profile = NULL;
+    profile_walk(&profile_find, &find);
+    return find.profile;
+}
+
+
+static void profile_print(handler_entry_ptr handler, const char *path,
+                          void *rock)
+{
+    o2_handler_profile_ptr profile = &handler->profile;
+    if (profile->calls == 0) return;
+    // rock is NULL for the full path table, which handles "!" addresses
+    printf("%c%s: %lld calls, mean %gs, max %gs, %lld slow\n    histogram:",
+           rock ? '/' : '!', path + 1, (long long) profile->calls,
+           profile->total / profile->calls, profile->max,
+           (long long) profile->slow);
+    int i;
+    for (i = 0; i < O2_PROFILE_BINS; i++) {
+        printf(" %lld", (long long) profile->histogram[i]);
+    }
+    printf("\n");
+}
+
+
+void o2_profile_print()
+{
+    printf("handler profiles (histogram bins: <1us, <2us, <4us, ...):\n");
+    profile_walk(&profile_print, (void *) &profile_print);
+    int64_t first = slow_count - PROFILE_SLOW_LEN;
+    if (first < 0) first = 0;
+    printf("%lld handler calls took more than %gs, most recent:\n",
+           (long long) slow_count, slow_threshold);
+    int64_t i;
+    for (i = first; i < slow_count; i++) {
+        slow_call *sc = &slow_calls[i % PROFILE_SLOW_LEN];
+        printf("    at %gs: %s took %gs\n", sc->when, sc->address,
+               sc->duration);
+    }
+}
+
+
+static void profile_reset(handler_entry_ptr handler, const char *path,
+                          void *rock)
+{
+    memset(&handler->profile, 0, sizeof(handler->profile));
+}
+
+
+void o2_profile_reset()
+{
+    profile_walk(&profile_reset, NULL);
+    slow_count = 0;
+}
+#endif
+
+
 // call handler for message. Does type coercion, argument vector
 // construction, and type checking. types points to the type string
 // after the initial ','
@@ -255,7 +433,18 @@ static void call_handler(handler_entry_ptr handler, o2_msg_data_ptr msg,
         o2_argv = NULL;
         o2_argc = 0;
     }
+    O2_TRACE_EVENT(O2_TRACE_DISPATCH, msg);
+    O2_PROBE3(handler_entry, (char *) msg->address, MSG_DATA_LENGTH(msg),
+              O2_PROBE_USEC(msg->timestamp));
+#ifdef O2_PROFILE_HANDLERS
+    o2_time start = o2_local_time();
     (*(handler->handler))(msg, types, o2_argv, o2_argc, handler->user_data);
+    profile_record(handler, msg, o2_local_time() - start);
+#else
+    (*(handler->handler))(msg, types, o2_argv, o2_argc, handler->user_data);
+#endif
+    O2_PROBE1(handler_return, (char *) msg->address);
+    O2_TRACE_EVENT(O2_TRACE_RETURN, msg);
 }
 
 
@@ -297,8 +486,11 @@ static void find_and_call_handlers_rec(char *remaining, char *name,
         o2_enumerate_begin(&enumerator, &(((node_entry_ptr)node)->children));
         o2_entry_ptr entry;
         while ((entry = o2_enumerate_next(&enumerator))) {
-            if (slash && (entry->tag == PATTERN_NODE) &&
-                (o2_pattern_match(entry->key, remaining) == O2_SUCCESS)) {
+            // o2_pattern_match() returns TRUE or FALSE, not O2_SUCCESS
+            if (!o2_pattern_match(entry->key, remaining)) {
+                continue;
+            }
+            if (slash && (entry->tag == PATTERN_NODE)) {
                 find_and_call_handlers_rec(slash + 1, name, entry, msg, types);
             } else if (!slash && (entry->tag == PATTERN_HANDLER)) {
                 char *path_end = remaining + strlen(remaining);
@@ -509,6 +701,9 @@ int o2_method_new(const char *path, const char *typespec,
     handler->types_len = types_len;
     handler->coerce_flag = coerce;
     handler->parse_args = parse;
+#ifdef O2_PROFILE_HANDLERS
+    memset(&handler->profile, 0, sizeof(handler->profile));
+#endif
     
     // case 1: method is global handler for entire service replacing a
     //         PATTERN_NODE with specific handlers: remove the PATTERN_NODE
@@ -670,16 +865,34 @@ int o2_service_provider_replace(process_info_ptr proc, const char *service_name,
     o2_send_cmd("!_o2/si", 0.0, "sis", service_name, O2_FAIL, proc->proc.name);
     o2_in_find_and_call_handlers--;
 
+    // proc also has a list of services it provides; find the service
+    // in the list and remove it. It should always be first in the list
+    // because we're using the same list to enumerate the services, but
+    // just in case there's some other reason to remove a service, we'll
+    // search for it rather than assuming it's the first entry. This is
+    // done before removing the services entry because service_name may
+    // be the entry's key, which is freed with the entry.
+    int found = FALSE;
+    dyn_array_ptr proc_list = &(proc->proc.services);
+    for (int j = 0; j < proc_list->length; j++) {
+        if (streql(*DA_GET(*proc_list, char *, j), service_name)) {
+            DA_REMOVE(*proc_list, char *, j);
+            found = TRUE;
+            break;
+        }
+    }
+
     // "replacement" is NULL, so we have to remove the listing
     DA_REMOVE(*list, process_info_ptr, i);
-    if (list->length == 0) {
+    int remaining = list->length; // list is freed if this is 0
+    if (remaining == 0) {
         entry_remove(&o2_path_tree, (o2_entry_ptr *) services, TRUE);
     } else if (i == 0) { // move top ip:port provider to top spot
         pick_service_provider(list);
     }
 
     // now we probably have a new service, report it:
-    if (list->length > 0) {
+    if (remaining > 0) {
         o2_info_ptr info = GET_SERVICE(*list, 0);
         const char *process_name;
         int status = o2_status_from_info(info, &process_name);
@@ -697,17 +910,8 @@ int o2_service_provider_replace(process_info_ptr proc, const char *service_name,
         o2_notify_others(service_name, FALSE, NULL);
     }
 
-    // proc also has a list of services it provides; find the service
-    // in the list and remove it. It should always be first in the list
-    // because we're using the same list to enumerate the services, but
-    // just in case there's some other reason to remove a service, we'll
-    // search for it rather than assuming it's the first entry.
-    list = &(proc->proc.services);
-    for (int j = 0; j < proc->proc.services.length; j++) {
-        if (streql(*DA_GET(*list, char *, i), service_name)) {
-            DA_REMOVE(*list, char *, i);
-            return O2_SUCCESS;
-        }
+    if (found) {
+        return O2_SUCCESS;
     }
     O2_DBg(printf("%s o2_service_provider_replace(%s, %s) did not find "
                   "service in process_info's services list\n",
@@ -756,6 +960,7 @@ services_entry_ptr o2_insert_new_service(o2string service_name,
     s->key = o2_heapify(service_name);
     s->next = NULL;
     DA_INIT(s->services, o2_entry_ptr, 1);
+    o2_service_policy_init(s);
     o2_add_entry_at(&o2_path_tree, (o2_entry_ptr *) services, 
                     (o2_entry_ptr) s);
     return s;
@@ -858,10 +1063,31 @@ int o2_embedded_msgs_deliver(o2_msg_data_ptr msg, int tcp_flag)
 }
 
 
-void send_msg_data_to_tapper(o2_msg_data_ptr msg, o2string tapper_name)
+// send a copy of msg to each tapper of services, replacing the service
+// name with the tapper name. The address is measured once and shared
+// by all the copies. Embedded messages of a bundle are tapped
+// individually (this is only needed for OSC delegation: local
+// delivery taps each embedded message as it is delivered).
+//
+void o2_send_to_tappers(o2_msg_data_ptr msg, services_entry_ptr services)
 {
-    // construct a new message to send to tapper by replacing service name
-
+    // quick check: taps, if any, follow the provider at index 0
+    if (services->services.length < 2 ||
+        GET_SERVICE(services->services, 1)->tag != TAPPER) {
+        return;
+    }
+    if (IS_BUNDLE(msg)) {
+        char *end_of_msg = PTR(msg) + MSG_DATA_LENGTH(msg);
+        o2_msg_data_ptr embedded = (o2_msg_data_ptr)
+                (msg->address + o2_strsize(msg->address) + sizeof(int32_t));
+        while (PTR(embedded) < end_of_msg) {
+            o2_send_to_tappers(embedded, services);
+            embedded = (o2_msg_data_ptr)
+                    (PTR(embedded) + MSG_DATA_LENGTH(embedded) +
+                     sizeof(int32_t));
+        }
+        return;
+    }
     // how big is the existing service name?
 
     // I think coerce to char * will remove bounds checking, which might limit the
@@ -874,36 +1100,54 @@ void send_msg_data_to_tapper(o2_msg_data_ptr msg, o2string tapper_name)
     }
     int curlen = (int) (slash - msg->address);
 
-    // how much space will tapper_name take?
-    int newlen = (int) strlen(tapper_name) + 1; // add 1 for initial '/' or '!'
-
     // how long is current address?
     int curaddrlen = (int) strlen((char *) (msg->address));
 
-    // how long is new address?
-    int newaddrlen = curaddrlen + (newlen - curlen);
-
-    // what is the difference in space needed for address (and message)?
-    // "+ 4" accounts for end-of-string byte and padding in each case
+    // "+ 4" accounts for end-of-string byte and padding
     int curaddrall = WORD_OFFSET(curaddrlen + 4); // address + padding
-    int newaddrall = WORD_OFFSET(newaddrlen + 4);
-    int extra = newaddrall - curaddrall;
-
-    // allocate a new message
-    o2_message_ptr newmsg = o2_alloc_size_message(MSG_DATA_LENGTH(msg) + extra);
-    newmsg->length = MSG_DATA_LENGTH(msg) + extra;
-    newmsg->data.timestamp = msg->timestamp;
-    // fill end of address with zeros before creating address string
-    *((int32_t *) (newmsg->data.address + WORD_OFFSET(newaddrlen))) = 0;
-    // first character is either / or ! copied from original message
-    newmsg->data.address[0] = msg->address[0];
-    memcpy((char *) (newmsg->data.address + 1), tapper_name, newlen); // copies name and EOS
-    memcpy((char *) (newmsg->data.address + newlen), msg->address + curlen, curaddrlen - curlen);
-    // copy the rest of the message
-    printf("** copying %d bytes from %p to %p\n", MSG_DATA_LENGTH(msg) - curaddrall, msg->address + curaddrall, newmsg->data.address + newaddrall);
-    memcpy((char *) (newmsg->data.address + newaddrall),
-           msg->address + curaddrall, MSG_DATA_LENGTH(msg) - curaddrall);
-    o2_message_send_sched(newmsg, FALSE);
+
+    int tapper_index = 1; // first tapper will be here
+    while (tapper_index < services->services.length) {
+        tapper_entry_ptr tapper = *DA_GET(services->services,
+                                          tapper_entry_ptr, tapper_index);
+        if (tapper->tag != TAPPER) {
+            break; // we've found all the tappers, so we're done
+        }
+        tapper_index++;
+        services->tapped++;
+        // construct a new message to send to tapper by replacing
+        // service name
+
+        // how much space will tapper_name take?
+        // add 1 for initial '/' or '!'
+        int newlen = (int) strlen(tapper->tapper_name) + 1;
+
+        // how long is new address?
+        int newaddrlen = curaddrlen + (newlen - curlen);
+
+        // what is the difference in space needed for address (and message)?
+        int newaddrall = WORD_OFFSET(newaddrlen + 4);
+        int extra = newaddrall - curaddrall;
+
+        // allocate a new message
+        o2_message_ptr newmsg =
+                o2_alloc_size_message(MSG_DATA_LENGTH(msg) + extra);
+        newmsg->length = MSG_DATA_LENGTH(msg) + extra;
+        newmsg->data.timestamp = msg->timestamp;
+        // fill end of address with zeros before creating address string
+        *((int32_t *) (newmsg->data.address + WORD_OFFSET(newaddrlen))) = 0;
+        // first character is either / or ! copied from original message
+        newmsg->data.address[0] = msg->address[0];
+        // copies name and EOS
+        memcpy((char *) (newmsg->data.address + 1), tapper->tapper_name,
+               newlen);
+        memcpy((char *) (newmsg->data.address + newlen),
+               msg->address + curlen, curaddrlen - curlen);
+        // copy the rest of the message
+        memcpy((char *) (newmsg->data.address + newaddrall),
+               msg->address + curaddrall, MSG_DATA_LENGTH(msg) - curaddrall);
+        o2_message_send_sched(newmsg, FALSE);
+    }
 }
 
 
@@ -920,8 +1164,12 @@ void o2_msg_data_deliver(o2_msg_data_ptr msg, int tcp_flag,
     char *address = msg->address;
     if (!service) {
         service = o2_msg_service(msg, &services);
-        if (!service) return; // service must have been removed
+        if (!service) { // service must have been removed
+            o2_dropped_no_service++;
+            return;
+        }
     }
+    services->delivered++;
 
     // we are going to deliver a non-bundle message, so we'll need
     // to find the type string...
@@ -955,15 +1203,7 @@ void o2_msg_data_deliver(o2_msg_data_ptr msg, int tcp_flag,
     } // else the assumption that the service is local fails, drop the message
 
     // if there are tappers, send the message to them as well
-    int tapper_index = 1; // first tapper will be here
-    while (tapper_index < services->services.length) {
-        tapper_entry_ptr tapper = *DA_GET(services->services, tapper_entry_ptr, tapper_index);
-        if (tapper->tag != TAPPER) {
-            break; // we've found all the tappers, so we're done
-        }
-        send_msg_data_to_tapper(msg, tapper->tapper_name);
-        tapper_index++;
-    }
+    o2_send_to_tappers(msg, services);
 }
 
 
@@ -1166,7 +1406,7 @@ static int o2_pattern_match(const char *str, const char *p)
                     }
                 }
                 
-                if (negate == match) {
+                if (negate != match) {
                     return FALSE;
                 }
                 // if there is a match, skip past the cset and continue on
@@ -1312,6 +1552,17 @@ int o2_remove_method(const char *path)
 int o2_remove_remote_process(process_info_ptr info)
 {
     if (info->tag == TCP_SOCKET) {
+        if (info->proc.status == PROCESS_CONNECTING) {
+            o2_connect_cancel(info);
+        }
+        if (info->proc.uses_hub) { // tell other clients of a scalable hub
+            o2_hub_remove(info);
+        }
+        while (info->proc.pending) { // messages that were never sent
+            o2_message_ptr msg = info->proc.pending;
+            info->proc.pending = msg->next;
+            o2_message_free(msg);
+        }
         // remove the remote services provided by the proc
         remove_remote_services(info);
         // proc.name may be NULL if we have not received an init (/_o2/dy)
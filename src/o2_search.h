@@ -60,6 +60,9 @@ typedef struct handler_entry { // "subclass" of o2_entry
                        ///<   to copies of type-coerced data as needed
                        ///<   (coerce_flag is only set if parse_args is true.)
     int parse_args;    ///< boolean - send argc and argv to handler?
+#ifdef O2_PROFILE_HANDLERS
+    o2_handler_profile profile; ///< execution time, see o2_profile_get()
+#endif
 } handler_entry, *handler_entry_ptr;
 
 
@@ -75,6 +78,12 @@ typedef struct services_entry { // "subclass" of o2_entry
             // Next in list are "taps" -- these are of type tapper_entry and
             // indicate services that should get copies of messages sent
             // to the service named by key.
+    int policy; // how to choose among multiple providers, O2_POLICY_FIRST
+            // unless set by o2_service_policy()
+    int policy_param; // argument index or address segment for hashing
+    int next_provider; // rotates for O2_POLICY_ROUND_ROBIN
+    int64_t delivered; // messages delivered to a local handler or OSC
+    int64_t tapped; // copies sent to tappers
 } services_entry, *services_entry_ptr;
 
 
@@ -174,6 +183,8 @@ int o2_embedded_msgs_deliver(o2_msg_data_ptr msg, int tcp_flag);
 void o2_msg_data_deliver(o2_msg_data_ptr msg, int tcp_flag,
                          o2_info_ptr service, services_entry_ptr services);
 
+void o2_send_to_tappers(o2_msg_data_ptr msg, services_entry_ptr services);
+
 void o2_node_finish(node_entry_ptr node);
 
 o2string o2_heapify(const char *path);
@@ -12,9 +12,14 @@
 #include "o2_message.h"
 #include "o2_interoperation.h"
 #include "o2_discovery.h"
+#include "o2_trace.h"
+#include "o2_probes.h"
 
 
 #include <errno.h>
+#ifndef WIN32
+#include <sys/ioctl.h>
+#endif
 
 
 // to prevent deep recursion, messages go into a queue if we are already
@@ -23,6 +28,8 @@ int o2_in_find_and_call_handlers = 0; // counter to allow nesting
 static o2_message_ptr pending_head = NULL;
 static o2_message_ptr pending_tail = NULL;
 
+int64_t o2_dropped_no_service = 0;
+
 
 void o2_deliver_pending()
 {
@@ -33,11 +40,24 @@ void o2_deliver_pending()
         } else {
             pending_head = pending_head->next;
         }
-        o2_message_send_sched(msg, TRUE);
+        o2_message_send_local(msg, TRUE);
     }
 }
 
 
+// how many messages are waiting for o2_deliver_pending()?
+int o2_pending_length()
+{
+    int n = 0;
+    o2_message_ptr msg = pending_head;
+    while (msg) { // the tail's next field is not cleared, so stop there
+        n++;
+        msg = (msg == pending_tail ? NULL : msg->next);
+    }
+    return n;
+}
+
+
 /*o2string o2_key_pad(char *padded, const char *key)
 {
     int i;
@@ -95,52 +115,321 @@ o2_info_ptr o2_service_find(const char *service_name, services_entry_ptr *servic
 }
 
 
-// This function is invoked by macros o2_send and o2_send_cmd.
-// It expects arguments to end with O2_MARKER_A and O2_MARKER_B
-int o2_send_marker(const char *path, double time, int tcp_flag, const char *typestring, ...)
+// policies set by o2_service_policy() are kept here so that they apply
+// when the service appears (again) and services_entry is created
+typedef struct service_policy {
+    char *name;
+    int policy;
+    int param;
+} service_policy, *service_policy_ptr;
+
+static dyn_array service_policies;
+
+
+int o2_service_policy(const char *service, int policy, int param)
 {
-    va_list ap;
-    va_start(ap, typestring);
+    if (!o2_application_name) {
+        return O2_NOT_INITIALIZED;
+    }
+    if (!service || !*service || strchr(service, '/') ||
+        strchr(service, '!') || strlen(service) >= NAME_BUF_LEN) {
+        return O2_BAD_SERVICE_NAME;
+    }
+    if (policy < O2_POLICY_FIRST || policy > O2_POLICY_HASH_PATH ||
+        param < 0) {
+        return O2_BAD_ARGS;
+    }
+    service_policy_ptr sp = NULL;
+    int i;
+    for (i = 0; i < service_policies.length; i++) {
+        service_policy_ptr p = DA_GET(service_policies, service_policy, i);
+        if (streql(p->name, service)) {
+            sp = p;
+            break;
+        }
+    }
+    if (!sp) {
+        char *name = (char *) O2_MALLOC(strlen(service) + 1);
+        if (!name) return O2_NO_MEMORY;
+        strcpy(name, service);
+        DA_EXPAND(service_policies, service_policy);
+        sp = DA_LAST(service_policies, service_policy);
+        sp->name = name;
+    }
+    sp->policy = policy;
+    sp->param = param;
+    services_entry_ptr services = *o2_services_find(service);
+    if (services) o2_service_policy_init(services);
+    O2_DBd(printf("%s service %s policy %d param %d\n", o2_debug_prefix,
+                  service, policy, param));
+    return O2_SUCCESS;
+}
+
+
+// copy the policy for services->key (if any) to services
+void o2_service_policy_init(services_entry_ptr services)
+{
+    int i;
+    services->policy = O2_POLICY_FIRST;
+    services->policy_param = 0;
+    for (i = 0; i < service_policies.length; i++) {
+        service_policy_ptr sp = DA_GET(service_policies, service_policy, i);
+        if (streql(sp->name, services->key)) {
+            services->policy = sp->policy;
+            services->policy_param = sp->param;
+            return;
+        }
+    }
+}
+
+
+void o2_service_policy_finish()
+{
+    int i;
+    for (i = 0; i < service_policies.length; i++) {
+        O2_FREE(DA_GET(service_policies, service_policy, i)->name);
+    }
+    DA_FINISH(service_policies);
+}
+
 
+// bytes waiting to be sent to a provider: the socket send queue plus
+// messages held until the connection is made. Local and OSC providers
+// are never backed up by O2, so they report 0.
+static int provider_queued(o2_info_ptr info)
+{
+    if (info->tag != TCP_SOCKET) return 0;
+    process_info_ptr proc = (process_info_ptr) info;
+    int queued = 0;
     o2_message_ptr msg;
-    int rslt = o2_message_build(&msg, time, NULL, path, typestring, tcp_flag,
-                                ap);
-#ifndef O2_NO_DEBUGGING
-    if (o2_debug & // either non-system (s) or system (S) mask
-        (msg->data.address[1] != '_' && !isdigit(msg->data.address[1]) ?
-         O2_DBs_FLAG : O2_DBS_FLAG)) {
-        printf("O2: sending%s ", (tcp_flag ? " cmd" : ""));
-        o2_msg_data_print(&(msg->data));
-        printf("\n");
+    for (msg = proc->proc.pending; msg; msg = msg->next) {
+        queued += msg->length;
     }
+    if (proc->fds_index >= 0 && proc->proc.status != PROCESS_CONNECTING) {
+        SOCKET fd = DA_GET(o2_fds, struct pollfd, proc->fds_index)->fd;
+        int n = 0;
+#if defined(SO_NWRITE)
+        socklen_t len = sizeof(n);
+        if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &n, &len) == 0) {
+            queued += n;
+        }
+#elif defined(TIOCOUTQ)
+        if (ioctl(fd, TIOCOUTQ, &n) == 0) {
+            queued += n;
+        }
 #endif
-    if (rslt != O2_SUCCESS) {
-        return rslt; // could not allocate a message!
     }
-    return o2_message_send_sched(msg, TRUE);
+    return queued;
 }
 
-// This is the externally visible message send function.
-//
-int o2_message_send(o2_message_ptr msg)
+
+// 32-bit FNV-1a, continuing from h
+static uint32_t policy_hash(uint32_t h, const char *data, int len)
 {
-    return o2_message_send_sched(msg, TRUE);
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t) data[i];
+        h *= 16777619;
+    }
+    return h;
 }
 
-// Internal message send function.
-// schedulable is normally TRUE meaning we can schedule messages
-// according to their timestamps. If this message was dispatched
-// by o2_ltsched, schedulable will be FALSE and we should ignore
-// the timestamp, which has already been observed by o2_ltsched.
-//
-// msg is freed by this function
+
+// final mix so that similar names do not get similar scores
+static uint32_t policy_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+
+// find the bytes to hash for O2_POLICY_HASH_PATH or O2_POLICY_HASH_ARG,
+// returning the length. If the node or argument is not found, the key is
+// the whole address. msg must be in host byte order.
+static int policy_key(services_entry_ptr services, o2_msg_data_ptr msg,
+                      const char **key)
+{
+    int n = services->policy_param;
+    *key = msg->address;
+    if (IS_BUNDLE(msg)) {
+        return (int) strlen(msg->address);
+    }
+    if (services->policy == O2_POLICY_HASH_PATH) {
+        const char *node = strchr(msg->address + 1, '/');
+        while (node && n-- > 0) {
+            node = strchr(node + 1, '/');
+        }
+        if (node) {
+            const char *end = strchr(++node, '/');
+            *key = node;
+            return end ? (int) (end - node) : (int) strlen(node);
+        }
+        return (int) strlen(msg->address);
+    }
+    // O2_POLICY_HASH_ARG: skip over arguments as in o2_msg_swap_endian()
+    char *types = O2_MSG_TYPES(msg);
+    char *data = WORD_ALIGN_PTR(types + strlen(types) + 4);
+    char *end_of_msg = PTR(msg) + MSG_DATA_LENGTH(msg);
+    for (; *types; types++) {
+        int size;
+        switch (*types) {
+            case O2_INT32:
+            case O2_BOOL:
+            case O2_MIDI:
+            case O2_FLOAT:
+            case O2_CHAR:
+                size = sizeof(int32_t);
+                break;
+            case O2_TIME:
+            case O2_INT64:
+            case O2_DOUBLE:
+                size = sizeof(int64_t);
+                break;
+            case O2_STRING:
+            case O2_SYMBOL:
+                if (data >= end_of_msg) return (int) strlen(msg->address);
+                size = (int) o2_strsize(data);
+                break;
+            case O2_BLOB:
+                if (data + sizeof(int32_t) > end_of_msg) {
+                    return (int) strlen(msg->address);
+                }
+                size = sizeof(int32_t) + ((*((int32_t *) data) + 3) & ~3);
+                break;
+            case O2_TRUE:
+            case O2_FALSE:
+            case O2_NIL:
+            case O2_INFINITUM:
+                size = 0;
+                break;
+            case O2_ARRAY_START:
+            case O2_ARRAY_END:
+                continue; // not counted as arguments
+            default: // vectors are not supported as keys
+                return (int) strlen(msg->address);
+        }
+        if (data + size > end_of_msg) break;
+        if (n-- == 0) {
+            if (size == 0) { // the type code is the value
+                *key = types;
+                return 1;
+            }
+            *key = data;
+            return size;
+        }
+        data += size;
+    }
+    return (int) strlen(msg->address);
+}
+
+
+// choose the provider for msg according to services->policy. The first
+// provider is at index 0; taps follow it and other providers follow
+// the taps. Used only when sending: local delivery (o2_msg_data_deliver)
+// always uses the local provider.
 //
-int o2_message_send_sched(o2_message_ptr msg, int schedulable)
+o2_info_ptr o2_service_choose(o2_msg_data_ptr msg, services_entry_ptr services)
+{
+    o2_info_ptr first = GET_SERVICE(services->services, 0);
+    int count = 0;
+    int i;
+    if (services->policy == O2_POLICY_FIRST || first->tag == TAPPER) {
+        return first;
+    }
+    for (i = 0; i < services->services.length; i++) {
+        if (GET_SERVICE(services->services, i)->tag != TAPPER) count++;
+    }
+    if (count < 2) return first;
+
+    int start = services->next_provider % count;
+    uint32_t seed = 2166136261u; // FNV offset basis
+    if (services->policy == O2_POLICY_HASH_ARG ||
+        services->policy == O2_POLICY_HASH_PATH) {
+        const char *key;
+        int len = policy_key(services, msg, &key);
+        seed = policy_hash(seed, key, len);
+    }
+    o2_info_ptr best = first;
+    int best_index = 0;
+    uint32_t best_score = 0;
+    int best_queued = 0;
+    int c = 0; // index among providers
+    for (i = 0; i < services->services.length; i++) {
+        o2_info_ptr info = GET_SERVICE(services->services, i);
+        if (info->tag == TAPPER) continue;
+        if (services->policy == O2_POLICY_ROUND_ROBIN) {
+            if (c == start) {
+                best = info;
+                best_index = c;
+                break;
+            }
+        } else if (services->policy == O2_POLICY_LEAST_QUEUED) {
+            // ties go to the first provider at or after start
+            int queued = provider_queued(info);
+            int order = (c - start + count) % count;
+            if (c == 0 || queued < best_queued ||
+                (queued == best_queued &&
+                 order < (best_index - start + count) % count)) {
+                best = info;
+                best_index = c;
+                best_queued = queued;
+            }
+        } else { // rendezvous hashing: the highest score wins
+            o2string name = (info->tag == TCP_SOCKET ?
+                             ((process_info_ptr) info)->proc.name :
+                             o2_process->proc.name);
+            uint32_t score = policy_mix(policy_hash(seed, name,
+                                                    (int) strlen(name)));
+            if (c == 0 || score > best_score) {
+                best = info;
+                best_index = c;
+                best_score = score;
+            }
+        }
+        c++;
+    }
+    services->next_provider = best_index + 1;
+    return best;
+}
+
+
+// the provider offered by this process, if any
+static o2_info_ptr local_provider(services_entry_ptr services)
+{
+    int i;
+    for (i = 0; i < services->services.length; i++) {
+        o2_info_ptr info = GET_SERVICE(services->services, i);
+        if (info->tag != TCP_SOCKET && info->tag != TAPPER) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+
+static int message_send(o2_message_ptr msg, int schedulable, int local)
 {
+    if (!local) { // local is set for messages that were already sent
+        O2_TRACE_EVENT(O2_TRACE_SEND, &msg->data);
+    }
     // Find the remote service, note that we skip over the leading '/':
     services_entry_ptr services;
     o2_info_ptr service = o2_msg_service(&msg->data, &services);
+    o2_info_ptr provider = NULL;
+    if (service && local) {
+        provider = local_provider(services);
+    }
+    if (provider) {
+        service = provider;
+    } else if (service && services->policy != O2_POLICY_FIRST) {
+        service = o2_service_choose(&msg->data, services);
+    }
     if (!service) {
+        o2_dropped_no_service++;
         o2_message_free(msg);
         return O2_FAIL;
     } else if (service->tag == TCP_SOCKET) { // remote delivery?
@@ -177,13 +466,79 @@ int o2_message_send_sched(o2_message_ptr msg, int schedulable)
 }
 
 
+// This function is invoked by macros o2_send and o2_send_cmd.
+// It expects arguments to end with O2_MARKER_A and O2_MARKER_B
+int o2_send_marker(const char *path, double time, int tcp_flag, const char *typestring, ...)
+{
+    va_list ap;
+    va_start(ap, typestring);
+
+    o2_message_ptr msg;
+    int rslt = o2_message_build(&msg, time, NULL, path, typestring, tcp_flag,
+                                ap);
+#ifndef O2_NO_DEBUGGING
+    if (o2_debug & // either non-system (s) or system (S) mask
+        (msg->data.address[1] != '_' && !isdigit(msg->data.address[1]) ?
+         O2_DBs_FLAG : O2_DBS_FLAG)) {
+        printf("O2: sending%s ", (tcp_flag ? " cmd" : ""));
+        o2_msg_data_print(&(msg->data));
+        printf("\n");
+    }
+#endif
+    if (rslt != O2_SUCCESS) {
+        return rslt; // could not allocate a message!
+    }
+    return o2_message_send_sched(msg, TRUE);
+}
+
+// This is the externally visible message send function.
+//
+int o2_message_send(o2_message_ptr msg)
+{
+    return o2_message_send_sched(msg, TRUE);
+}
+
+// Internal message send function.
+// schedulable is normally TRUE meaning we can schedule messages
+// according to their timestamps. If this message was dispatched
+// by o2_ltsched, schedulable will be FALSE and we should ignore
+// the timestamp, which has already been observed by o2_ltsched.
+//
+// msg is freed by this function
+//
+int o2_message_send_sched(o2_message_ptr msg, int schedulable)
+{
+    O2_PROBE3(send, (char *) msg->data.address, msg->length,
+              O2_PROBE_USEC(msg->data.timestamp));
+    return message_send(msg, schedulable, FALSE);
+}
+
+
+// Like o2_message_send_sched(), but if this process offers the service,
+// msg is delivered here. This is used for messages from other processes,
+// which may have chosen this process among several providers (see
+// o2_service_policy()), and for messages leaving the scheduler, which
+// only holds messages for local delivery.
+//
+int o2_message_send_local(o2_message_ptr msg, int schedulable)
+{
+    return message_send(msg, schedulable, TRUE);
+}
+
+
 // deliver msg_data; similar to o2_message_send but local future
 //     delivery requires the creation of an o2_message
 int o2_msg_data_send(o2_msg_data_ptr msg, int tcp_flag)
 {
     services_entry_ptr services;
     o2_info_ptr service = o2_msg_service(msg, &services);
-    if (!service) return O2_FAIL;
+    if (!service) {
+        o2_dropped_no_service++;
+        return O2_FAIL;
+    }
+    if (services->policy != O2_POLICY_FIRST) {
+        service = o2_service_choose(msg, services);
+    }
     if (service->tag == TCP_SOCKET) {
         return o2_send_remote(msg, tcp_flag, (process_info_ptr) service);
     } else if (service->tag == OSC_REMOTE_SERVICE) {
@@ -207,10 +562,15 @@ int o2_msg_data_send(o2_msg_data_ptr msg, int tcp_flag)
 
 int o2_send_remote(o2_msg_data_ptr msg, int tcp_flag, process_info_ptr info)
 {
+    O2_PROBE4(send_remote, (char *) msg->address, MSG_DATA_LENGTH(msg),
+              O2_PROBE_USEC(msg->timestamp), tcp_flag);
+    // the receiver may need to know about our latest services
+    o2_flush_service_changes();
     // send the message to remote process
     if (tcp_flag) {
         return send_by_tcp_to_process(info, msg);
     } else { // send via UDP
+        O2_TRACE_EVENT(O2_TRACE_WIRE, msg);
         O2_DBs(if (msg->address[1] != '_' && !isdigit(msg->address[1]))
                    o2_dbg_msg("sent UDP", msg, "to", info->proc.name));
         O2_DBS(if (msg->address[1] == '_' || isdigit(msg->address[1]))
@@ -222,8 +582,11 @@ int o2_send_remote(o2_msg_data_ptr msg, int tcp_flag, process_info_ptr info)
                    0, (struct sockaddr *) &(info->proc.udp_sa),
                    sizeof(info->proc.udp_sa)) < 0) {
             perror("o2_send_remote");
+            info->send_errors++;
             return O2_FAIL;
         }
+        info->msgs_out++;
+        info->bytes_out += MSG_DATA_LENGTH(msg);
     }
     return O2_SUCCESS;
 }
@@ -233,10 +596,16 @@ int o2_send_remote(o2_msg_data_ptr msg, int tcp_flag, process_info_ptr info)
 // message after calling this.
 int send_by_tcp_to_process(process_info_ptr info, o2_msg_data_ptr msg)
 {
+    if (info->fds_index == -1) { // not connected (see o2_set_lazy_connect())
+        return o2_lazy_send(info, msg);
+    } else if (info->proc.status == PROCESS_CONNECTING) {
+        return o2_pending_append(info, msg); // sent when connected
+    }
     O2_DBs(if (msg->address[1] != '_' && !isdigit(msg->address[1]))
            o2_dbg_msg("sending TCP", msg, "to", info->proc.name));
     O2_DBS(if (msg->address[1] == '_' || isdigit(msg->address[1]))
            o2_dbg_msg("sending TCP", msg, "to", info->proc.name));
+    O2_TRACE_EVENT(O2_TRACE_WIRE, msg);
 #if IS_LITTLE_ENDIAN
     o2_msg_swap_endian(msg, TRUE);
 #endif
@@ -248,6 +617,7 @@ int send_by_tcp_to_process(process_info_ptr info, o2_msg_data_ptr msg)
     SOCKET fd = DA_GET(o2_fds, struct pollfd, info->fds_index)->fd;
     if (send(fd, (char *) &MSG_DATA_LENGTH(msg), len + sizeof(int32_t),
              MSG_NOSIGNAL) < 0) {
+        info->send_errors++;
         if (errno != EAGAIN && errno != EINTR) {
             O2_DBo(printf("%s removing remote process after send error to socket %ld", o2_debug_prefix, (long) fd));
             o2_remove_remote_process(info);
@@ -259,5 +629,7 @@ int send_by_tcp_to_process(process_info_ptr info, o2_msg_data_ptr msg)
     // restore len just in case caller needs it to skip over the
     // message, which has now been byte-swapped and should not be read
     MSG_DATA_LENGTH(msg) = len;
+    info->msgs_out++;
+    info->bytes_out += len;
     return O2_SUCCESS;
 }    
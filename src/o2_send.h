@@ -17,12 +17,23 @@
 
 extern int o2_in_find_and_call_handlers;
 
+// messages dropped because their service does not exist
+extern int64_t o2_dropped_no_service;
+
 void o2_deliver_pending();
 
+int o2_pending_length();
+
 services_entry_ptr *o2_services_find(const char *service_name);
 
 o2_info_ptr o2_msg_service(o2_msg_data_ptr msg, services_entry_ptr *services);
 
+void o2_service_policy_init(services_entry_ptr services);
+
+void o2_service_policy_finish();
+
+o2_info_ptr o2_service_choose(o2_msg_data_ptr msg, services_entry_ptr services);
+
 /**
  *  \brief Use initial part of an O2 address to find an o2_service using
  *  a hash table lookup.
@@ -40,6 +51,8 @@ o2_info_ptr o2_service_find(const char *name, services_entry_ptr *services);
 
 int o2_message_send_sched(o2_message_ptr msg, int schedulable);
 
+int o2_message_send_local(o2_message_ptr msg, int schedulable);
+
 int o2_msg_data_send(o2_msg_data_ptr msg, int tcp_flag);
 
 int o2_send_remote(o2_msg_data_ptr msg, int tcp_flag,
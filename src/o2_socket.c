@@ -13,6 +13,8 @@
 #include "o2_send.h"
 #include "o2_interoperation.h"
 #include "o2_socket.h"
+#include "o2_trace.h"
+#include "o2_probes.h"
 
 #ifdef WIN32
 #include <stdio.h> 
@@ -39,6 +41,13 @@ typedef struct ifaddrs
 #else
 #include "sys/ioctl.h"
 #include <ifaddrs.h>
+// UDP_SOCKET asks the kernel to timestamp arriving packets so that
+// clock sync is not affected by delays in the poll loop
+#if defined(SO_TIMESTAMPNS) || defined(SO_TIMESTAMP)
+#define O2_RECV_TIMESTAMPS
+#include <time.h>
+#include "sys/time.h"
+#endif
 #endif
 
 static int osc_tcp_handler(SOCKET sock, process_info_ptr info);
@@ -57,6 +66,7 @@ dyn_array o2_fds_info; ///< info about sockets
 
 process_info_ptr o2_process = NULL; ///< the process descriptor for this process
 process_info_ptr o2_message_source = NULL; ///< socket info for current message
+o2_time o2_message_recv_time = -1; ///< local arrival time of current message
 
 int o2_found_network = FALSE;
 
@@ -110,8 +120,11 @@ static void deliver_or_schedule(process_info_ptr info)
                isdigit(info->message->data.address[1]))
                o2_dbg_msg("msg received", &info->message->data,
                           "type", o2_tag_to_string(info->tag)));
+    info->msgs_in++;
+    info->bytes_in += info->message->length;
+    O2_TRACE_EVENT(O2_TRACE_RECEIVE, &info->message->data);
     o2_message_source = info;
-    o2_message_send_sched(info->message, TRUE);
+    o2_message_send_local(info->message, TRUE);
 }
 
 
@@ -304,6 +317,7 @@ int o2_process_initialize(process_info_ptr info, int status, int hub_flag)
     info->proc.status = status;
     info->proc.uses_hub = hub_flag;
     DA_INIT(info->proc.services, o2string, 0);
+    info->proc.services_seq = -1;
     info->port = 0;
     memset(&info->proc.udp_sa, 0, sizeof(info->proc.udp_sa));
     return O2_SUCCESS;
@@ -379,7 +393,8 @@ int o2_make_tcp_recv_socket(int tag, int port,
     if (tag == TCP_SERVER_SOCKET || tag == OSC_TCP_SERVER_SOCKET) {
         // only bind server port
         RETURN_IF_ERROR(bind_recv_socket(sock, &port, TRUE));
-        RETURN_IF_ERROR(listen(sock, 10));
+        // every process in an ensemble may connect at once at startup
+        RETURN_IF_ERROR(listen(sock, SOMAXCONN));
         O2_DBo(printf("%s bind and listen called on socket %ld\n",
                       o2_debug_prefix, (long) sock));
     }
@@ -429,11 +444,28 @@ int o2_make_tcp_recv_socket(int tag, int port,
 }
 
                                     
-int o2_make_udp_recv_socket(int tag, int *port, process_info_ptr *info)
+// make a UDP socket bound to *port. If share_flag is set, other
+// processes can bind the same port (see o2_make_udp_shared_socket())
+//
+static int make_udp_recv_socket(int tag, int *port, int share_flag,
+                                process_info_ptr *info)
 {
     SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock == INVALID_SOCKET)
         return O2_FAIL;
+#ifdef SO_REUSEPORT
+    // SO_REUSEADDR (set by bind_recv_socket()) is enough on Linux, but
+    // BSD and macOS need SO_REUSEPORT, which must be set before bind()
+    if (share_flag) {
+        int yes = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                       (const char *) &yes, sizeof(yes)) < 0) {
+            perror("setsockopt(SO_REUSEPORT)");
+            closesocket(sock);
+            return O2_FAIL;
+        }
+    }
+#endif
     // Bind the socket
     int err;
     if ((err = bind_recv_socket(sock, port, FALSE))) {
@@ -442,12 +474,37 @@ int o2_make_udp_recv_socket(int tag, int *port, process_info_ptr *info)
     }
     O2_DBo(printf("%s created socket %ld and bind called to receive UDP\n",
                   o2_debug_prefix, (long) sock));
+#ifdef O2_RECV_TIMESTAMPS
+    if (tag == UDP_SOCKET) {
+        int option = 1;
+#ifdef SO_TIMESTAMPNS
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, 
+#else
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, 
+#endif
+                       (const char *) &option, sizeof(option)) < 0) {
+            perror("setsockopt(SO_TIMESTAMPNS)");
+        }
+    }
+#endif
     *info = o2_add_new_socket(sock, tag, &udp_recv_handler);
     // printf("%s: o2_make_udp_recv_socket: listening on port %d\n", o2_debug_prefix, o2_process.port);
     return O2_SUCCESS;
 }
 
 
+int o2_make_udp_recv_socket(int tag, int *port, process_info_ptr *info)
+{
+    return make_udp_recv_socket(tag, port, FALSE, info);
+}
+
+
+int o2_make_udp_shared_socket(int tag, int port, process_info_ptr *info)
+{
+    return make_udp_recv_socket(tag, &port, TRUE, info);
+}
+
+
 // When service is delegated to OSC via TCP, a TCP connection
 // is created. Incoming messages are delivered to this
 // handler.
@@ -478,10 +535,17 @@ void o2_socket_remove(int i)
                   GET_PROCESS(i)->port,
                   (long long) pfd->fd));
     SOCKET sock = pfd->fd;
+    process_info_ptr removed = GET_PROCESS(i);
+    if (removed->tag == OSC_TCP_CLIENT) { // write any buffered OSC output
+        if (removed->osc.out.length > 0) o2_osc_flush_socket(removed);
+        DA_FINISH(removed->osc.out);
+    }
+    if (sock != INVALID_SOCKET) { // no socket if connection never started
 #ifdef SHUT_WR
-    shutdown(sock, SHUT_WR);
+        shutdown(sock, SHUT_WR);
 #endif
-    if (closesocket(pfd->fd)) perror("closing socket");
+        if (closesocket(sock)) perror("closing socket");
+    }
     if (o2_fds.length > i + 1) { // move last to i
         struct pollfd *lastfd = DA_LAST(o2_fds, struct pollfd);
         memcpy(pfd, lastfd, sizeof(struct pollfd));
@@ -565,7 +629,14 @@ int o2_recv()
     for (i = 0; i < len; i++) {
         struct pollfd *d = DA_GET(o2_fds, struct pollfd, i);
         // if (d->revents) printf("%d:%p:%x ", i, d, d->revents);
-        if (d->revents & POLLERR) {
+        if ((d->events & POLLOUT) && d->revents) {
+            // a connect call finished or failed: the handler finds out
+            process_info_ptr info = GET_PROCESS(i);
+            if ((*(info->handler))(d->fd, info)) {
+                O2_DBo(printf("%s removing remote process after connect failed on socket %ld\n", o2_debug_prefix, (long) d->fd));
+                o2_remove_remote_process(info);
+            }
+        } else if (d->revents & POLLERR) {
         } else if (d->revents & POLLHUP) {
             process_info_ptr info = GET_PROCESS(i);
             O2_DBo(printf("%s removing remote process after POLLHUP to socket %ld\n", o2_debug_prefix, (long) d->fd));
@@ -679,6 +750,7 @@ int o2_osc_tcp_accept_handler(SOCKET sock, process_info_ptr info)
     process_info_ptr conn_info = o2_add_new_socket(connection, OSC_TCP_SOCKET, &osc_tcp_handler);
     assert(info->osc.service_name);
     conn_info->osc.service_name = info->osc.service_name;
+    conn_info->osc.slip = info->osc.slip;
     assert(info->port != 0);
     conn_info->port = info->port;
     O2_DBoO(printf("%s OSC server on port %d accepts client as socket %ld for service %s\n",
@@ -691,6 +763,9 @@ int o2_osc_tcp_accept_handler(SOCKET sock, process_info_ptr info)
 //
 static int osc_tcp_handler(SOCKET sock, process_info_ptr info)
 {
+    if (info->osc.slip) {
+        return o2_osc_slip_recv(sock, info);
+    }
     int n = read_whole_message(sock, info);
     if (n == O2_FAIL) { // not ready to process message yet
         return O2_SUCCESS;
@@ -712,6 +787,9 @@ static int osc_tcp_handler(SOCKET sock, process_info_ptr info)
 //
 static int read_whole_message(SOCKET sock, process_info_ptr info)
 {
+    // OSC is received after space for the O2 service and timestamp
+    int headroom = (info->tag == OSC_TCP_SOCKET ?
+                    o2_osc_headroom(info->osc.service_name) : 0);
     assert(info->length_got < 5);
     // printf("--   %s: read_whole message length_got %d length %d message_got %d\n",
     //       o2_debug_prefix, info->length_got, info->length, info->message_got);
@@ -721,6 +799,10 @@ static int read_whole_message(SOCKET sock, process_info_ptr info)
         // int, so int is ok for n
         int n = (int) recvfrom(sock, PTR(&(info->length)) + info->length_got,
                                4 - info->length_got, 0, NULL, NULL);
+        if (n == 0) { /* the other process closed the connection */
+            tcp_message_cleanup(info);
+            return O2_TCP_HUP;
+        }
         if (n < 0) { /* error: close the socket */
 #ifdef WIN32
             if ((errno != EAGAIN && errno != EINTR) ||
@@ -740,21 +822,27 @@ static int read_whole_message(SOCKET sock, process_info_ptr info)
         info->length_got += n;
         assert(info->length_got < 5);
         if (info->length_got < 4) {
+            info->partial_reads++;
             return O2_FAIL;
         }
         // done receiving length bytes
         info->length = htonl(info->length);
-        info->message = o2_alloc_size_message(info->length);
+        info->message = o2_alloc_size_message(info->length + headroom);
         info->message_got = 0; // just to make sure
     }
 
     /* read the full message */
     if (info->message_got < info->length) {
         // coerce to int to avoid compiler warning; message length is int, so n can be int
-        int n = (int) recvfrom(sock,
-                               PTR(&(info->message->data)) + info->message_got,
+        int n = (int) recvfrom(sock, PTR(&(info->message->data)) + headroom +
+                                     info->message_got,
                                info->length - info->message_got, 0, NULL, NULL);
-        if (n <= 0) {
+        if (n == 0) { /* the other process closed the connection */
+            o2_message_free(info->message);
+            tcp_message_cleanup(info);
+            return O2_TCP_HUP;
+        }
+        if (n < 0) {
 #ifdef WIN32
             if ((errno != EAGAIN && errno != EINTR) ||
                 (GetLastError() != WSAEWOULDBLOCK &&
@@ -773,10 +861,17 @@ static int read_whole_message(SOCKET sock, process_info_ptr info)
         }
         info->message_got += n;
         if (info->message_got < info->length) {
+            info->partial_reads++;
             return O2_FAIL; 
         }
     }
     info->message->length = info->length;
+    // OSC has no timestamp, and O2 is still in network byte order
+    O2_PROBE4(tcp_read, PTR(&(info->message->data)) +
+                        (headroom ? headroom : sizeof(o2_time)),
+              info->length, headroom ? 0 :
+                            o2_probe_net_usec(&(info->message->data)),
+              info->tag);
     return O2_SUCCESS; // we have a full message now
 }
 
@@ -832,6 +927,42 @@ static int tcp_recv_handler(SOCKET sock, process_info_ptr info)
 }
 
 
+#ifdef O2_RECV_TIMESTAMPS
+// find the kernel timestamp for a received packet and convert it to
+// local time. The kernel uses system (wall clock) time, which may not
+// be the local time base, so compute how long ago the packet arrived
+// and subtract that from the current local time. Returns -1 if there
+// is no timestamp.
+//
+static o2_time recv_timestamp(struct msghdr *mh)
+{
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) continue;
+        double age;
+#ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_type != SCM_TIMESTAMPNS) continue;
+        struct timespec stamp, now;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        clock_gettime(CLOCK_REALTIME, &now);
+        age = (now.tv_sec - stamp.tv_sec) +
+              (now.tv_nsec - stamp.tv_nsec) * 1.0E-9;
+#else
+        if (cmsg->cmsg_type != SCM_TIMESTAMP) continue;
+        struct timeval stamp, now;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        gettimeofday(&now, NULL);
+        age = (now.tv_sec - stamp.tv_sec) +
+              (now.tv_usec - stamp.tv_usec) * 1.0E-6;
+#endif
+        if (age < 0) age = 0; // system time was adjusted
+        return o2_local_time() - age;
+    }
+    return -1;
+}
+#endif
+
+
 static int udp_recv_handler(SOCKET sock, process_info_ptr info)
 {
     int len;
@@ -839,12 +970,33 @@ static int udp_recv_handler(SOCKET sock, process_info_ptr info)
         perror("udp_recv_handler");
         return O2_FAIL;
     }
-    info->message = o2_alloc_size_message(len);
+    // OSC is received after space for the O2 service and timestamp
+    int headroom = (info->tag == OSC_SOCKET ?
+                    o2_osc_headroom(info->osc.service_name) : 0);
+    info->message = o2_alloc_size_message(len + headroom);
     if (!info->message) return O2_FAIL;
     int n;
+#ifdef O2_RECV_TIMESTAMPS
+    struct iovec iov;
+    iov.iov_base = PTR(&(info->message->data)) + headroom;
+    iov.iov_len = len;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    n = (int) recvmsg(sock, &mh, 0);
+    if (n > 0 && info->tag == UDP_SOCKET) {
+        o2_message_recv_time = recv_timestamp(&mh);
+    }
+    if (n <= 0) {
+#else
     // coerce to int to avoid compiler warning; len is int, so int is good for n
-    if ((n = (int) recvfrom(sock, (char *) &(info->message->data), len, 
-                            0, NULL, NULL)) <= 0) {
+    if ((n = (int) recvfrom(sock, PTR(&(info->message->data)) + headroom,
+                            len, 0, NULL, NULL)) <= 0) {
+#endif
         // I think udp errors should be ignored. UDP is not reliable
         // anyway. For now, though, let's at least print errors.
         perror("recvfrom in udp_recv_handler");
@@ -853,9 +1005,15 @@ static int udp_recv_handler(SOCKET sock, process_info_ptr info)
         return O2_FAIL;
     }
     info->message->length = n;
+    // OSC has no timestamp, and O2 is still in network byte order
+    O2_PROBE4(udp_recv, PTR(&(info->message->data)) +
+                        (headroom ? headroom : sizeof(o2_time)),
+              n, headroom ? 0 : o2_probe_net_usec(&(info->message->data)),
+              info->tag);
     // endian corrections are done in handler
     if (info->tag == UDP_SOCKET || info->tag == DISCOVER_SOCKET) {
         deliver_or_schedule(info);
+        o2_message_recv_time = -1;
     } else if (info->tag == OSC_SOCKET) {
         return o2_deliver_osc(info);
     } else {
@@ -36,6 +36,7 @@ struct poll_fd {
 //#include <pthread.h>
 //#endif
 #include <netinet/tcp.h>
+#include <fcntl.h>
 #define closesocket close
 #include <netdb.h>      // Header for socket transportations. Included "stdint.h"
 typedef int SOCKET;     // In O2, we'll use SOCKET to denote the type of a socket
@@ -73,6 +74,7 @@ typedef int (*o2_socket_handler)(SOCKET sock, struct process_info *info);
 #define PROCESS_CONNECTED 1   // connect call returned or accepted connection
 #define PROCESS_NO_CLOCK 2    // process initial message received, not clock synced
 #define PROCESS_OK 3          // process is clock synced
+#define PROCESS_CONNECTING 4  // non-blocking connect call in progress
 
 
 // anything with a tag is of the "abstract superclass" o2_info
@@ -105,6 +107,13 @@ typedef struct process_info { // "subclass" of o2_info
               // this is the port number of the OSC_TCP_SERVER_SOCKET from
               // which this socket was accepted. (It is used by
               // o2_osc_port_free() to identify the sockets to close.)
+    // counters reported by o2_stats_get() and /_o2/stats:
+    int64_t msgs_in;            // messages received on this socket
+    int64_t bytes_in;           // bytes received (message data only)
+    int64_t msgs_out;           // messages sent to this process or socket
+    int64_t bytes_out;          // bytes sent (message data only)
+    int64_t partial_reads;      // reads that ended before a whole message
+    int64_t send_errors;        // failed sends
     union {
         struct {
             o2string name; // e.g. "128.2.1.100:55765", this is used so that when
@@ -119,14 +128,27 @@ typedef struct process_info { // "subclass" of o2_info
             dyn_array services; // these are the keys of remote_service_entry
                         // objects, owned by the service entries (do not free)
             struct sockaddr_in udp_sa;  // address for sending UDP messages
+            int32_t services_seq; // version of the process's service table
+                        // from the latest /sv message, -1 if none yet
+            o2_message_ptr pending; // TCP messages waiting for a connection
+                        // when fds_index is -1 (see o2_set_lazy_connect())
+                        // or status is PROCESS_CONNECTING
+            struct sockaddr_in tcp_sa; // address passed to connect()
+            o2_time connect_deadline; // give up connecting at this time
         } proc;
         struct {
             o2string service_name;
+            int slip; // TCP packets are SLIP-framed (see O2_OSC_SLIP)
+            int slip_esc; // the last byte received was a SLIP ESC
+            dyn_array out; // OSC_TCP_CLIENT output, see o2_osc_flush()
         } osc;
     };        
 } process_info, *process_info_ptr;
 
 extern process_info_ptr o2_message_source;
+// local time at which the current message arrived according to the
+// kernel, or -1 if unknown (only UDP_SOCKET messages are timestamped)
+extern o2_time o2_message_recv_time;
 
 extern char o2_local_ip[24];
 extern int o2_local_tcp_port;
@@ -173,6 +195,10 @@ int o2_make_tcp_recv_socket(int tag, int port, o2_socket_handler handler,
 
 int o2_make_udp_recv_socket(int tag, int *port, process_info_ptr *info);
 
+// like o2_make_udp_recv_socket(), but every process on the host can bind
+// port, e.g. to receive multicast
+int o2_make_udp_shared_socket(int tag, int port, process_info_ptr *info);
+
 int o2_osc_delegate_handler(SOCKET sock, process_info_ptr info);
 
 void o2_free_deleted_sockets();
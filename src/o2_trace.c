@@ -0,0 +1,179 @@
+//  o2_trace.c -- message tracing
+//
+// When O2 is compiled with O2_TRACE and o2_trace_start() has been
+// called, messages are followed through each process: the
+// application sends the message, it is written to a socket, read from
+// a socket at the receiver, possibly scheduled, and finally a handler
+// is called. Each step is recorded with local and global time in a
+// ring buffer of trace_events, and o2_trace_write() saves them in the
+// Chrome trace event format (load the file with chrome://tracing or
+// https://ui.perfetto.dev). Using global time, traces written by
+// different processes can be concatenated and shown on one timeline.
+//
+// Adding an ID to messages would change the O2 message format, so a
+// message's trace ID is instead an FNV-1a hash of the message
+// (timestamp, address, types and data) in host byte order. The
+// sender and receiver compute the same ID, so events in different
+// processes are connected by the ID. Identical messages get the same
+// ID, but they are still ordered in time.
+
+#ifdef O2_TRACE
+
+#include <stdio.h>
+#include "o2_internal.h"
+#include "o2_clock.h"
+#include "o2_trace.h"
+
+#define TRACE_ADDRESS_LEN 48
+#define TRACE_HASH_MAX 256 // only hash this many bytes of the message
+
+typedef struct trace_event {
+    o2_time local;   // local time of the event
+    o2_time global;  // global time, or -1 if the clock is not synchronized
+    uint32_t id;     // the message trace ID
+    int kind;        // O2_TRACE_SEND, etc.
+    char address[TRACE_ADDRESS_LEN]; // truncated if necessary
+} trace_event, *trace_event_ptr;
+
+int o2_tracing = FALSE;
+static trace_event_ptr trace_ring = NULL;
+static int trace_capacity = 0;
+static int64_t trace_count = 0; // trace_ring[trace_count % capacity] is next
+
+static const char *trace_names[] = { "send", "wire", "receive",
+                                     "schedule", "dispatch", "return" };
+
+
+static uint32_t trace_id(o2_msg_data_ptr msg)
+{
+    int len = MSG_DATA_LENGTH(msg);
+    if (len > TRACE_HASH_MAX) len = TRACE_HASH_MAX;
+    uint32_t h = 2166136261u; // FNV-1a
+    const unsigned char *data = (const unsigned char *) PTR(msg);
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+
+void o2_trace_event(int kind, o2_msg_data_ptr msg)
+{
+    trace_event_ptr event = &trace_ring[trace_count++ % trace_capacity];
+    event->local = o2_local_time();
+    event->global = (o2_gtsched_started ?
+                     o2_local_to_global(event->local) : -1);
+    // the handler may have changed the message, and a return event only
+    // needs to close the span, so do not compute its ID
+    event->id = (kind == O2_TRACE_RETURN ? 0 : trace_id(msg));
+    event->kind = kind;
+    strncpy(event->address, msg->address, TRACE_ADDRESS_LEN - 1);
+    event->address[TRACE_ADDRESS_LEN - 1] = 0;
+}
+
+
+int o2_trace_start(int capacity)
+{
+    if (capacity <= 0) return O2_FAIL;
+    if (capacity != trace_capacity) {
+        trace_event_ptr ring = (trace_event_ptr)
+                O2_MALLOC(capacity * sizeof(trace_event));
+        if (!ring) return O2_NO_MEMORY;
+        if (trace_ring) O2_FREE(trace_ring);
+        trace_ring = ring;
+        trace_capacity = capacity;
+    }
+    trace_count = 0;
+    o2_tracing = TRUE;
+    return O2_SUCCESS;
+}
+
+
+void o2_trace_stop()
+{
+    o2_tracing = FALSE;
+}
+
+
+// print a string as a JSON string, escaping as necessary
+static void json_string(FILE *out, const char *s)
+{
+    putc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(out, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            putc(*s, out);
+        }
+    }
+    putc('"', out);
+}
+
+
+int o2_trace_write(const char *filename)
+{
+    if (!o2_application_name) return O2_NOT_INITIALIZED;
+    FILE *out = fopen(filename, "w");
+    if (!out) return O2_FAIL;
+    // Chrome needs a number for each process
+    const char *name = o2_process->proc.name;
+    uint32_t pid = 2166136261u;
+    const char *p;
+    for (p = name; *p; p++) {
+        pid = (pid ^ (unsigned char) *p) * 16777619u;
+    }
+    pid &= 0x7fffffff;
+    fprintf(out, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+            "\"pid\":%u,\"tid\":1,\"args\":{\"name\":", pid);
+    json_string(out, name);
+    fprintf(out, "}}");
+    int64_t first = trace_count - trace_capacity;
+    if (first < 0) first = 0;
+    int64_t i;
+    for (i = first; i < trace_count; i++) {
+        trace_event_ptr event = &trace_ring[i % trace_capacity];
+        // microseconds on the global timeline if there is one
+        double ts = (event->global >= 0 ? event->global : event->local) *
+                    1000000.0;
+        fprintf(out, ",\n{\"name\":");
+        json_string(out, event->address);
+        if (event->kind == O2_TRACE_RETURN) {
+            fprintf(out, ",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%u,\"tid\":1}",
+                    ts, pid);
+            continue;
+        }
+        // the dispatch span contains the handler call; other events
+        // are shown as 1us slices so that flow arrows can attach to them
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,%s"
+                "\"pid\":%u,\"tid\":1,\"args\":{\"id\":\"%08x\","
+                "\"local\":%.6f,\"global\":%.6f}}",
+                trace_names[event->kind],
+                event->kind == O2_TRACE_DISPATCH ? "B" : "X", ts,
+                event->kind == O2_TRACE_DISPATCH ? "" : "\"dur\":1,",
+                pid, event->id, event->local, event->global);
+        // connect the events of each message with a flow
+        const char *flow = (event->kind == O2_TRACE_SEND ? "s" :
+                            (event->kind == O2_TRACE_DISPATCH ? "f" : "t"));
+        fprintf(out, ",\n{\"name\":\"message\",\"cat\":\"flow\",\"ph\":\"%s\","
+                "%s\"id\":\"%08x\",\"ts\":%.3f,\"pid\":%u,\"tid\":1}",
+                flow, event->kind == O2_TRACE_DISPATCH ? "\"bp\":\"e\"," : "",
+                event->id, ts, pid);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(out) == 0 ? O2_SUCCESS : O2_FAIL;
+}
+
+
+void o2_trace_finish()
+{
+    o2_tracing = FALSE;
+    if (trace_ring) O2_FREE(trace_ring);
+    trace_ring = NULL;
+    trace_capacity = 0;
+    trace_count = 0;
+}
+
+#endif
@@ -0,0 +1,26 @@
+/* o2_trace.h -- header for message tracing (see o2_trace_start()) */
+
+#ifdef O2_TRACE
+
+#define O2_TRACE_SEND 0      // the application sent the message
+#define O2_TRACE_WIRE 1      // the message was written to a socket
+#define O2_TRACE_RECEIVE 2   // the message was read from a socket
+#define O2_TRACE_SCHEDULE 3  // the message was put in a scheduler
+#define O2_TRACE_DISPATCH 4  // a handler was called (begins a span)
+#define O2_TRACE_RETURN 5    // the handler returned (ends the span)
+
+extern int o2_tracing; // TRUE between o2_trace_start() and o2_trace_stop()
+
+void o2_trace_event(int kind, o2_msg_data_ptr msg);
+
+void o2_trace_finish();
+
+// record an event if tracing is on; compiles to nothing without O2_TRACE
+#define O2_TRACE_EVENT(kind, msg) \
+    do { if (o2_tracing) o2_trace_event((kind), (msg)); } while (0)
+
+#else
+
+#define O2_TRACE_EVENT(kind, msg) do {} while (0)
+
+#endif
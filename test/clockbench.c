@@ -0,0 +1,142 @@
+//  clockbench.c - compare the cost of local clock sources
+//
+//  This program times o2_local_time() (which uses CLOCK_MONOTONIC on
+//  Linux, or the CPU timestamp counter if O2 is compiled with
+//  O2_USE_TSC) and the system clock functions it could be built on.
+//  It prints the average cost of each call in nanoseconds.
+//
+//  Usage: clockbench [count]
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#ifndef WIN32
+#include <time.h>
+#include <sys/time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define N_DEFAULT 10000000
+
+int n = N_DEFAULT;
+
+// prevent the compiler from optimizing away unused results
+volatile double sink = 0;
+
+
+#ifndef WIN32
+// each benchmark is timed using CLOCK_MONOTONIC so that the result
+// does not depend on the clock being measured
+double elapsed_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_nsec - start->tv_nsec) * 1.0E-9;
+}
+#define START_TIMING struct timespec start; \
+                     clock_gettime(CLOCK_MONOTONIC, &start);
+#define REPORT(name) report(name, elapsed_since(&start))
+#else
+#define START_TIMING o2_time start = o2_local_time();
+#define REPORT(name) report(name, o2_local_time() - start)
+#endif
+
+
+void report(const char *name, double secs)
+{
+    printf("%-26s %8.2f ns/call\n", name, secs * 1.0E9 / n);
+}
+
+
+void bench_o2_local_time()
+{
+    START_TIMING
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += o2_local_time();
+    }
+    sink = sum;
+    REPORT("o2_local_time");
+}
+
+
+#ifndef WIN32
+void bench_gettimeofday()
+{
+    START_TIMING
+    double sum = 0;
+    struct timeval tv;
+    for (int i = 0; i < n; i++) {
+        gettimeofday(&tv, NULL);
+        sum += tv.tv_sec + tv.tv_usec * 0.000001;
+    }
+    sink = sum;
+    REPORT("gettimeofday");
+}
+
+
+void bench_clock_gettime(clockid_t id, const char *name)
+{
+    START_TIMING
+    double sum = 0;
+    struct timespec ts;
+    for (int i = 0; i < n; i++) {
+        clock_gettime(id, &ts);
+        sum += ts.tv_sec + ts.tv_nsec * 1.0E-9;
+    }
+    sink = sum;
+    REPORT(name);
+}
+#endif
+
+
+#ifdef HAVE_RDTSC
+void bench_rdtsc()
+{
+    START_TIMING
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += (double) __rdtsc();
+    }
+    sink = sum;
+    REPORT("rdtsc (uncalibrated)");
+}
+#endif
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: clockbench [count] (default count is %d)\n", N_DEFAULT);
+    if (argc == 2) {
+        n = atoi(argv[1]);
+        if (n <= 0) n = N_DEFAULT;
+    }
+    o2_initialize("test");
+#ifdef O2_USE_TSC
+    printf("o2_local_time uses the CPU timestamp counter\n");
+#endif
+    bench_o2_local_time();
+#ifndef WIN32
+    bench_gettimeofday();
+    bench_clock_gettime(CLOCK_REALTIME, "CLOCK_REALTIME");
+    bench_clock_gettime(CLOCK_MONOTONIC, "CLOCK_MONOTONIC");
+#ifdef CLOCK_MONOTONIC_RAW
+    bench_clock_gettime(CLOCK_MONOTONIC_RAW, "CLOCK_MONOTONIC_RAW");
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+    bench_clock_gettime(CLOCK_MONOTONIC_COARSE, "CLOCK_MONOTONIC_COARSE");
+#endif
+#endif
+#ifdef HAVE_RDTSC
+    bench_rdtsc();
+#endif
+    o2_finish();
+    printf("CLOCKBENCH DONE\n");
+    return 0;
+}
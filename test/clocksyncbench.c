@@ -0,0 +1,410 @@
+//  clocksyncbench.c - accuracy of clock synchronization under impairment
+//
+//  This program forks one master and n slave processes on the local
+//  host. They share CLOCK_MONOTONIC, so the true master time is known
+//  to every process and each slave can measure its own error directly.
+//
+//  The master provides the clock with o2_clock_set(). Each slave uses
+//  the internal o2_local_clock_set() with a clock that runs fast or slow by up to
+//  drift ppm (spread evenly from -drift to +drift across the slaves).
+//
+//  Network impairment comes from a shim that replaces sendto(), which
+//  O2 uses for all UDP (including clock sync requests and replies).
+//  Each datagram is held for delay +/- asymmetry, plus a random jitter
+//  in [0, jitter], then sent. Slave-to-master datagrams get
+//  delay * (1 + asymmetry) and master-to-slave datagrams get
+//  delay * (1 - asymmetry), so an asymmetry of 0.5 with a 2ms delay
+//  means 3ms one way and 1ms the other. TCP is not impaired.
+//
+//  Each process reports to the parent through a pipe. The parent prints
+//  the time from start to the first o2_clock_is_synchronized for each
+//  slave, the absolute offset error (mean and max over slaves) for each
+//  second of the run, the p50/p99/max error over the second half of the
+//  run, and the number of clock sync requests (/_cs/get) per second
+//  handled by the master, from o2_stats_get().
+//
+//  Usage: clocksyncbench [-n slaves] [-t seconds] [-d delay_ms]
+//                        [-j jitter_ms] [-a asymmetry] [-r drift_ppm]
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+// internal header for o2_local_clock_set(), which is not public
+#include "o2_internal.h"
+
+#define MAX_SLAVES 32
+#define MAX_DELAYED 4096
+#define SAMPLE_PERIOD 0.1
+#define MAX_SAMPLES 100000
+
+int n_slaves = 2;
+double duration = 20.0;
+double delay = 0.0;      // one-way delay in seconds
+double jitter = 0.0;     // max random extra delay in seconds
+double asymmetry = 0.0;
+double drift_ppm = 100.0;
+
+double t0; // CLOCK_MONOTONIC at startup, shared by all processes
+int report_fd; // write end of the pipe to the parent
+unsigned seed = 1;
+
+
+double real_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1.0E-9 - t0;
+}
+
+
+double random_unit()
+{
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) & 0xFFFFFF) / (double) 0x1000000;
+}
+
+
+/********** UDP impairment shim **********/
+
+typedef struct delayed_packet {
+    double release;
+    int fd;
+    int flags;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    size_t len;
+    char *data;
+} delayed_packet;
+
+delayed_packet delayed[MAX_DELAYED];
+int n_delayed = 0;
+double out_delay = 0.0; // delay for datagrams sent by this process
+
+
+ssize_t real_sendto(int fd, const void *buf, size_t len, int flags,
+                    const struct sockaddr *addr, socklen_t addrlen)
+{
+    return syscall(SYS_sendto, fd, buf, len, flags, addr, addrlen);
+}
+
+
+// O2 is linked statically, so this definition is used instead of the
+// C library's for every UDP datagram that O2 sends
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               const struct sockaddr *addr, socklen_t addrlen)
+{
+    if ((out_delay <= 0 && jitter <= 0) || !addr ||
+        addrlen > sizeof(struct sockaddr_storage) ||
+        n_delayed >= MAX_DELAYED) {
+        return real_sendto(fd, buf, len, flags, addr, addrlen);
+    }
+    delayed_packet *p = &delayed[n_delayed++];
+    p->release = real_time() + out_delay + random_unit() * jitter;
+    p->fd = fd;
+    p->flags = flags;
+    memcpy(&p->addr, addr, addrlen);
+    p->addrlen = addrlen;
+    p->len = len;
+    p->data = (char *) malloc(len);
+    memcpy(p->data, buf, len);
+    return len;
+}
+
+
+// send datagrams whose delay has expired
+void shim_pump()
+{
+    double now = real_time();
+    int i = 0;
+    while (i < n_delayed) {
+        delayed_packet *p = &delayed[i];
+        if (p->release <= now) {
+            real_sendto(p->fd, p->data, p->len, p->flags,
+                        (struct sockaddr *) &p->addr, p->addrlen);
+            free(p->data);
+            delayed[i] = delayed[--n_delayed];
+        } else {
+            i++;
+        }
+    }
+}
+
+
+/********** master and slave processes **********/
+
+o2_time master_clock(void *rock)
+{
+    return real_time();
+}
+
+
+o2_time slave_clock(void *rock)
+{
+    return real_time() * (1.0 + *(double *) rock);
+}
+
+
+// poll O2 and the shim until the end of the run, calling callback
+// (if any) after each poll
+void run_loop(void (*callback)(int), int index)
+{
+    while (real_time() < duration) {
+        shim_pump();
+        o2_poll();
+        if (callback) {
+            (*callback)(index);
+        }
+        usleep(100);
+    }
+}
+
+
+int run_master()
+{
+    o2_initialize("clocksync");
+    out_delay = delay * (1.0 - asymmetry);
+    o2_clock_set(&master_clock, NULL);
+    // global time is real_time() minus a constant offset
+    double before = real_time();
+    o2_time now = o2_time_get();
+    double after = real_time();
+    dprintf(report_fd, "M %.9f\n", now - (before + after) * 0.5);
+
+    run_loop(NULL, 0);
+
+    o2_stats stats;
+    int requests = 0;
+    if (o2_stats_get(&stats) == O2_SUCCESS) {
+        for (int i = 0; i < stats.service_count; i++) {
+            if (strcmp(stats.services[i].name, "_cs") == 0) {
+                requests = (int) stats.services[i].delivered;
+            }
+        }
+        o2_stats_free(&stats);
+    }
+    dprintf(report_fd, "P %d\n", requests);
+    o2_finish();
+    return 0;
+}
+
+
+int synchronized = FALSE;
+double next_sample = 0;
+
+void slave_poll(int index)
+{
+    if (!synchronized) {
+        if (!o2_clock_is_synchronized) {
+            return;
+        }
+        synchronized = TRUE;
+        dprintf(report_fd, "C %d %.6f\n", index, real_time());
+    }
+    if (real_time() < next_sample) {
+        return;
+    }
+    next_sample += SAMPLE_PERIOD;
+    double before = real_time();
+    o2_time estimate = o2_time_get();
+    double after = real_time();
+    dprintf(report_fd, "S %d %.6f %.9f\n", index, (before + after) * 0.5,
+            estimate);
+}
+
+
+int run_slave(int index)
+{
+    double drift = drift_ppm * 1.0E-6;
+    if (n_slaves > 1) {
+        drift *= 2.0 * index / (n_slaves - 1) - 1.0;
+    }
+    seed = index + 2;
+    o2_initialize("clocksync");
+    out_delay = delay * (1.0 + asymmetry);
+    o2_local_clock_set(&slave_clock, &drift);
+    dprintf(report_fd, "B %d %.6f %.3f\n", index, real_time(),
+            drift * 1.0E6);
+    next_sample = real_time();
+    run_loop(&slave_poll, index);
+    o2_finish();
+    return 0;
+}
+
+
+/********** the parent collects and reports results **********/
+
+typedef struct sample {
+    int slave;
+    double time;
+    double estimate;
+    double error;
+} sample;
+
+sample *samples;
+int n_samples = 0;
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+void report(FILE *in)
+{
+    double master_offset = 0; // master global time - real_time()
+    int requests = -1;
+    double start[MAX_SLAVES];
+    double converged[MAX_SLAVES];
+    double drift[MAX_SLAVES];
+    for (int i = 0; i < n_slaves; i++) {
+        converged[i] = -1;
+    }
+    samples = (sample *) malloc(sizeof(sample) * MAX_SAMPLES);
+    char line[128];
+    while (fgets(line, sizeof(line), in)) {
+        int i;
+        double t, x;
+        if (sscanf(line, "M %lf", &x) == 1) {
+            master_offset = x;
+        } else if (sscanf(line, "P %d", &i) == 1) {
+            requests = i;
+        } else if (sscanf(line, "B %d %lf %lf", &i, &t, &x) == 3) {
+            start[i] = t;
+            drift[i] = x;
+        } else if (sscanf(line, "C %d %lf", &i, &t) == 2) {
+            converged[i] = t;
+        } else if (sscanf(line, "S %d %lf %lf", &i, &t, &x) == 3 &&
+                   n_samples < MAX_SAMPLES) {
+            samples[n_samples].slave = i;
+            samples[n_samples].time = t;
+            samples[n_samples].estimate = x;
+            n_samples++;
+        }
+    }
+    // the master offset arrives whenever the master reports it, so
+    // compute errors after reading everything
+    for (int i = 0; i < n_samples; i++) {
+        samples[i].error = samples[i].estimate -
+                           (samples[i].time + master_offset);
+    }
+
+    printf("%d slaves, %g s, delay %g ms, jitter %g ms, asymmetry %g, "
+           "drift %g ppm\n", n_slaves, duration, delay * 1000,
+           jitter * 1000, asymmetry, drift_ppm);
+    for (int i = 0; i < n_slaves; i++) {
+        if (converged[i] < 0) {
+            printf("slave %d: drift %+.1f ppm, never synchronized\n",
+                   i, drift[i]);
+        } else {
+            printf("slave %d: drift %+.1f ppm, synchronized after %.3f s\n",
+                   i, drift[i], converged[i] - start[i]);
+        }
+    }
+
+    printf("\n  time  mean |error| us  max |error| us\n");
+    for (int second = 0; second < (int) ceil(duration); second++) {
+        double sum = 0, max = 0;
+        int count = 0;
+        for (int i = 0; i < n_samples; i++) {
+            if ((int) samples[i].time == second) {
+                double e = fabs(samples[i].error) * 1.0E6;
+                sum += e;
+                if (e > max) max = e;
+                count++;
+            }
+        }
+        if (count > 0) {
+            printf("%6d %16.1f %15.1f\n", second, sum / count, max);
+        }
+    }
+
+    double *errors = (double *) malloc(sizeof(double) * MAX_SAMPLES);
+    int n_errors = 0;
+    for (int i = 0; i < n_samples; i++) {
+        if (samples[i].time >= duration / 2) {
+            errors[n_errors++] = fabs(samples[i].error) * 1.0E6;
+        }
+    }
+    if (n_errors > 0) {
+        qsort(errors, n_errors, sizeof(double), &compare_doubles);
+        printf("\nsecond half |error|: p50 %.1f us, p99 %.1f us, "
+               "max %.1f us\n", errors[n_errors / 2],
+               errors[(int) (n_errors * 0.99)], errors[n_errors - 1]);
+    }
+    if (requests >= 0) {
+        printf("master handled %d clock sync requests, %.2f/s "
+               "(%.2f/s per slave)\n", requests, requests / duration,
+               requests / duration / n_slaves);
+    }
+    free(errors);
+    free(samples);
+}
+
+
+void usage()
+{
+    fprintf(stderr, "Usage: clocksyncbench [-n slaves] [-t seconds] "
+            "[-d delay_ms] [-j jitter_ms] [-a asymmetry] [-r drift_ppm]\n");
+    exit(1);
+}
+
+
+int main(int argc, char * const argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:t:d:j:a:r:")) != -1) {
+        switch (c) {
+          case 'n': n_slaves = atoi(optarg); break;
+          case 't': duration = atof(optarg); break;
+          case 'd': delay = atof(optarg) * 0.001; break;
+          case 'j': jitter = atof(optarg) * 0.001; break;
+          case 'a': asymmetry = atof(optarg); break;
+          case 'r': drift_ppm = atof(optarg); break;
+          default: usage();
+        }
+    }
+    if (n_slaves < 1 || n_slaves > MAX_SLAVES || duration <= 0 ||
+        delay < 0 || jitter < 0 || asymmetry < -1 || asymmetry > 1) {
+        usage();
+    }
+    t0 = 0;
+    t0 = real_time();
+
+    int fds[2];
+    if (pipe(fds)) {
+        perror("clocksyncbench pipe");
+        return 1;
+    }
+    pid_t pids[MAX_SLAVES + 1];
+    for (int p = 0; p <= n_slaves; p++) {
+        pids[p] = fork();
+        if (pids[p] == 0) {
+            close(fds[0]);
+            report_fd = fds[1];
+            exit(p == 0 ? run_master() : run_slave(p - 1));
+        } else if (pids[p] < 0) {
+            perror("clocksyncbench fork");
+            return 1;
+        }
+    }
+    close(fds[1]);
+    FILE *in = fdopen(fds[0], "r");
+    report(in);
+    fclose(in);
+    for (int p = 0; p <= n_slaves; p++) {
+        waitpid(pids[p], NULL, 0);
+    }
+    printf("CLOCKSYNCBENCH DONE\n");
+    return 0;
+}
@@ -0,0 +1,586 @@
+//  discoverybench.c - discovery and startup cost of a full mesh
+//
+//  This program forks n processes on the local host, all with the same
+//  application name. Process i offers service s<i>, and after each
+//  poll it checks o2_status() of every other s<j>. When all of them
+//  are known (status >= 0), the process reports to the parent through
+//  a pipe, and it reports again whenever one is lost or found.
+//
+//  Each process also counts what it sends, through shims that replace
+//  sendto() and send(), which O2 uses for all UDP and TCP messages.
+//  Messages are classified by address: discovery (!_o2/dy), init
+//  (!_o2/in, sent on each new TCP connection), services (/sv, the
+//  service lists) and everything else (mostly clock sync). With each
+//  report of seeing all others, a process includes its socket count
+//  (from o2_stats_get()), and at exit, it reports the peak heap
+//  allocated by O2 (through o2_memory()) and its max RSS.
+//
+//  The run has two phases:
+//    - cold start: all n processes are forked at once, and the time
+//      from fork until each one sees all the others is measured
+//    - rolling restart: -r times, one process (in turn) is stopped,
+//      we wait until every other process has noticed, then a new
+//      process with the same service is forked, and the time until
+//      all n processes see each other again is measured
+//
+//  With broadcast discovery (see doc/design.txt), every process sends
+//  discovery messages to the discovery ports of o2_port_map, and every
+//  pair of processes makes a TCP connection and exchanges service
+//  lists, so packets grow as n^2. Use -m to measure multicast
+//  discovery (o2_discovery_multicast()) instead.
+//
+//  Usage: discoverybench [-n processes] [-r restarts] [-t timeout]
+//                        [-m] [-y usec] [-d debug_flags]
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#define MAX_PROCS 500
+#define MULTICAST_GROUP "239.255.0.79"
+#define MULTICAST_PORT 64579
+
+int n_procs = 10;
+int n_restarts = 5;
+double timeout = 60.0;
+int multicast = FALSE;
+int yield_usec = 1000;
+const char *debug_flags = NULL;
+
+double t0; // CLOCK_MONOTONIC at startup, shared by all processes
+int report_fd; // write end of the pipe to the parent
+
+
+double real_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1.0E-9 - t0;
+}
+
+
+/********** counting shims **********/
+
+#define DISCOVERY 0
+#define INIT 1
+#define SERVICES 2
+#define OTHER 3
+#define N_KINDS 4
+
+const char *kind_names[N_KINDS] = { "discovery", "init", "services",
+                                    "other" };
+
+int64_t sent[N_KINDS];
+
+
+// classify a message by the end of its address, which follows the
+// timestamp in data
+void count_message(const char *data, size_t len)
+{
+    const char *address = data + sizeof(o2_time);
+    size_t max = len - sizeof(o2_time);
+    size_t alen = (len > sizeof(o2_time) ? strnlen(address, max) : 0);
+    int kind = OTHER;
+    if (alen >= 3 && alen < max) {
+        const char *suffix = address + alen - 3;
+        if (strcmp(suffix, "/dy") == 0) kind = DISCOVERY;
+        else if (strcmp(suffix, "/in") == 0) kind = INIT;
+        else if (strcmp(suffix, "/sv") == 0) kind = SERVICES;
+    }
+    sent[kind]++;
+}
+
+
+// O2 is linked statically, so these definitions are used instead of the
+// C library's: sendto() for every UDP datagram and send() for every TCP
+// message, which is preceded by its length
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               const struct sockaddr *addr, socklen_t addrlen)
+{
+    count_message((const char *) buf, len);
+    return syscall(SYS_sendto, fd, buf, len, flags, addr, addrlen);
+}
+
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    if (len > sizeof(int32_t)) {
+        count_message((const char *) buf + sizeof(int32_t),
+                      len - sizeof(int32_t));
+    } else {
+        sent[OTHER]++;
+    }
+    return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+
+// heap allocated by O2, measured with malloc_usable_size() so that
+// memory allocated here can be freed by the C library and vice versa
+int64_t heap = 0;
+int64_t heap_peak = 0;
+
+void *counting_malloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p) {
+        heap += malloc_usable_size(p);
+        if (heap > heap_peak) heap_peak = heap;
+    }
+    return p;
+}
+
+
+void counting_free(void *p)
+{
+    if (p) {
+        heap -= malloc_usable_size(p);
+    }
+    free(p);
+}
+
+
+/********** child processes **********/
+
+volatile sig_atomic_t running = TRUE;
+
+void stop_handler(int sig)
+{
+    running = FALSE;
+}
+
+
+// count the other services that this process can reach
+int visible_services(int index)
+{
+    char name[32];
+    int count = 0;
+    for (int j = 0; j < n_procs; j++) {
+        if (j != index) {
+            sprintf(name, "s%d", j);
+            if (o2_status(name) >= 0) count++;
+        }
+    }
+    return count;
+}
+
+
+int socket_count()
+{
+    int sockets = 0;
+    o2_stats stats;
+    if (o2_stats_get(&stats) == O2_SUCCESS) {
+        sockets = stats.socket_count;
+        o2_stats_free(&stats);
+    }
+    return sockets;
+}
+
+
+// each incarnation of process index is distinguished by generation
+int run_child(int index, int generation)
+{
+    signal(SIGTERM, &stop_handler);
+    o2_memory(&counting_malloc, &counting_free);
+    if (debug_flags) o2_debug_flags(debug_flags);
+    if (o2_initialize("discbench") ||
+        (multicast && o2_discovery_multicast(MULTICAST_GROUP,
+                                             MULTICAST_PORT))) {
+        dprintf(report_fd, "F %d %d\n", index, generation);
+        return 1;
+    }
+    char name[32];
+    sprintf(name, "s%d", index);
+    o2_service_new(name);
+
+    int all = FALSE;
+    int visible = 0;
+    while (running) {
+        o2_poll();
+        int count = visible_services(index);
+        if (count != visible) {
+            visible = count;
+            dprintf(report_fd, "V %d %d %d\n", index, generation, visible);
+        }
+        int found = (visible == n_procs - 1);
+        if (found != all) {
+            all = found;
+            dprintf(report_fd, "%c %d %d %.6f %lld %lld %lld %lld %d\n",
+                    (all ? 'A' : 'L'), index, generation, real_time(),
+                    (long long) sent[DISCOVERY], (long long) sent[INIT],
+                    (long long) sent[SERVICES], (long long) sent[OTHER],
+                    socket_count());
+        }
+        if (yield_usec) usleep(yield_usec);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    dprintf(report_fd, "X %d %d %lld %lld %lld %lld %lld %ld\n",
+            index, generation, (long long) sent[DISCOVERY],
+            (long long) sent[INIT], (long long) sent[SERVICES],
+            (long long) sent[OTHER], (long long) heap_peak,
+            usage.ru_maxrss);
+    o2_finish();
+    return 0;
+}
+
+
+/********** the parent starts processes and collects reports **********/
+
+typedef struct proc_state {
+    pid_t pid;
+    int generation;
+    double forked;     // time of fork()
+    double all_time;   // time of the latest A report, -1 after L
+    int64_t sent_at_all[N_KINDS]; // counts in the first A report
+    int sockets;       // socket count in the first A report
+    int visible;       // services of other processes seen
+    int exited;
+    int failed;
+} proc_state;
+
+proc_state procs[MAX_PROCS];
+
+// exit reports, one per process incarnation
+typedef struct exit_report {
+    int64_t sent[N_KINDS];
+    int64_t heap_peak;
+    long rss_kb;
+} exit_report;
+
+exit_report *exits;
+int n_exits = 0;
+
+int pipe_fds[2];
+char in_buf[65536];
+int in_len = 0;
+
+
+void parse_line(char *line)
+{
+    int i, g, count, sockets;
+    double t;
+    long long s[N_KINDS], peak;
+    long rss;
+    if (sscanf(line, "V %d %d %d", &i, &g, &count) == 3) {
+        if (g == procs[i].generation) procs[i].visible = count;
+    } else if (sscanf(line, "F %d %d", &i, &g) == 2) {
+        procs[i].failed = TRUE;
+    } else if (sscanf(line, "A %d %d %lf %lld %lld %lld %lld %d", &i, &g,
+                      &t, &s[0], &s[1], &s[2], &s[3], &sockets) == 8) {
+        if (g == procs[i].generation) {
+            if (procs[i].sent_at_all[DISCOVERY] < 0) {
+                for (int k = 0; k < N_KINDS; k++) {
+                    procs[i].sent_at_all[k] = s[k];
+                }
+                procs[i].sockets = sockets;
+            }
+            procs[i].all_time = t;
+        }
+    } else if (sscanf(line, "L %d %d %lf", &i, &g, &t) == 3) {
+        if (g == procs[i].generation) procs[i].all_time = -1;
+    } else if (sscanf(line, "X %d %d %lld %lld %lld %lld %lld %ld",
+                      &i, &g, &s[0], &s[1], &s[2], &s[3], &peak,
+                      &rss) == 8) {
+        exit_report *x = &exits[n_exits++];
+        for (int k = 0; k < N_KINDS; k++) {
+            x->sent[k] = s[k];
+        }
+        x->heap_peak = peak;
+        x->rss_kb = rss;
+        if (g == procs[i].generation) procs[i].exited = TRUE;
+    }
+}
+
+
+// read and parse reports for up to wait seconds
+void read_reports(double wait)
+{
+    struct pollfd pfd = { pipe_fds[0], POLLIN, 0 };
+    if (poll(&pfd, 1, (int) (wait * 1000)) <= 0) {
+        return;
+    }
+    ssize_t n = read(pipe_fds[0], in_buf + in_len,
+                     sizeof(in_buf) - 1 - in_len);
+    if (n <= 0) return;
+    in_len += (int) n;
+    in_buf[in_len] = 0;
+    char *line = in_buf;
+    char *end;
+    while ((end = strchr(line, '\n'))) {
+        *end = 0;
+        parse_line(line);
+        line = end + 1;
+    }
+    in_len -= (int) (line - in_buf);
+    memmove(in_buf, line, in_len);
+}
+
+
+void start_proc(int index)
+{
+    proc_state *p = &procs[index];
+    p->generation++;
+    p->all_time = -1;
+    p->visible = 0;
+    p->sent_at_all[DISCOVERY] = -1;
+    p->exited = FALSE;
+    p->failed = FALSE;
+    fflush(stdout); // or the child would print it again
+    p->forked = real_time();
+    p->pid = fork();
+    if (p->pid == 0) {
+        close(pipe_fds[0]);
+        report_fd = pipe_fds[1];
+        exit(run_child(index, p->generation));
+    } else if (p->pid < 0) {
+        perror("discoverybench fork");
+        exit(1);
+    }
+}
+
+
+void stop_proc(int index)
+{
+    kill(procs[index].pid, SIGTERM);
+    double deadline = real_time() + 10.0;
+    while (!procs[index].exited && !procs[index].failed &&
+           real_time() < deadline) {
+        read_reports(0.1);
+    }
+    waitpid(procs[index].pid, NULL, 0);
+}
+
+
+// wait until every process sees all others, at or after since;
+// returns the time of the last A report, or -1 on timeout
+double wait_for_mesh(double since)
+{
+    double deadline = real_time() + timeout;
+    while (real_time() < deadline) {
+        double last = since;
+        int done = TRUE;
+        for (int i = 0; i < n_procs && done; i++) {
+            if (procs[i].failed || procs[i].all_time < since) {
+                done = FALSE;
+            } else if (procs[i].all_time > last) {
+                last = procs[i].all_time;
+            }
+        }
+        if (done) return last;
+        read_reports(0.1);
+    }
+    return -1;
+}
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+void print_stats(const char *name, double *values, int n, const char *unit)
+{
+    if (n == 0) return;
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += values[i];
+    qsort(values, n, sizeof(double), &compare_doubles);
+    printf("  %-24s mean %9.3f  p50 %9.3f  max %9.3f %s\n", name,
+           sum / n, values[n / 2], values[n - 1], unit);
+}
+
+
+// after a timeout, show how far discovery got
+void print_visible()
+{
+    int complete = 0;
+    int fewest = n_procs;
+    for (int i = 0; i < n_procs; i++) {
+        if (procs[i].visible == n_procs - 1) complete++;
+        if (procs[i].visible < fewest) fewest = procs[i].visible;
+    }
+    printf("  %d processes saw all others, the fewest seen by one was %d\n",
+           complete, fewest);
+}
+
+
+// returns TRUE if a full mesh was made
+int cold_start()
+{
+    double start = real_time();
+    for (int i = 0; i < n_procs; i++) {
+        start_proc(i);
+    }
+    double done = wait_for_mesh(start);
+    int failed = 0;
+    for (int i = 0; i < n_procs; i++) {
+        if (procs[i].failed) failed++;
+    }
+    printf("cold start: %d processes", n_procs);
+    if (failed) {
+        printf(", %d failed to initialize", failed);
+    }
+    if (done < 0) {
+        printf(", no full mesh after %g s\n", timeout);
+        print_visible();
+        return FALSE;
+    }
+    printf(", full mesh after %.3f s\n", done - start);
+
+    double *values = (double *) malloc(sizeof(double) * n_procs);
+    for (int i = 0; i < n_procs; i++) {
+        values[i] = procs[i].all_time - procs[i].forked;
+    }
+    print_stats("time to see all", values, n_procs, "s");
+    int64_t total = 0;
+    for (int k = 0; k < N_KINDS; k++) {
+        for (int i = 0; i < n_procs; i++) {
+            values[i] = (double) procs[i].sent_at_all[k];
+            total += procs[i].sent_at_all[k];
+        }
+        char name[64];
+        sprintf(name, "%s msgs sent", kind_names[k]);
+        print_stats(name, values, n_procs, "per process");
+    }
+    printf("  %lld messages sent in all until each process saw all others\n",
+           (long long) total);
+    for (int i = 0; i < n_procs; i++) values[i] = procs[i].sockets;
+    print_stats("sockets", values, n_procs, "per process");
+    free(values);
+    return TRUE;
+}
+
+
+void rolling_restart()
+{
+    double *times = (double *) malloc(sizeof(double) * n_restarts);
+    int n_times = 0;
+    for (int r = 0; r < n_restarts; r++) {
+        int index = r % n_procs;
+        stop_proc(index);
+        // wait until the others notice, so that the new process is not
+        // confused with the old one
+        double deadline = real_time() + timeout;
+        int noticed = FALSE;
+        while (!noticed && real_time() < deadline) {
+            noticed = TRUE;
+            for (int i = 0; i < n_procs; i++) {
+                if (i != index && procs[i].all_time >= 0) noticed = FALSE;
+            }
+            if (!noticed) read_reports(0.1);
+        }
+        double start = real_time();
+        start_proc(index);
+        double done = wait_for_mesh(start);
+        if (done < 0) {
+            printf("restart %d of s%d: no full mesh after %g s\n", r,
+                   index, timeout);
+            print_visible();
+            break;
+        }
+        times[n_times++] = done - start;
+    }
+    printf("rolling restart: %d of %d restarts made a full mesh\n",
+           n_times, n_restarts);
+    print_stats("time to full mesh", times, n_times, "s");
+    free(times);
+}
+
+
+void report_exits()
+{
+    if (n_exits == 0) return;
+    double *values = (double *) malloc(sizeof(double) * n_exits);
+    printf("at exit (%d processes, including restarted ones):\n", n_exits);
+    for (int k = 0; k < N_KINDS; k++) {
+        int64_t total = 0;
+        for (int i = 0; i < n_exits; i++) {
+            values[i] = (double) exits[i].sent[k];
+            total += exits[i].sent[k];
+        }
+        char name[64];
+        sprintf(name, "%s msgs sent", kind_names[k]);
+        print_stats(name, values, n_exits, "per process");
+        printf("  %-24s total %lld\n", "", (long long) total);
+    }
+    for (int i = 0; i < n_exits; i++) {
+        values[i] = exits[i].heap_peak / 1024.0;
+    }
+    print_stats("peak O2 heap", values, n_exits, "KB");
+    for (int i = 0; i < n_exits; i++) values[i] = exits[i].rss_kb / 1024.0;
+    print_stats("max RSS", values, n_exits, "MB");
+    free(values);
+}
+
+
+void usage()
+{
+    fprintf(stderr, "Usage: discoverybench [-n processes] [-r restarts] "
+            "[-t timeout] [-m] [-y usec] [-d debug_flags]\n");
+    exit(1);
+}
+
+
+int main(int argc, char * const argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:r:t:my:d:")) != -1) {
+        switch (c) {
+          case 'n': n_procs = atoi(optarg); break;
+          case 'r': n_restarts = atoi(optarg); break;
+          case 't': timeout = atof(optarg); break;
+          case 'm': multicast = TRUE; break;
+          case 'y': yield_usec = atoi(optarg); break;
+          case 'd': debug_flags = optarg; break;
+          default: usage();
+        }
+    }
+    if (n_procs < 2 || n_procs > MAX_PROCS || n_restarts < 0 ||
+        timeout <= 0 || yield_usec < 0) {
+        usage();
+    }
+    t0 = 0;
+    t0 = real_time();
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < (rlim_t) n_procs + 64) {
+        limit.rlim_cur = n_procs + 64; // every process connects to all
+        if (limit.rlim_cur > limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+        }
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (pipe(pipe_fds)) {
+        perror("discoverybench pipe");
+        return 1;
+    }
+    exits = (exit_report *) malloc(sizeof(exit_report) *
+                                   (n_procs + n_restarts));
+    printf("%s discovery, %d processes, %d restarts\n",
+           (multicast ? "multicast" : "broadcast"), n_procs, n_restarts);
+
+    if (cold_start()) {
+        rolling_restart();
+    }
+    for (int i = 0; i < n_procs; i++) {
+        stop_proc(i);
+    }
+    report_exits();
+    free(exits);
+    printf("DISCOVERYBENCH DONE\n");
+    return 0;
+}
@@ -0,0 +1,219 @@
+//  dispatchbench.c - microbenchmark for local message dispatch
+//
+//  This program builds a tree of handlers with o2_method_new() under
+//  the service "bench": width nodes at each of depth levels, and width
+//  handlers under each node at the bottom, e.g. /bench/n3/n0/h7 for a
+//  width of 10 and depth of 2. Then it delivers prebuilt messages with
+//  o2_msg_data_deliver(), so no sockets or scheduling are involved,
+//  and prints nanoseconds, handler calls and heap allocations (counted
+//  through o2_memory()) per delivered message for:
+//    - o2_method_new() while building the tree
+//    - o2_lookup() of full paths in o2_full_path_table
+//    - exact addresses (a hash lookup at each level of the tree)
+//    - "!" addresses (one lookup in the full path table)
+//    - patterns *, [a-z] and {a,b} at the first level below the service
+//      (each tries o2_pattern_match() on all width nodes)
+//    - a handler with no type checking, a handler with exactly matching
+//      types, and a handler that must coerce all its arguments
+//
+//  Usage: dispatchbench [width] [depth] [count]
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+// internal headers for o2_msg_data_deliver() and o2_lookup()
+#include "o2_internal.h"
+#include "o2_search.h"
+
+#define WIDTH_DEFAULT 10
+#define DEPTH_DEFAULT 2
+#define N_DEFAULT 1000000
+#define N_MSGS 64 // exact addresses cycle through this many messages
+
+int width = WIDTH_DEFAULT;
+int depth = DEPTH_DEFAULT;
+int n = N_DEFAULT;
+
+int64_t allocs = 0;
+int64_t calls = 0;
+int methods = 0;
+
+o2_message_ptr msgs[N_MSGS];
+char *full_paths[N_MSGS];
+
+
+void *counting_malloc(size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+
+void handler(o2_msg_data_ptr msg, const char *types,
+             o2_arg_ptr *argv, int argc, void *user_data)
+{
+    calls++;
+}
+
+
+void report(const char *name, double secs, int64_t count,
+            int64_t n_calls, int64_t n_allocs)
+{
+    printf("%-26s %9.1f ns/op %7.2f calls/op %7.2f allocs/op\n", name,
+           secs * 1.0E9 / count, (double) n_calls / count,
+           (double) n_allocs / count);
+}
+
+
+// add width nodes or handlers below prefix, recursively
+void add_methods(char *prefix, int level)
+{
+    int len = (int) strlen(prefix);
+    for (int i = 0; i < width; i++) {
+        if (level <= depth) {
+            sprintf(prefix + len, "/n%d", i);
+            add_methods(prefix, level + 1);
+        } else {
+            sprintf(prefix + len, "/h%d", i);
+            o2_method_new(prefix, "i", &handler, NULL, FALSE, TRUE);
+            methods++;
+        }
+    }
+    prefix[len] = 0;
+}
+
+
+// build a path to a pseudo-random handler, starting with first
+// (a service name or a pattern) at level 1
+void make_path(char *path, char lead, const char *first, unsigned seed)
+{
+    sprintf(path, "%cbench/%s", lead, first);
+    for (int level = 1; level < depth; level++) {
+        seed = seed * 1103515245 + 12345;
+        sprintf(path + strlen(path), "/n%d", (seed >> 16) % width);
+    }
+    seed = seed * 1103515245 + 12345;
+    sprintf(path + strlen(path), "/h%d", (seed >> 16) % width);
+}
+
+
+void bench_deliver(const char *name, o2_message_ptr *messages, int count)
+{
+    int64_t calls0 = calls;
+    int64_t allocs0 = allocs;
+    o2_time start = o2_local_time();
+    for (int i = 0; i < n; i++) {
+        o2_msg_data_deliver(&messages[i % count]->data, FALSE, NULL, NULL);
+    }
+    report(name, o2_local_time() - start, n, calls - calls0,
+           allocs - allocs0);
+}
+
+
+// build and deliver one message with a single int32 argument
+void bench_pattern(const char *name, const char *pattern)
+{
+    char path[256];
+    make_path(path, '/', pattern, 0);
+    o2_send_start();
+    o2_add_int32(1);
+    o2_message_ptr msg = o2_message_finish(0.0, path, TRUE);
+    bench_deliver(name, &msg, 1);
+    o2_message_free(msg);
+}
+
+
+void bench_types(const char *name, const char *path, const char *types)
+{
+    o2_send_start();
+    for (const char *t = types; *t; t++) {
+        switch (*t) {
+          case 'i': o2_add_int32(1); break;
+          case 'f': o2_add_float(2.0F); break;
+          case 'd': o2_add_double(3.0); break;
+          default: assert(FALSE);
+        }
+    }
+    o2_message_ptr msg = o2_message_finish(0.0, path, TRUE);
+    bench_deliver(name, &msg, 1);
+    o2_message_free(msg);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: dispatchbench [width] [depth] [count] "
+           "(defaults are %d %d %d)\n", WIDTH_DEFAULT, DEPTH_DEFAULT,
+           N_DEFAULT);
+    if (argc > 1) width = atoi(argv[1]);
+    if (argc > 2) depth = atoi(argv[2]);
+    if (argc > 3) n = atoi(argv[3]);
+    if (width < 2 || depth < 1 || n < 1) {
+        printf("width must be at least 2, depth and count at least 1\n");
+        return 1;
+    }
+    o2_memory(&counting_malloc, &free);
+    o2_initialize("test");
+    o2_service_new("bench");
+
+    char prefix[256] = "/bench";
+    int64_t allocs0 = allocs;
+    o2_time start = o2_local_time();
+    add_methods(prefix, 1);
+    report("o2_method_new", o2_local_time() - start, methods, 0,
+           allocs - allocs0);
+    printf("%d handlers, width %d, depth %d\n", methods, width, depth);
+
+    o2_service_new("coerce");
+    o2_method_new("/coerce/raw", NULL, &handler, NULL, FALSE, FALSE);
+    o2_method_new("/coerce/exact", "ifd", &handler, NULL, FALSE, TRUE);
+    o2_method_new("/coerce/coerce", "ifd", &handler, NULL, TRUE, TRUE);
+
+    // exact addresses to pseudo-random handlers
+    char path[256];
+    char first[32];
+    for (int i = 0; i < N_MSGS; i++) {
+        sprintf(first, "n%d", i % width);
+        make_path(path, '/', first, i);
+        o2_send_start();
+        o2_add_int32(i);
+        msgs[i] = o2_message_finish(0.0, path, TRUE);
+        full_paths[i] = (char *) O2_MALLOC(strlen(path) + 4);
+        o2_string_pad(full_paths[i], path);
+    }
+
+    int64_t calls0 = calls;
+    allocs0 = allocs;
+    start = o2_local_time();
+    for (int i = 0; i < n; i++) {
+        o2_entry_ptr entry = *o2_lookup(&o2_full_path_table,
+                                        full_paths[i % N_MSGS]);
+        assert(entry);
+    }
+    report("o2_lookup (full path)", o2_local_time() - start, n,
+           calls - calls0, allocs - allocs0);
+
+    bench_deliver("exact address", msgs, N_MSGS);
+    for (int i = 0; i < N_MSGS; i++) {
+        msgs[i]->data.address[0] = '!';
+    }
+    bench_deliver("! full path address", msgs, N_MSGS);
+    for (int i = 0; i < N_MSGS; i++) {
+        o2_message_free(msgs[i]);
+        O2_FREE(full_paths[i]);
+    }
+
+    bench_pattern("pattern *", "*");
+    bench_pattern("pattern [a-z]0", "[a-z]0");
+    bench_pattern("pattern {n0,n1}", "{n0,n1}");
+
+    bench_types("no type check", "/coerce/raw", "ifd");
+    bench_types("exact types ifd", "/coerce/exact", "ifd");
+    bench_types("coerced types fdi->ifd", "/coerce/coerce", "fdi");
+
+    o2_finish();
+    printf("DISPATCHBENCH DONE\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+//  lazyclient.c - test for lazy (on demand) TCP connections
+//
+//  see lazyserver.c for details
+
+
+#include "o2.h"
+#include "stdio.h"
+#include "string.h"
+#include "assert.h"
+
+#ifdef WIN32
+#include "usleep.h" // special windows implementation of sleep/usleep
+#else
+#include <unistd.h>
+#endif
+
+
+int max_msg_count = 1000;
+
+int msg_count = 0;
+int running = TRUE;
+
+
+void client_tcp(o2_msg_data_ptr data, const char *types,
+                o2_arg_ptr *argv, int argc, void *user_data)
+{
+    msg_count++;
+    assert(msg_count == argv[0]->i32);
+    int32_t i = msg_count + 1;
+    // server will shut down when it gets data == -1
+    if (msg_count >= max_msg_count) {
+        i = -1;
+        running = FALSE;
+    }
+    o2_send_cmd("!server/tcp", 0, "i", i);
+    if (msg_count % 100 == 0) {
+        printf("client received %d messages\n", msg_count);
+    }
+}
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: lazyclient [msgcount [flags]] "
+           "(see o2.h for flags, use a for all)\n");
+    if (argc >= 2) {
+        max_msg_count = atoi(argv[1]);
+        printf("max_msg_count set to %d\n", max_msg_count);
+    }
+    if (argc >= 3) {
+        o2_debug_flags(argv[2]);
+        printf("debug flags are: %s\n", argv[2]);
+    }
+    if (argc > 3) {
+        printf("WARNING: lazyclient ignoring extra command line arguments\n");
+    }
+    o2_initialize("test");
+    o2_set_lazy_connect(TRUE);
+    o2_service_new("client");
+    o2_method_new("/client/tcp", "i", &client_tcp, NULL, FALSE, TRUE);
+
+    while (o2_status("server") < O2_LOCAL) {
+        o2_poll();
+        usleep(2000); // 2ms
+    }
+    printf("We discovered the server.\ntime is %g.\n", o2_time_get());
+
+    // UDP messages are sent directly without a TCP connection
+    for (int i = 1; i <= 3; i++) {
+        o2_send("!server/udp", 0, "i", i);
+        o2_poll();
+        usleep(100000); // 100ms
+    }
+
+    // the first TCP message is queued until the connection is made
+    o2_send_cmd("!server/tcp", 0, "i", 1);
+
+    while (running) {
+        o2_poll();
+        usleep(1000);
+    }
+    // poll some more to make sure last message goes out
+    for (int i = 0; i < 100; i++) {
+        o2_poll();
+        usleep(2000); // 2ms
+    }
+
+    o2_finish();
+    sleep(1); // finish cleaning up sockets
+    printf("CLIENT DONE\n");
+    return 0;
+}
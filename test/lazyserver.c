@@ -0,0 +1,93 @@
+//  lazyserver.c - test for lazy (on demand) TCP connections
+//
+//  This program works with lazyclient.c. Both processes call
+//  o2_set_lazy_connect(TRUE), so they learn about each other's
+//  services from discovery without making a TCP connection. The
+//  client sends a few UDP messages, which do not need a connection,
+//  then sends TCP messages, which are queued until the connection is
+//  made. The server replies to each TCP message by TCP.
+//
+
+#include "o2.h"
+#include "stdio.h"
+#include "string.h"
+#include "assert.h"
+
+#ifdef WIN32
+#include "usleep.h" // special windows implementation of sleep/usleep
+#else
+#include <unistd.h>
+#endif
+
+
+int udp_count = 0;
+int msg_count = 0;
+int running = TRUE;
+
+
+void server_udp(o2_msg_data_ptr msg, const char *types,
+                o2_arg_ptr *argv, int argc, void *user_data)
+{
+    udp_count++;
+    printf("server received UDP message %d\n", argv[0]->i32);
+}
+
+
+void server_tcp(o2_msg_data_ptr msg, const char *types,
+                o2_arg_ptr *argv, int argc, void *user_data)
+{
+    if (argv[0]->i32 == -1) {
+        running = FALSE;
+        return;
+    }
+    msg_count++;
+    assert(msg_count == argv[0]->i32);
+    o2_send_cmd("!client/tcp", 0, "i", msg_count);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: lazyserver [debugflags] "
+           "(see o2.h for flags, use a for all)\n");
+    if (argc == 2) {
+        o2_debug_flags(argv[1]);
+        printf("debug flags are: %s\n", argv[1]);
+    }
+    if (argc > 2) {
+        printf("WARNING: lazyserver ignoring extra command line argments\n");
+    }
+
+    o2_initialize("test");
+    o2_set_lazy_connect(TRUE);
+    o2_service_new("server");
+    o2_method_new("/server/udp", "i", &server_udp, NULL, FALSE, TRUE);
+    o2_method_new("/server/tcp", "i", &server_tcp, NULL, FALSE, TRUE);
+
+    // we are the master clock
+    o2_clock_set(NULL, NULL);
+
+    // wait for client service to be discovered
+    while (o2_status("client") < O2_LOCAL) {
+        o2_poll();
+        usleep(2000); // 2ms
+    }
+    printf("We discovered the client at time %g.\n", o2_time_get());
+
+    while (running) {
+        o2_poll();
+        usleep(1000);
+    }
+    printf("server received %d UDP and %d TCP messages\n",
+           udp_count, msg_count);
+
+    // poll some more to make sure last message goes out
+    for (int i = 0; i < 100; i++) {
+        o2_poll();
+        usleep(2000); // 2ms
+    }
+    o2_finish();
+    sleep(1); // clean up sockets
+    printf("SERVER DONE\n");
+    return 0;
+}
@@ -0,0 +1,274 @@
+//  lo_oscbench.c - throughput and latency of the O2 OSC bridge
+//
+//  This program measures both directions of the bridge in one process:
+//  a liblo client sends OSC to an O2 port made with o2_osc_port_new()
+//  for service "oscin". The O2 handler for /oscin/r forwards each
+//  message to service "oscout", made with o2_osc_delegate(), which
+//  sends OSC to a liblo server in this process. Each message carries
+//  an id and the o2_local_time() when it was sent, so the liblo server
+//  measures the latency of the whole path:
+//     liblo -> OSC -> O2 (osc_to_o2) -> handler -> O2 -> OSC -> liblo
+//
+//  For UDP and TCP, and for plain messages and nested bundles (an
+//  immediate bundle holding one message and an inner bundle of two
+//  more), it prints:
+//    - latency percentiles, with one message or bundle in flight
+//    - messages per second, with up to WINDOW messages in flight
+//      (and lost messages, which only UDP can lose)
+//    - O2 heap allocations (counted through o2_memory()) per message
+//      received by the liblo server
+//  O2 must have clock sync to deliver the timestamped messages of a
+//  bundle, so this process is the clock master.
+//
+//  Usage: lo_oscbench [count] [latency_count]
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+#include "lo/lo.h"
+
+#define N_DEFAULT 100000
+#define LATENCY_DEFAULT 2000
+#define WINDOW 64        // messages in flight for throughput
+#define MSGS_PER_BUNDLE 3
+#define DRAIN_TIMEOUT 1.0 // give up on lost messages after this long
+
+// each transport uses its own ports so that sockets from the previous
+// transport cannot interfere
+#define UDP_OSC_IN "8110"
+#define UDP_OSC_OUT "8111"
+#define TCP_OSC_IN "8112"
+#define TCP_OSC_OUT "8113"
+
+int n = N_DEFAULT;
+int n_latency = LATENCY_DEFAULT;
+
+lo_address client;  // sends to the O2 OSC port
+lo_server server;   // receives from the O2 OSC delegate
+
+int64_t allocs = 0;
+int64_t received = 0;
+o2_time last_received = 0;
+
+int recording = FALSE;
+double *latencies;
+int n_latencies = 0;
+int max_latencies;
+
+
+void *counting_malloc(size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+
+// O2 side: forward /oscin/r to the delegate
+void forward_handler(o2_msg_data_ptr msg, const char *types,
+                     o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_send("/oscout/r", 0, "id", argv[0]->i, argv[1]->d);
+}
+
+
+// liblo side: count and time the forwarded messages
+int lo_handler(const char *path, const char *types,
+               lo_arg **argv, int argc, lo_message msg, void *user_data)
+{
+    received++;
+    last_received = o2_local_time();
+    if (recording && n_latencies < max_latencies) {
+        latencies[n_latencies++] = o2_local_time() - argv[1]->d;
+    }
+    return 0;
+}
+
+
+void lo_error(int num, const char *msg, const char *path)
+{
+    printf("liblo server error %d in path %s: %s\n", num, path, msg);
+}
+
+
+void poll_both()
+{
+    o2_poll();
+    while (lo_server_recv_noblock(server, 0) > 0) ;
+}
+
+
+lo_message make_message(int id)
+{
+    lo_message msg = lo_message_new();
+    lo_message_add_int32(msg, id);
+    lo_message_add_double(msg, o2_local_time());
+    return msg;
+}
+
+
+// send one message, or one nested bundle with MSGS_PER_BUNDLE messages;
+// returns the number of messages sent
+int send_item(int id, int bundle_flag)
+{
+    if (!bundle_flag) {
+        lo_message msg = make_message(id);
+        lo_send_message(client, "/r", msg);
+        lo_message_free(msg);
+        return 1;
+    }
+    lo_bundle outer = lo_bundle_new(LO_TT_IMMEDIATE);
+    lo_bundle_add_message(outer, "/r", make_message(id));
+    lo_bundle inner = lo_bundle_new(LO_TT_IMMEDIATE);
+    lo_bundle_add_message(inner, "/r", make_message(id));
+    lo_bundle_add_message(inner, "/r", make_message(id));
+    lo_bundle_add_bundle(outer, inner);
+    lo_send_bundle(client, outer);
+    lo_bundle_free_recursive(outer); // also frees inner and the messages
+    return MSGS_PER_BUNDLE;
+}
+
+
+// poll until received reaches expected or nothing arrives for
+// DRAIN_TIMEOUT; returns the number of messages not received
+int64_t wait_for(int64_t expected)
+{
+    int64_t last = received;
+    o2_time progress = o2_local_time();
+    while (received < expected) {
+        poll_both();
+        if (received != last) {
+            last = received;
+            progress = o2_local_time();
+        } else if (o2_local_time() - progress > DRAIN_TIMEOUT) {
+            return expected - received;
+        }
+    }
+    return 0;
+}
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+void run(const char *transport, int bundle_flag)
+{
+    const char *kind = (bundle_flag ? "bundle" : "message");
+
+    // latency: one message or bundle in flight
+    int64_t lost = 0;
+    n_latencies = 0;
+    recording = TRUE;
+    for (int i = 0; i < n_latency; i++) {
+        int64_t expected = received + send_item(i, bundle_flag);
+        lost += wait_for(expected);
+        received = expected; // do not let late arrivals confuse counts
+    }
+    recording = FALSE;
+    if (n_latencies > 0) {
+        qsort(latencies, n_latencies, sizeof(double), &compare_doubles);
+        printf("%s %-7s latency us: p50 %.1f p99 %.1f p99.9 %.1f "
+               "max %.1f (%lld lost)\n", transport, kind,
+               latencies[n_latencies / 2] * 1.0E6,
+               latencies[(int) (n_latencies * 0.99)] * 1.0E6,
+               latencies[(int) (n_latencies * 0.999)] * 1.0E6,
+               latencies[n_latencies - 1] * 1.0E6, (long long) lost);
+    }
+
+    // throughput: up to WINDOW messages in flight
+    int64_t start_received = received;
+    int64_t start_allocs = allocs;
+    int64_t sent = 0;
+    int64_t dropped = 0; // messages given up on to reopen the window
+    o2_time start = o2_local_time();
+    for (int i = 0; i < n; i++) {
+        o2_time progress = o2_local_time();
+        while (sent - dropped - (received - start_received) >= WINDOW) {
+            int64_t before = received;
+            poll_both();
+            if (received != before) {
+                progress = o2_local_time();
+            } else if (o2_local_time() - progress > 0.01) {
+                // UDP dropped what is in flight; stop waiting for it
+                dropped = sent - (received - start_received);
+            }
+        }
+        sent += send_item(i, bundle_flag);
+    }
+    int64_t expected = start_received + n * (int64_t)
+                       (bundle_flag ? MSGS_PER_BUNDLE : 1);
+    wait_for(expected);
+    // if messages were lost, wait_for() timed out, so use the time
+    // of the last arrival
+    o2_time elapsed = last_received - start;
+    int64_t got = received - start_received;
+    int64_t total = expected - start_received;
+    printf("%s %-7s %.0f msgs/s", transport, kind, got / elapsed);
+    if (bundle_flag) {
+        printf(" (%.0f bundles/s)", n / elapsed);
+    }
+    printf(", %.2f allocs/msg, %lld of %lld lost\n",
+           (double) (allocs - start_allocs) / got,
+           (long long) (total - got), (long long) total);
+    received = expected;
+}
+
+
+void run_transport(const char *transport, int tcp_flag, const char *in_port,
+                   const char *out_port)
+{
+    server = lo_server_new_with_proto(out_port, tcp_flag ? LO_TCP : LO_UDP,
+                                      &lo_error);
+    assert(server);
+    lo_server_add_method(server, "/r", "id", &lo_handler, NULL);
+    o2_osc_delegate("oscout", "127.0.0.1", atoi(out_port), tcp_flag);
+    o2_osc_port_new("oscin", atoi(in_port), tcp_flag);
+    client = lo_address_new_with_proto(tcp_flag ? LO_TCP : LO_UDP,
+                                       "localhost", in_port);
+    assert(client);
+    poll_both(); // make connections
+
+    run(transport, FALSE);
+    run(transport, TRUE);
+
+    lo_address_free(client);
+    o2_osc_port_free(atoi(in_port));
+    o2_service_free("oscout");
+    poll_both();
+    lo_server_free(server);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: lo_oscbench [count] [latency_count] "
+           "(defaults are %d %d)\n", N_DEFAULT, LATENCY_DEFAULT);
+    if (argc > 1) n = atoi(argv[1]);
+    if (argc > 2) n_latency = atoi(argv[2]);
+    if (n < 1 || n_latency < 1) {
+        printf("count and latency_count must be at least 1\n");
+        return 1;
+    }
+    max_latencies = n_latency * MSGS_PER_BUNDLE;
+    latencies = (double *) malloc(sizeof(double) * max_latencies);
+
+    o2_memory(&counting_malloc, &free);
+    o2_initialize("test");
+    o2_clock_set(NULL, NULL); // bundle timestamps need a global clock
+    o2_service_new("oscin");
+    o2_method_new("/oscin/r", "id", &forward_handler, NULL, FALSE, TRUE);
+
+    run_transport("udp", FALSE, UDP_OSC_IN, UDP_OSC_OUT);
+    run_transport("tcp", TRUE, TCP_OSC_IN, TCP_OSC_OUT);
+
+    o2_finish();
+    free(latencies);
+    printf("LO_OSCBENCH DONE\n");
+    return 0;
+}
@@ -0,0 +1,501 @@
+// o2bench.c -- network benchmark with machine-readable results
+//
+// This program measures O2 message passing between processes: one-way
+// throughput and round-trip latency over UDP and TCP for a sweep of
+// payload sizes. Results are written as JSON so that they can be
+// compared from release to release and with the liblo benchmark
+// (lo_benchmk_client.c/lo_benchmk_server.c).
+//
+// By default, o2bench forks server processes on the local host and
+// runs the client in the original process. To measure across hosts,
+// start servers with -S (one per process index) and the client with -c.
+// All processes must use the same -s (services per process).
+//
+// Each server process p offers services bench<p>_0 ... bench<p>_<s-1>,
+// each with these methods:
+//     /bench<p>_<k>/ping "iidb" seq, tcp_flag, client time, payload --
+//         echoed back to /o2bench/pong using the same transport
+//     /bench<p>_<k>/data "ib" seq, payload -- counted, no reply
+// and bench<p>_0 also has control methods sent by TCP:
+//     /bench<p>_0/report "i" run -- reply /o2bench/report "iihhd" with
+//         run, p, messages, payload bytes, and the time between the
+//         first and last data message, then reset the counts
+//     /bench<p>_0/quit "" -- stop the server
+//
+// Latency is measured with one ping outstanding at a time, sent round
+// robin to all services. Throughput is measured by sending count data
+// messages round robin to all services as fast as possible. Over UDP,
+// messages can be lost, so both the send rate and the receive rate are
+// reported along with the loss.
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_PROCESSES 64
+#define MIN_SIZE 16
+#define MAX_SIZE 32768 // O2 rejects larger blobs
+#define DISCOVERY_TIMEOUT 30.0
+#define PING_TIMEOUT 1.0
+#define REPORT_TIMEOUT 10.0
+#define SETTLE_TIME 0.1 // wait for data in flight before asking for reports
+
+int n_processes = 1;
+int n_services = 1;
+int msg_count = 10000;
+int latency_count = 1000;
+int max_size = 32768;
+int do_udp = TRUE;
+int do_tcp = TRUE;
+int client_only = FALSE;
+int server_index = -1;
+int yield_usec = 0; // sleep between polls, 0 to poll as fast as possible
+const char *outfile = NULL;
+
+// server state
+int running = TRUE;
+int server_process = 0;
+int64_t data_count = 0;
+int64_t data_bytes = 0;
+double data_first = 0;
+double data_last = 0;
+
+// client state
+int n_targets = 0;
+char **ping_addresses = NULL;
+char **data_addresses = NULL;
+int ping_seq = -1; // the ping we are waiting for
+double ping_rtt = -1;
+int report_run = 0;
+int reports = 0;
+int64_t report_count = 0;
+int64_t report_bytes = 0;
+double report_span = 0;
+pid_t children[MAX_PROCESSES];
+int n_children = 0;
+
+
+void ping_handler(o2_msg_data_ptr msg, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    int tcp = argv[1]->i32;
+    o2_send_start();
+    o2_add_int32(argv[0]->i32);
+    o2_add_int32(tcp);
+    o2_add_double(argv[2]->d);
+    o2_add_blob(&argv[3]->b);
+    o2_send_finish(0, "/o2bench/pong", tcp);
+}
+
+
+void data_handler(o2_msg_data_ptr msg, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_time now = o2_local_time();
+    if (data_count == 0) {
+        data_first = now;
+    }
+    data_last = now;
+    data_count++;
+    data_bytes += argv[1]->b.size;
+}
+
+
+void report_handler(o2_msg_data_ptr msg, const char *types,
+                    o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_send_cmd("/o2bench/report", 0, "iihhd", argv[0]->i32,
+                server_process, data_count, data_bytes,
+                data_last - data_first);
+    data_count = 0;
+    data_bytes = 0;
+}
+
+
+void quit_handler(o2_msg_data_ptr msg, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    running = FALSE;
+}
+
+
+void pong_handler(o2_msg_data_ptr msg, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    if (argv[0]->i32 == ping_seq) { // otherwise it is late: ignore it
+        ping_rtt = o2_local_time() - argv[2]->d;
+    }
+}
+
+
+void client_report_handler(o2_msg_data_ptr msg, const char *types,
+                           o2_arg_ptr *argv, int argc, void *user_data)
+{
+    if (argv[0]->i32 != report_run) {
+        return;
+    }
+    reports++;
+    report_count += argv[2]->h;
+    report_bytes += argv[3]->h;
+    // processes receive in parallel, so the run takes the longest span
+    if (argv[4]->d > report_span) {
+        report_span = argv[4]->d;
+    }
+}
+
+
+void poll_for(double seconds)
+{
+    o2_time start = o2_local_time();
+    while (o2_local_time() < start + seconds) {
+        o2_poll();
+        usleep(1000);
+    }
+}
+
+
+int run_server(int index, pid_t parent)
+{
+    char path[64];
+    server_process = index;
+    o2_initialize("o2bench");
+    for (int k = 0; k < n_services; k++) {
+        sprintf(path, "bench%d_%d", index, k);
+        o2_service_new(path);
+        sprintf(path, "/bench%d_%d/ping", index, k);
+        o2_method_new(path, "iidb", &ping_handler, NULL, FALSE, TRUE);
+        sprintf(path, "/bench%d_%d/data", index, k);
+        o2_method_new(path, "ib", &data_handler, NULL, FALSE, TRUE);
+    }
+    sprintf(path, "/bench%d_0/report", index);
+    o2_method_new(path, "i", &report_handler, NULL, FALSE, TRUE);
+    sprintf(path, "/bench%d_0/quit", index);
+    o2_method_new(path, "", &quit_handler, NULL, FALSE, TRUE);
+
+    // by default, poll as fast as possible, like o2server.c, so that
+    // latency is not hidden by sleeping. A forked server also stops if
+    // the client dies.
+    int polls = 0;
+    while (running) {
+        o2_poll();
+        if (yield_usec) usleep(yield_usec);
+        if (parent && (++polls & 0xFFFF) == 0 && getppid() != parent) {
+            break;
+        }
+    }
+    poll_for(0.1); // let the quit reply and TCP shutdown go out
+    o2_finish();
+    return 0;
+}
+
+
+int wait_for_servers()
+{
+    char service[32];
+    o2_time start = o2_local_time();
+    for (int p = 0; p < n_processes; p++) {
+        for (int k = 0; k < n_services; k++) {
+            sprintf(service, "bench%d_%d", p, k);
+            int status;
+            while ((status = o2_status(service)) != O2_REMOTE_NOTIME &&
+                   status != O2_REMOTE) {
+                if (o2_local_time() > start + DISCOVERY_TIMEOUT) {
+                    fprintf(stderr, "o2bench: timeout waiting for %s\n",
+                            service);
+                    return O2_FAIL;
+                }
+                o2_poll();
+                usleep(2000);
+            }
+        }
+    }
+    // give servers time to discover the client's o2bench service
+    poll_for(0.5);
+    return O2_SUCCESS;
+}
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+// nearest-rank percentile of sorted samples
+double percentile(double *sorted, int n, double p)
+{
+    int i = (int) (p * n + 0.999999) - 1;
+    if (i < 0) i = 0;
+    if (i >= n) i = n - 1;
+    return sorted[i];
+}
+
+
+void measure_latency(FILE *out, int tcp, o2_blob_ptr payload)
+{
+    double *rtts = (double *) O2_MALLOC(sizeof(double) * latency_count);
+    int warmup = latency_count / 10 + 1;
+    int samples = 0;
+    int lost = 0;
+    for (int i = -warmup; i < latency_count; i++) {
+        ping_seq++;
+        ping_rtt = -1;
+        o2_send_start();
+        o2_add_int32(ping_seq);
+        o2_add_int32(tcp);
+        o2_add_double(o2_local_time());
+        o2_add_blob(payload);
+        o2_send_finish(0, ping_addresses[ping_seq % n_targets], tcp);
+        o2_time start = o2_local_time();
+        while (ping_rtt < 0 && o2_local_time() < start + PING_TIMEOUT) {
+            o2_poll();
+            if (yield_usec) usleep(yield_usec);
+        }
+        if (i < 0) {
+            continue;
+        } else if (ping_rtt < 0) {
+            lost++;
+        } else {
+            rtts[samples++] = ping_rtt * 1000000.0; // microseconds
+        }
+    }
+    fprintf(out, "      \"latency_us\": {\"samples\": %d, \"lost\": %d",
+            samples, lost);
+    if (samples > 0) {
+        double sum = 0;
+        for (int i = 0; i < samples; i++) {
+            sum += rtts[i];
+        }
+        qsort(rtts, samples, sizeof(double), &compare_doubles);
+        fprintf(out, ", \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, "
+                "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f",
+                rtts[0], sum / samples, percentile(rtts, samples, 0.5),
+                percentile(rtts, samples, 0.99),
+                percentile(rtts, samples, 0.999), rtts[samples - 1]);
+        fprintf(stderr, "  latency p50 %.1f us p99 %.1f us p99.9 %.1f us"
+                " (%d lost)\n", percentile(rtts, samples, 0.5),
+                percentile(rtts, samples, 0.99),
+                percentile(rtts, samples, 0.999), lost);
+    }
+    fprintf(out, "},\n");
+    O2_FREE(rtts);
+}
+
+
+int measure_throughput(FILE *out, int tcp, o2_blob_ptr payload)
+{
+    report_run++;
+    reports = 0;
+    report_count = 0;
+    report_bytes = 0;
+    report_span = 0;
+    int failed = 0;
+    o2_time start = o2_local_time();
+    for (int i = 0; i < msg_count; i++) {
+        o2_send_start();
+        o2_add_int32(i);
+        o2_add_blob(payload);
+        if (o2_send_finish(0, data_addresses[i % n_targets], tcp)) {
+            failed++;
+        }
+        o2_poll();
+    }
+    double send_time = o2_local_time() - start;
+    poll_for(SETTLE_TIME);
+
+    char path[64];
+    for (int p = 0; p < n_processes; p++) {
+        sprintf(path, "/bench%d_0/report", p);
+        o2_send_cmd(path, 0, "i", report_run);
+    }
+    start = o2_local_time();
+    while (reports < n_processes) {
+        if (o2_local_time() > start + REPORT_TIMEOUT) {
+            fprintf(stderr, "o2bench: timeout waiting for reports\n");
+            return O2_FAIL;
+        }
+        o2_poll();
+        usleep(1000);
+    }
+    double send_rate = (send_time > 0 ? msg_count / send_time : 0);
+    double recv_rate = (report_span > 0 ? report_count / report_span : 0);
+    double recv_mbytes = (report_span > 0 ?
+                          report_bytes / report_span / 1000000.0 : 0);
+    fprintf(out, "      \"throughput\": {\"sent\": %d, \"send_failed\": %d,"
+            " \"received\": %lld, \"loss\": %.6f, "
+            "\"send_msgs_per_sec\": %.1f, \"recv_msgs_per_sec\": %.1f, "
+            "\"recv_mbytes_per_sec\": %.3f}\n", msg_count, failed,
+            (long long) report_count,
+            1.0 - (double) report_count / msg_count,
+            send_rate, recv_rate, recv_mbytes);
+    fprintf(stderr, "  throughput %.0f msgs/s sent, %.0f msgs/s received,"
+            " %.2f MB/s (%lld of %d received)\n", send_rate, recv_rate,
+            recv_mbytes, (long long) report_count, msg_count);
+    return O2_SUCCESS;
+}
+
+
+int run_client(FILE *out)
+{
+    char path[64];
+    o2_initialize("o2bench");
+    o2_service_new("o2bench");
+    o2_method_new("/o2bench/pong", "iidb", &pong_handler, NULL, FALSE, TRUE);
+    o2_method_new("/o2bench/report", "iihhd", &client_report_handler,
+                  NULL, FALSE, TRUE);
+
+    // build addresses once so that sending does no string formatting
+    n_targets = n_processes * n_services;
+    ping_addresses = (char **) O2_MALLOC(sizeof(char *) * n_targets);
+    data_addresses = (char **) O2_MALLOC(sizeof(char *) * n_targets);
+    for (int i = 0; i < n_targets; i++) {
+        sprintf(path, "/bench%d_%d/ping", i / n_services, i % n_services);
+        ping_addresses[i] = (char *) O2_MALLOC(strlen(path) + 1);
+        strcpy(ping_addresses[i], path);
+        sprintf(path, "/bench%d_%d/data", i / n_services, i % n_services);
+        data_addresses[i] = (char *) O2_MALLOC(strlen(path) + 1);
+        strcpy(data_addresses[i], path);
+    }
+
+    int rslt = wait_for_servers();
+    if (rslt == O2_SUCCESS) {
+        fprintf(out, "{\n  \"benchmark\": \"o2bench\",\n"
+                "  \"unix_time\": %lld,\n  \"processes\": %d,\n"
+                "  \"services\": %d,\n  \"count\": %d,\n"
+                "  \"latency_count\": %d,\n  \"yield_usec\": %d,\n"
+                "  \"results\": [", (long long) time(NULL), n_processes,
+                n_services, msg_count, latency_count, yield_usec);
+        int first = TRUE;
+        for (int tcp = FALSE; tcp <= TRUE && rslt == O2_SUCCESS; tcp++) {
+            if ((tcp && !do_tcp) || (!tcp && !do_udp)) {
+                continue;
+            }
+            int size = MIN_SIZE;
+            while (rslt == O2_SUCCESS) {
+                if (size > max_size) {
+                    size = max_size;
+                }
+                fprintf(stderr, "%s, %d byte payload:\n",
+                        tcp ? "tcp" : "udp", size);
+                o2_blob_ptr payload = o2_blob_new(size);
+                memset(payload->data, 0x55, size);
+                fprintf(out, "%s\n    {\n      \"transport\": \"%s\",\n"
+                        "      \"payload\": %d,\n", first ? "" : ",",
+                        tcp ? "tcp" : "udp", size);
+                first = FALSE;
+                measure_latency(out, tcp, payload);
+                rslt = measure_throughput(out, tcp, payload);
+                fprintf(out, "    }");
+                O2_FREE(payload);
+                if (size >= max_size) {
+                    break;
+                }
+                size *= 4;
+            }
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+    for (int p = 0; p < n_processes; p++) {
+        sprintf(path, "/bench%d_0/quit", p);
+        o2_send_cmd(path, 0, "");
+    }
+    poll_for(0.2);
+    for (int i = 0; i < n_targets; i++) {
+        O2_FREE(ping_addresses[i]);
+        O2_FREE(data_addresses[i]);
+    }
+    O2_FREE(ping_addresses);
+    O2_FREE(data_addresses);
+    o2_finish();
+    return rslt;
+}
+
+
+void usage()
+{
+    fprintf(stderr,
+        "Usage: o2bench [options]\n"
+        "  -p n      number of server processes (default 1)\n"
+        "  -s n      services per server process (default 1)\n"
+        "  -n n      messages per throughput measurement (default 10000)\n"
+        "  -l n      round trips per latency measurement (default 1000)\n"
+        "  -m bytes  largest payload, sizes go 16, 64, 256, ... "
+        "(default 32768)\n"
+        "  -t udp|tcp|both  transports to measure (default both)\n"
+        "  -o file   write JSON results to file (default stdout)\n"
+        "  -S index  only run server process index (for other hosts)\n"
+        "  -c        only run the client, servers were started with -S\n"
+        "  -y usec   sleep between polls instead of busy polling; use this\n"
+        "            when processes outnumber CPU cores\n"
+        "  -d flags  O2 debug flags (see o2.h)\n");
+    exit(1);
+}
+
+
+int main(int argc, char * const argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "p:s:n:l:m:t:o:S:cy:d:")) != -1) {
+        switch (c) {
+          case 'p': n_processes = atoi(optarg); break;
+          case 's': n_services = atoi(optarg); break;
+          case 'n': msg_count = atoi(optarg); break;
+          case 'l': latency_count = atoi(optarg); break;
+          case 'm': max_size = atoi(optarg); break;
+          case 't':
+            do_udp = (strcmp(optarg, "tcp") != 0);
+            do_tcp = (strcmp(optarg, "udp") != 0);
+            break;
+          case 'o': outfile = optarg; break;
+          case 'S': server_index = atoi(optarg); break;
+          case 'c': client_only = TRUE; break;
+          case 'y': yield_usec = atoi(optarg); break;
+          case 'd': o2_debug_flags(optarg); break;
+          default: usage();
+        }
+    }
+    if (n_processes < 1 || n_processes > MAX_PROCESSES ||
+        n_services < 1 || msg_count < 1 || latency_count < 1 ||
+        max_size < MIN_SIZE || max_size > MAX_SIZE) {
+        usage();
+    }
+    if (server_index >= 0) {
+        return run_server(server_index, 0);
+    }
+
+    if (!client_only) {
+        pid_t parent = getpid();
+        for (int p = 0; p < n_processes; p++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                exit(run_server(p, parent));
+            } else if (pid < 0) {
+                perror("o2bench fork");
+                return 1;
+            }
+            children[n_children++] = pid;
+        }
+    }
+
+    FILE *out = stdout;
+    if (outfile && !(out = fopen(outfile, "w"))) {
+        perror(outfile);
+        return 1;
+    }
+    int rslt = run_client(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (int i = 0; i < n_children; i++) {
+        waitpid(children[i], NULL, 0);
+    }
+    return (rslt == O2_SUCCESS ? 0 : 1);
+}
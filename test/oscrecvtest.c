@@ -52,11 +52,13 @@ void osc_i_handler(o2_msg_data_ptr data, const char *types,
 int main(int argc, const char * argv[])
 {
     printf("Usage: oscrecvtest [flags] "
-           "(see o2.h for flags, use a for all, also u for UDP)\n");
+           "(see o2.h for flags, use a for all, also u for UDP, "
+           "L for SLIP over TCP)\n");
     int tcpflag = TRUE;
     if (argc == 2) {
         o2_debug_flags(argv[1]);
         tcpflag = (strchr(argv[1], 'u') == NULL);
+        if (tcpflag && strchr(argv[1], 'L')) tcpflag = O2_OSC_SLIP;
     }
     if (argc > 2) {
         printf("WARNING: o2server ignoring extra command line argments\n");
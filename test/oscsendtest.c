@@ -17,13 +17,15 @@
 int main(int argc, const char * argv[])
 {
     printf("Usage: oscsendtest [flags] (see o2.h for flags, "
-           "use a for all, also u for UDP, M for master)\n");
+           "use a for all, also u for UDP, L for SLIP over TCP, "
+           "M for master)\n");
 
     int tcpflag = TRUE;
     int master = FALSE;
     if (argc == 2) {
         o2_debug_flags(argv[1]);
         tcpflag = (strchr(argv[1], 'u') == NULL);
+        if (tcpflag && strchr(argv[1], 'L')) tcpflag = O2_OSC_SLIP;
         master = (strchr(argv[1], 'M') != NULL);
     }
     if (argc > 2) {
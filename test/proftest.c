@@ -0,0 +1,110 @@
+// proftest.c -- test handler profiling (requires O2_PROFILE_HANDLERS)
+//
+// Deliver messages to fast and slow handlers and check the call
+// counts, histograms and slow call counts from o2_profile_get().
+
+#include <stdio.h>
+#include "o2.h"
+#include "assert.h"
+
+#ifdef WIN32
+#include "usleep.h" // special windows implementation of sleep/usleep
+#else
+#include <unistd.h>
+#endif
+
+#define N_FAST 100
+#define N_SLOW 3
+#define N_SERVICE 5
+
+int fast_count = 0;
+int slow_count = 0;
+int service_count = 0;
+
+
+void fast_handler(o2_msg_data_ptr data, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    fast_count++;
+}
+
+
+void slow_handler(o2_msg_data_ptr data, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    usleep(20000); // 20ms is over the 10ms threshold
+    slow_count++;
+}
+
+
+void service_handler(o2_msg_data_ptr data, const char *types,
+                     o2_arg_ptr *argv, int argc, void *user_data)
+{
+    service_count++;
+}
+
+
+int64_t histogram_sum(o2_handler_profile_ptr profile)
+{
+    int64_t sum = 0;
+    for (int i = 0; i < O2_PROFILE_BINS; i++) {
+        sum += profile->histogram[i];
+    }
+    return sum;
+}
+
+
+int main(int argc, const char * argv[])
+{
+    o2_initialize("test");
+    o2_service_new("one");
+    o2_method_new("/one/fast", "i", &fast_handler, NULL, FALSE, TRUE);
+    o2_method_new("/one/slow", "", &slow_handler, NULL, FALSE, TRUE);
+    o2_service_new("two");
+    o2_method_new("/two", NULL, &service_handler, NULL, FALSE, FALSE);
+    o2_profile_slow(0.01);
+
+    for (int i = 0; i < N_FAST; i++) {
+        o2_send_cmd("/one/fast", 0, "i", i);
+    }
+    for (int i = 0; i < N_SLOW; i++) {
+        o2_send_cmd("/one/slow", 0, "");
+    }
+    for (int i = 0; i < N_SERVICE; i++) {
+        o2_send_cmd("/two/anything", 0, "i", i);
+    }
+    o2_send_cmd("!one/fast", 0, "i", 0); // profiled separately
+    o2_poll();
+    assert(fast_count == N_FAST + 1);
+    assert(slow_count == N_SLOW);
+    assert(service_count == N_SERVICE);
+
+    o2_handler_profile_ptr fast = o2_profile_get("/one/fast");
+    assert(fast);
+    assert(fast->calls == N_FAST);
+    assert(histogram_sum(fast) == N_FAST);
+    assert(fast->max <= fast->total);
+
+    o2_handler_profile_ptr slow = o2_profile_get("/one/slow");
+    assert(slow);
+    assert(slow->calls == N_SLOW);
+    assert(slow->slow == N_SLOW);
+    assert(slow->max >= 0.02);
+    assert(histogram_sum(slow) == N_SLOW);
+    // 20ms is longer than 2^14us, so these are in the last bin
+    assert(slow->histogram[O2_PROFILE_BINS - 1] == N_SLOW);
+
+    o2_handler_profile_ptr service = o2_profile_get("/two");
+    assert(service);
+    assert(service->calls == N_SERVICE);
+
+    assert(o2_profile_get("/one/none") == NULL);
+    o2_profile_print();
+
+    o2_profile_reset();
+    assert(fast->calls == 0 && slow->calls == 0 && service->calls == 0);
+
+    o2_finish();
+    printf("DONE\n");
+    return 0;
+}
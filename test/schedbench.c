@@ -0,0 +1,212 @@
+//  schedbench.c - scheduler stress benchmark and correctness check
+//
+//  This program replaces the O2 clock with a virtual clock (see
+//  o2_clock_set()) so that time only moves when we say so. For each
+//  workload, it builds count messages, inserts them all with
+//  o2_schedule(), then advances the virtual clock and calls
+//  o2_sched_poll() until every message is delivered. It prints the
+//  cost per message of inserting and of dispatching (which includes
+//  delivery to a local handler and freeing the message) and the memory
+//  used by pending messages. Workloads:
+//    - uniform: timestamps spread evenly over 10s, polled every 1ms
+//    - burst: every timestamp within one 10ms scheduler bin, many of
+//      them equal, polled every 1ms
+//    - far: timestamps 1000s to 1100s in the future, reached with one
+//      large time jump followed by random jumps of up to 3s, which is
+//      more than the 1.28s wheel, so wrap-around logic is exercised
+//  The handler asserts that no message is delivered early (after the
+//  poll that reached its time, never before), none is delivered late
+//  (a poll whose time reached it would have delivered it), messages
+//  are delivered in time order, and messages with equal timestamps are
+//  delivered in the order they were scheduled.
+//
+//  Usage: schedbench [count] (the insert cost grows with the number of
+//  pending messages per bin, so large counts can take a long time,
+//  especially for the burst workload)
+
+#include "o2.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+#include <stddef.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+// internal headers for o2_schedule(), o2_sched_poll(), o2_local_now, etc.
+#include "o2_internal.h"
+#include "o2_sched.h"
+#include "o2_clock.h"
+
+#define N_DEFAULT 20000
+
+#define UNIFORM 0
+#define BURST 1
+#define FAR 2
+
+int n = N_DEFAULT;
+
+o2_time virtual_time = 1000.0; // what the clock callback returns
+
+o2_time poll_prev; // time of the previous o2_sched_poll()
+o2_time poll_now;  // time of the current o2_sched_poll()
+
+int delivered = 0;
+o2_time last_timestamp = 0;
+int64_t last_seq = -1;
+
+unsigned seed = 1;
+
+
+o2_time virtual_clock(void *rock)
+{
+    return virtual_time;
+}
+
+
+// a small portable random number generator in [0, 1) so that
+// runs are repeatable
+double random_unit()
+{
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) & 0xFFFFFF) / (double) 0x1000000;
+}
+
+
+void sched_handler(o2_msg_data_ptr msg, const char *types,
+                   o2_arg_ptr *argv, int argc, void *user_data)
+{
+    o2_time ts = msg->timestamp;
+    int64_t seq = argv[0]->h;
+    assert(ts <= poll_now);   // not early
+    assert(ts > poll_prev);   // not late
+    assert(ts >= last_timestamp); // in time order
+    if (ts == last_timestamp) {
+        assert(seq > last_seq); // FIFO for equal times
+    }
+    last_timestamp = ts;
+    last_seq = seq;
+    delivered++;
+}
+
+
+// advance the virtual clock by dt and dispatch whatever is due
+void advance(o2_time dt)
+{
+    virtual_time += dt;
+    o2_local_now = o2_local_time();
+    o2_global_now = o2_local_to_global(o2_local_now);
+    poll_prev = poll_now;
+    poll_now = o2_global_now;
+    o2_sched_poll();
+}
+
+
+// the O2 clock is virtual, so benchmarks are timed with the system clock
+double real_time()
+{
+#ifndef WIN32
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1.0E-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+long max_rss_kb()
+{
+#ifndef WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+
+// schedule and dispatch n messages with timestamps chosen by workload
+void run(const char *name, int workload)
+{
+    o2_time now = o2_time_get();
+    poll_now = now;
+    delivered = 0;
+    last_timestamp = 0;
+    last_seq = -1;
+
+    // build all messages first so that only o2_schedule() is timed
+    o2_message_ptr *msgs = (o2_message_ptr *)
+            O2_MALLOC(sizeof(o2_message_ptr) * n);
+    int64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        o2_time ts;
+        if (workload == UNIFORM) {
+            ts = now + 0.001 + random_unit() * 10.0;
+        } else if (workload == BURST) { // 100 distinct times in 1ms
+            ts = now + 0.5 + ((int) (random_unit() * 100)) * 0.00001;
+        } else { // FAR
+            ts = now + 1000.0 + random_unit() * 100.0;
+        }
+        o2_send_start();
+        o2_add_int64(i);
+        msgs[i] = o2_message_finish(ts, "/sched/t", TRUE);
+        bytes += offsetof(o2_message, data) + msgs[i]->allocated;
+    }
+
+    o2_time start = real_time();
+    for (int i = 0; i < n; i++) {
+        o2_schedule(&o2_gtsched, msgs[i]);
+    }
+    double insert_time = real_time() - start;
+    O2_FREE(msgs);
+    long rss = max_rss_kb();
+
+    int polls = 0;
+    start = real_time();
+    if (workload == FAR) {
+        advance(999.0); // jump, dispatched 1s at a time
+        polls++;
+    }
+    while (delivered < n) {
+        if (workload == FAR) {
+            advance(0.001 + random_unit() * 3.0);
+        } else {
+            advance(0.001);
+        }
+        polls++;
+        assert(polls < 100000000);
+    }
+    double dispatch_time = real_time() - start;
+    assert(delivered == n);
+
+    printf("%-8s %9.1f ns/insert %9.1f ns/dispatch %6.1f bytes/msg "
+           "%7.1f MB max rss %d polls\n", name, insert_time * 1.0E9 / n,
+           dispatch_time * 1.0E9 / n, (double) bytes / n, rss / 1024.0,
+           polls);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    printf("Usage: schedbench [count] (default count is %d)\n", N_DEFAULT);
+    if (argc == 2) {
+        n = atoi(argv[1]);
+        if (n <= 0) n = N_DEFAULT;
+    }
+    o2_initialize("test");
+    o2_service_new("sched");
+    o2_method_new("/sched/t", "h", &sched_handler, NULL, FALSE, TRUE);
+    o2_clock_set(&virtual_clock, NULL); // also starts o2_gtsched
+
+    printf("%d messages per workload\n", n);
+    run("uniform", UNIFORM);
+    run("burst", BURST);
+    run("far", FAR);
+
+    o2_finish();
+    printf("SCHEDBENCH DONE\n");
+    return 0;
+}
@@ -0,0 +1,207 @@
+// statstest.c -- test o2_stats_get() and the /_o2/stats query
+//
+// Messages are sent to a local service with a tap, through an OSC
+// delegate back to an OSC port of this process, and to a service that
+// does not exist. Then the counters are checked, first with
+// o2_stats_get() and then by sending /_o2/stats and checking replies.
+
+#include <stdio.h>
+#include "o2.h"
+#include "assert.h"
+#include "string.h"
+
+#ifdef WIN32
+#include "usleep.h" // special windows implementation of sleep/usleep
+#else
+#include <unistd.h>
+#endif
+
+#define N 100
+#define OSC_PORT 8112
+#define OSC_MSG_LEN 12 // "/i\0\0" ",i\0\0" and an int32
+
+int one_count = 0;
+int copy_count = 0;
+int oscin_count = 0;
+
+int global_replies = 0;
+int socket_replies = 0;
+int service_replies = 0;
+int end_count = -1; // number of replies reported by /end
+int one_delivered = -1; // "one" delivered count from /service reply
+int oscin_msgs_in = -1; // from /socket reply for the OSC port
+
+
+void one_handler(o2_msg_data_ptr data, const char *types,
+                 o2_arg_ptr *argv, int argc, void *user_data)
+{
+    one_count++;
+}
+
+
+void copy_handler(o2_msg_data_ptr data, const char *types,
+                  o2_arg_ptr *argv, int argc, void *user_data)
+{
+    copy_count++;
+}
+
+
+void oscin_handler(o2_msg_data_ptr data, const char *types,
+                   o2_arg_ptr *argv, int argc, void *user_data)
+{
+    assert(argv[0]->i32 == oscin_count);
+    oscin_count++;
+}
+
+
+void global_handler(o2_msg_data_ptr data, const char *types,
+                    o2_arg_ptr *argv, int argc, void *user_data)
+{
+    assert(argv[1]->h == 3); // dropped_no_service
+    assert(argv[2]->h == 0); // dropped_queue_full
+    assert(argv[4]->i32 >= 2); // scheduled, including O2 housekeeping
+    assert(argv[5]->i32 >= argv[6]->i32); // pool_size >= pool_free
+    global_replies++;
+}
+
+
+void socket_handler(o2_msg_data_ptr data, const char *types,
+                    o2_arg_ptr *argv, int argc, void *user_data)
+{
+    if (strcmp(argv[2]->s, "oscin") == 0) {
+        assert(argv[1]->i32 == O2_STATS_SOCKET_OSC_UDP);
+        oscin_msgs_in = (int) argv[3]->h;
+    }
+    socket_replies++;
+}
+
+
+void service_handler(o2_msg_data_ptr data, const char *types,
+                     o2_arg_ptr *argv, int argc, void *user_data)
+{
+    if (strcmp(argv[1]->s, "one") == 0) {
+        one_delivered = (int) argv[2]->h;
+    }
+    service_replies++;
+}
+
+
+void end_handler(o2_msg_data_ptr data, const char *types,
+                 o2_arg_ptr *argv, int argc, void *user_data)
+{
+    end_count = argv[1]->i32;
+}
+
+
+o2_service_stats_ptr find_service(o2_stats_ptr stats, const char *name)
+{
+    for (int i = 0; i < stats->service_count; i++) {
+        if (strcmp(stats->services[i].name, name) == 0) {
+            return &stats->services[i];
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, const char * argv[])
+{
+    o2_initialize("test");
+    o2_clock_set(NULL, NULL); // so that messages can be scheduled
+    o2_service_new("one");
+    o2_method_new("/one/i", "i", &one_handler, NULL, FALSE, TRUE);
+    o2_method_new("/one/st/global", "shhiiii", &global_handler, NULL,
+                  FALSE, TRUE);
+    o2_method_new("/one/st/socket", "sishhhhhh", &socket_handler, NULL,
+                  FALSE, TRUE);
+    o2_method_new("/one/st/service", "sshh", &service_handler, NULL,
+                  FALSE, TRUE);
+    o2_method_new("/one/st/end", "si", &end_handler, NULL, FALSE, TRUE);
+    o2_service_new("copy");
+    o2_method_new("/copy/i", "i", &copy_handler, NULL, FALSE, TRUE);
+    o2_tap("one", "copy");
+    o2_service_new("oscin");
+    o2_method_new("/oscin/i", "i", &oscin_handler, NULL, FALSE, TRUE);
+    assert(o2_osc_port_new("oscin", OSC_PORT, FALSE) == O2_SUCCESS);
+    assert(o2_osc_delegate("oscout", "127.0.0.1", OSC_PORT, FALSE) ==
+           O2_SUCCESS);
+    o2_poll();
+
+    for (int i = 0; i < N; i++) {
+        o2_send_cmd("/one/i", 0, "i", i);
+        o2_send("/oscout/i", 0, "i", i);
+        o2_poll();
+    }
+    for (int i = 0; i < 3; i++) {
+        o2_send("/nowhere/i", 0, "i", i);
+    }
+    // these stay in the scheduler
+    o2_send("/one/i", o2_time_get() + 1000, "i", 0);
+    o2_send("/one/i", o2_time_get() + 1000, "i", 0);
+    while (oscin_count < N) {
+        o2_poll();
+        usleep(1000);
+    }
+    assert(one_count == N);
+    assert(copy_count == N);
+
+    o2_stats stats;
+    assert(o2_stats_get(&stats) == O2_SUCCESS);
+    assert(stats.dropped_no_service == 3);
+    assert(stats.dropped_queue_full == 0);
+    assert(stats.pending == 0);
+    assert(stats.scheduled >= 2); // O2 also schedules discovery, etc.
+    assert(stats.pool_size >= stats.pool_free);
+    o2_service_stats_ptr ss = find_service(&stats, "one");
+    assert(ss && ss->delivered == N && ss->tapped == N);
+    ss = find_service(&stats, "copy");
+    assert(ss && ss->delivered == N && ss->tapped == 0);
+    ss = find_service(&stats, "oscout");
+    assert(ss && ss->delivered == N);
+    ss = find_service(&stats, "oscin");
+    assert(ss && ss->delivered == N);
+    int found_osc_socket = FALSE;
+    for (int i = 0; i < stats.socket_count; i++) {
+        o2_socket_stats_ptr sock = &stats.sockets[i];
+        printf("socket tag %d name \"%s\" in %lld/%lld out %lld/%lld "
+               "partial %lld errors %lld\n", sock->tag, sock->name,
+               (long long) sock->msgs_in, (long long) sock->bytes_in,
+               (long long) sock->msgs_out, (long long) sock->bytes_out,
+               (long long) sock->partial_reads,
+               (long long) sock->send_errors);
+        assert(sock->tag >= O2_STATS_SOCKET_UDP &&
+               sock->tag <= O2_STATS_SOCKET_OSC_TCP_CLIENT);
+        if (strcmp(sock->name, "oscin") == 0) {
+            assert(sock->tag == O2_STATS_SOCKET_OSC_UDP);
+            assert(sock->msgs_in == N);
+            assert(sock->bytes_in == N * OSC_MSG_LEN);
+            found_osc_socket = TRUE;
+        }
+        assert(sock->send_errors == 0);
+    }
+    assert(found_osc_socket);
+    int socket_count = stats.socket_count;
+    int service_count = stats.service_count;
+    o2_stats_free(&stats);
+    assert(stats.sockets == NULL && stats.services == NULL);
+    printf("o2_stats_get: %d sockets, %d services\n",
+           socket_count, service_count);
+
+    // ask for the same information with a message
+    o2_send_cmd("/_o2/stats", 0, "s", "/one/st");
+    while (end_count < 0) {
+        o2_poll();
+        usleep(1000);
+    }
+    assert(global_replies == 1);
+    assert(socket_replies == socket_count);
+    assert(service_replies == service_count);
+    assert(end_count == socket_count + service_count);
+    assert(one_delivered == N);
+    assert(oscin_msgs_in == N);
+    printf("/_o2/stats: %d replies\n", end_count);
+
+    o2_finish();
+    printf("DONE\n");
+    return 0;
+}
@@ -1020,6 +1020,32 @@ void service_fourtap(o2_msg_data_ptr msg, const char *types,
 }
 
 
+// a service delegated to OSC is tapped by osctap1 and osctap2. The
+// OSC messages come back through an OSC port to oscin.
+#define OSC_TAP_COUNT 10000
+int osc_in_count = 0;
+int osc_tap_count = 0;
+
+void service_oscin(o2_msg_data_ptr data, const char *types,
+                   o2_arg_ptr *argv, int argc, void *user_data)
+{
+    assert(argc == 1);
+    assert(argv[0]->i == 1234);
+    osc_in_count++;
+}
+
+
+void service_osctap(o2_msg_data_ptr data, const char *types,
+                    o2_arg_ptr *argv, int argc, void *user_data)
+{
+    assert(argc == 1);
+    assert(argv[0]->i == 1234);
+    assert(strcmp(data->address, "/osctap1/i") == 0 ||
+           strcmp(data->address, "/osctap2/i") == 0);
+    osc_tap_count++;
+}
+
+
 void send_the_message()
 {
     while (!got_the_message) {
@@ -1210,6 +1236,32 @@ int main(int argc, const char * argv[])
     send_the_message();
     o2_send("/four/i", 0, "d", 1234.0);
     send_the_message();
+
+    o2_service_new("oscin");
+    o2_method_new("/oscin/i", "i", &service_oscin, NULL, FALSE, TRUE);
+    assert(o2_osc_port_new("oscin", 8110, FALSE) == O2_SUCCESS);
+    assert(o2_osc_delegate("oscout", "localhost", 8110, FALSE) ==
+           O2_SUCCESS);
+    o2_tap("oscout", "osctap1");
+    o2_tap("oscout", "osctap2");
+    o2_method_new("/osctap1/i", "i", &service_osctap, NULL, FALSE, TRUE);
+    o2_method_new("/osctap2/i", "i", &service_osctap, NULL, FALSE, TRUE);
+    o2_send("/oscout/i", 0, "i", 1234);
+    while (osc_in_count < 1) {
+        o2_poll();
+    }
+    assert(osc_tap_count == 2);
+    printf("oscout message was sent to OSC and tapped twice\n");
+    osc_tap_count = 0;
+    o2_time start = o2_local_time();
+    for (int i = 0; i < OSC_TAP_COUNT; i++) {
+        o2_send("/oscout/i", 0, "i", 1234);
+        if (i % 100 == 0) o2_poll(); // keep up with OSC input
+    }
+    o2_time elapsed = o2_local_time() - start;
+    assert(osc_tap_count == 2 * OSC_TAP_COUNT);
+    printf("sent %d tapped OSC messages in %gs (%g per second)\n",
+           OSC_TAP_COUNT, elapsed, OSC_TAP_COUNT / elapsed);
     printf("DONE\n");
     o2_finish();
     return 0;
@@ -0,0 +1,98 @@
+// tracetest.c -- test message tracing (requires O2_TRACE)
+//
+// Send immediate and scheduled messages to a local service, write the
+// trace as Chrome trace JSON and check the events in the file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "o2.h"
+#include "assert.h"
+#include "string.h"
+
+#ifdef WIN32
+#include "usleep.h" // special windows implementation of sleep/usleep
+#else
+#include <unistd.h>
+#endif
+
+#define N 10
+#define TRACE_FILE "tracetest.json"
+
+int msg_count = 0;
+
+
+void one_handler(o2_msg_data_ptr data, const char *types,
+                 o2_arg_ptr *argv, int argc, void *user_data)
+{
+    msg_count++;
+}
+
+
+// count occurrences of pattern in s
+int count(const char *s, const char *pattern)
+{
+    int n = 0;
+    while ((s = strstr(s, pattern))) {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+
+int main(int argc, const char * argv[])
+{
+    o2_initialize("test");
+    o2_clock_set(NULL, NULL); // so that messages can be scheduled
+    o2_service_new("one");
+    o2_method_new("/one/i", "i", &one_handler, NULL, FALSE, TRUE);
+    o2_poll();
+
+    assert(o2_trace_start(0) == O2_FAIL);
+    assert(o2_trace_start(1000) == O2_SUCCESS);
+    for (int i = 0; i < N; i++) {
+        o2_send_cmd("/one/i", 0, "i", i);
+        o2_send_cmd("/one/i", o2_time_get() + 0.05, "i", i + N);
+    }
+    while (msg_count < 2 * N) {
+        o2_poll();
+        usleep(1000);
+    }
+    o2_trace_stop();
+    o2_send_cmd("/one/i", 0, "i", 0); // not traced
+    assert(msg_count == 2 * N + 1);
+    assert(o2_trace_write(TRACE_FILE) == O2_SUCCESS);
+    o2_finish();
+
+    // read the trace and check it
+    FILE *inf = fopen(TRACE_FILE, "r");
+    assert(inf);
+    char *json = malloc(1000000);
+    size_t len = fread(json, 1, 999999, inf);
+    json[len] = 0;
+    fclose(inf);
+    assert(strstr(json, "{\"traceEvents\":["));
+    // O2 traces its own messages too, so only count /one/i events
+    assert(count(json, "{\"name\":\"/one/i\",\"cat\":\"send\"") == 2 * N);
+    assert(count(json, "{\"name\":\"/one/i\",\"cat\":\"schedule\"") == N);
+    assert(count(json, "{\"name\":\"/one/i\",\"cat\":\"dispatch\"") ==
+           2 * N);
+    assert(count(json, "{\"name\":\"/one/i\",\"ph\":\"E\"") == 2 * N);
+    // the flow that starts at each send must finish with the same ID
+    const char *s = json;
+    while ((s = strstr(s, "{\"name\":\"/one/i\",\"cat\":\"send\""))) {
+        char id[32];
+        const char *idp = strstr(s, "\"id\":\"");
+        assert(idp);
+        memcpy(id, idp, 16);
+        id[16] = 0; // "id":"xxxxxxxx"
+        char finish[64];
+        snprintf(finish, 64, "\"ph\":\"f\",\"bp\":\"e\",%s", id);
+        assert(strstr(json, finish));
+        s++;
+    }
+    free(json);
+    remove(TRACE_FILE);
+    printf("DONE\n");
+    return 0;
+}